@@ -241,6 +241,13 @@ TESTS = r"""
 (aeq 'member '(3 4) (member 3 '(1 2 3 4) :test eq))
 (aeq 'member '("three" "four") (member "three" '("one" "two" "three" "four") :test string=))
 (aeq 'member '("two" "three" "four") (member "three" '("one" "two" "three" "four") :test string<))
+(aeq 'sort '(1 2 3) (sort (list 3 1 2) #'<))
+(aeq 'sort nil (sort nil #'<))
+(aeq 'sort '("a" "b" "c") (sort (list "b" "a" "c") #'string<))
+(aeq 'sort '((0 b) (0 d) (1 a) (1 c) (1 e)) (sort (list '(1 a) '(0 b) '(1 c) '(0 d) '(1 e)) #'< :key #'car))
+(aeq 'sort '((1 a) (1 c) (1 e) (0 b) (0 d)) (sort (list '(1 a) '(0 b) '(1 c) '(0 d) '(1 e)) #'> :key #'car))
+(aeq 'sort '(200 0 100) (let (l) (dotimes (i 200) (push (mod (* i 37) 101) l)) (let ((s (sort l #'<))) (list (length s) (first s) (nth 199 s)))))
+(aeq 'sort '(9 7 1) (let ((v (make-array 5 :initial-element 0))) (setf (aref v 0) 5 (aref v 1) 2 (aref v 2) 9 (aref v 3) 1 (aref v 4) 7) (sort v #'>) (list (aref v 0) (aref v 1) (aref v 4))))
 
 #| map operations |#
 
@@ -344,6 +351,42 @@ TESTS = r"""
 
 (aeq 'stream "<string-stream 0>" (with-output-to-string (s) (princ s s)))
 (aeq 'stream "12 23 34" (with-output-to-string (st) (format st "~a ~a ~a" 12 23 34)))
+(aeq 'stream '(abc xyz (1 2)) (with-input-from-string (a "abc(1 2)") (with-input-from-string (b "xyz") (list (read a) (read b) (read a)))))
+(aeq 'stream '(12 (9) (3)) (with-input-from-string (a "12(3)") (list (read a) (read-from-string "(9)") (read a))))
+(aeq 'stream '(xyz nothing) (let ((old (with-input-from-string (a "abc") a))) (with-input-from-string (b "xyz") (list (read b) (ignore-errors (read old))))))
+(aeq 'write-object '((nil 200 -70000 "hi" #\a 1.5 sym (1 . 2)) 99999999999999999999 nil) (progn (with-flash-file (s "obj.bin" 2) (write-object '(nil 200 -70000 "hi" #\a 1.5 sym (1 . 2)) s) (write-object 99999999999999999999 s)) (with-flash-file (s "obj.bin") (list (read-object s) (read-object s) (read-object s)))))
+(aeq 'write-object '(((1 2) (1 2)) t) (let ((x (list 1 2))) (with-flash-file (s "obj.bin" 2) (write-object (list x x) s)) (with-flash-file (s "obj.bin") (let ((y (read-object s))) (list y (eq (first y) (second y)))))))
+(aeq 'write-object '(1 2 t) (let ((x (list 1 2))) (setf (cdr (cdr x)) x) (with-flash-file (s "obj.bin" 2) (write-object x s)) (with-flash-file (s "obj.bin") (let ((y (read-object s))) (list (first y) (second y) (eq y (cddr y)))))))
+(aeq 'write-object 7 (let ((a (make-array 3 :initial-element 7))) (with-flash-file (s "obj.bin" 2) (write-object a s)) (with-flash-file (s "obj.bin") (aref (read-object s) 2))))
+(aeq 'write-object t (delete-file "obj.bin"))
+(aeq 'write-object nothing (ignore-errors (with-output-to-string (s) (write-object '(nil 200) s))))
+(aeq 'read-object nothing (ignore-errors (with-input-from-string (s "abc") (read-object s))))
+(aeq 'read-sequence '(3 1 0 2) (let ((v (make-array 3 :initial-element 1)) (w (make-array 3))) (setf (aref v 1) 0 (aref v 2) 2) (with-flash-file (s "seq.bin" 2) (write-sequence v s)) (with-flash-file (s "seq.bin") (list (read-sequence w s) (aref w 0) (aref w 1) (aref w 2)))))
+(aeq 'read-sequence nothing (ignore-errors (let ((str (concatenate 'string "xxx"))) (with-flash-file (s "seq.bin") (read-sequence str s)))))
+(aeq 'read-sequence '(3 "abcx") (let ((str (concatenate 'string "xxxx"))) (with-flash-file (s "seq.bin" 2) (write-sequence "abc" s)) (with-flash-file (s "seq.bin") (list (read-sequence str s) str))))
+(aeq 'read-sequence t (delete-file "seq.bin"))
+(aeq 'kv-open 0 (progn (delete-file "test.kv") (kv-open "test.kv")))
+(aeq 'kv-put '(1 "two" 3.5) (kv-put 'a '(1 "two" 3.5)))
+(aeq 'kv-put 99999999999999999999 (kv-put "b" 99999999999999999999))
+(aeq 'kv-get '(1 "two" 3.5) (kv-get 'a))
+(aeq 'kv-get 99999999999999999999 (kv-get "b"))
+(aeq 'kv-get nil (kv-get 'c))
+(aeq 'kv-get 7 (kv-get 'c 7))
+(aeq 'kv-put 5 (kv-put 'a 5))
+(aeq 'kv-get 5 (kv-get 'a))
+(aeq 'kv-open 2 (kv-open "test.kv"))
+(aeq 'kv-get 5 (kv-get 'a))
+(aeq 'kv-delete t (kv-delete "b"))
+(aeq 'kv-delete nil (kv-delete "b"))
+(aeq 'kv-get 0 (kv-get "b" 0))
+(aeq 'kv-compact t (> (kv-compact) 0))
+(aeq 'kv-compact 0 (kv-compact))
+(aeq 'kv-get 5 (kv-get 'a))
+(aeq 'kv-open 1 (kv-open "test.kv"))
+(aeq 'kv-open '(1 nil 3) (let (mid end got) (delete-file "bad.kv") (kv-open "bad.kv") (kv-put 'a 1) (kv-open "test.kv") (setq mid (with-flash-file (s "bad.kv") (file-length s))) (kv-open "bad.kv") (kv-put 'b 2) (kv-open "test.kv") (setq end (with-flash-file (s "bad.kv") (file-length s))) (kv-open "bad.kv") (kv-put 'c 3) (kv-open "test.kv") (with-flash-file (s "bad.kv" 3) (file-position s (1- end)) (write-byte 99 s)) (kv-open "bad.kv") (setq got (list (kv-get 'a) (kv-get 'b) (kv-get 'c))) (kv-open "test.kv") (with-flash-file (s "bad.kv" 3) (file-position s mid) (write-byte 99 s)) got))
+(aeq 'kv-open nothing (ignore-errors (kv-open "bad.kv")))
+(aeq 'kv-open 1 (kv-open "test.kv"))
+(aeq 'kv-open t (delete-file "bad.kv"))
 
 #| features |#
 
@@ -381,6 +424,18 @@ TESTS = r"""
 (aeq 'format "[1,2,3]" (format nil "[~{~a~^,~}]" '(1 2 3)))
 (aeq 'format "0003.14159" (format nil "~10,'0g" 3.14159))
 (aeq 'format "nil  nil" (format nil "~a ~{ ~a ~} ~a" nil nil nil))
+(aeq 'format "   3.142" (format nil "~8,3f" 3.14159))
+(aeq 'format "2.50" (format nil "~,2f" 2.5))
+(aeq 'format "1.5" (format nil "~f" 1.5))
+(aeq 'format "7.0" (format nil "~f" 7))
+(aeq 'format "-1.00" (format nil "~5,2f" -1.0))
+(aeq 'format " 1.234e+03" (format nil "~10,3e" 1234.0))
+(aeq 'format "1.0e-03" (format nil "~e" 0.001))
+(aeq 'format "-5.00e-01" (format nil "~,2e" -0.5))
+(aeq 'format "ab   |" (format nil "~5a|" "ab"))
+(aeq 'format '("1-2" "3-4") (let ((f "~a-~a")) (list (format nil f 1 2) (format nil f 3 4))))
+(aeq 'format '("x1y" "z1y") (let ((f (concatenate 'string "x~" "ay"))) (list (format nil f 1) (progn (setf (char f 0) #\z) (format nil f 1)))))
+(aeq 'format nothing (ignore-errors (format nil "~q")))
 
 #| strings |#
 
@@ -438,6 +493,17 @@ TESTS = r"""
 (aeq 'search nil (search "hat" "the cat sat on the mat"))
 (aeq 'search 1 (search '(1 2) '( 0 1 2 3 4)))
 (aeq 'search nil (search '(2 1 2 3 4 5) '(2 1 2 3 4)))
+(aeq 'search 9 (search "at" "the cat sat on the mat" :start 6))
+(aeq 'search 9 (search "at" "the cat sat on the mat" :start 6 :end 11))
+(aeq 'search nil (search "at" "the cat sat on the mat" :start 6 :end 10))
+(aeq 'search nil (search "at" "the cat sat on the mat" :end 6))
+(aeq 'search 20 (search "at" "the cat sat on the mat" :start 20))
+(aeq 'search 2 (search "" "abc" :start 2))
+(aeq 'search 3 (search "abcabd" "abcabcabd"))
+(aeq 'search 2 (search "aab" "aaaab"))
+(aeq 'search 3 (search '(1 2) '(1 2 0 1 2 3) :start 1))
+(aeq 'search 0 (search '(1 2) '(1 2 0 1 2 3) :end 4))
+(aeq 'search nothing (ignore-errors (search "a" "abc" :start 2 :end 1)))
 
 #| characters |#
 
@@ -465,6 +531,7 @@ TESTS = r"""
 (aeq 'read-from-string 144 (eval (read-from-string "((lambda (x) (* x x)) 12)")))
 (aeq 'read-from-string t (eval (read-from-string "(eq (+ 2 3) 5)")))
 (aeq 'read-from-string nil (read-from-string "()"))
+(aeq 'read-from-string t (let ((x -1)) (dotimes (i 830) (setq x (* x 2))) (= x (read-from-string (princ-to-string x)))))
 
 #| closures |#
 
@@ -500,6 +567,19 @@ TESTS = r"""
 (aeq 'array 1 (let ((a (make-array 40 :element-type 'bit :initial-element 0))) (incf (aref a 39)) (aref a 39)))
 (aeq 'array 0 (let ((a (make-array 40 :element-type 'bit :initial-element 0))) (incf (aref a 39)) (decf (aref a 39)) (aref a 39)))
 
+#| hash tables |#
+
+(aeq 'gethash 1 (let ((h (make-hash-table))) (setf (gethash 'a h) 1) (gethash 'a h)))
+(aeq 'gethash 'none (gethash 'z (make-hash-table) 'none))
+(aeq 'gethash 2 (let ((h (make-hash-table :test #'equal))) (setf (gethash "k" h) 1 (gethash "k" h) 2) (gethash (concatenate 'string "k") h)))
+(aeq 'gethash 11 (let ((h (make-hash-table))) (incf (gethash 'n h 10)) (gethash 'n h)))
+(aeq 'gethash 5929 (let ((h (make-hash-table))) (dotimes (i 100) (setf (gethash i h) (* i i))) (gethash 77 h)))
+(aeq 'gethash 0 (let ((h (make-hash-table))) (ignore-errors (setf (gethash 'b h) (error "x"))) (hash-table-count h)))
+(aeq 'gethash '(1 3) (let ((h (make-hash-table))) (setf (gethash 'a h) 1 (gethash 'c h) (progn (clrhash h) 3)) (list (hash-table-count h) (gethash 'c h))))
+(aeq 'remhash '(t nil 0) (let ((h (make-hash-table))) (setf (gethash 1 h) 'x) (list (remhash 1 h) (remhash 1 h) (hash-table-count h))))
+(aeq 'maphash 4950 (let ((h (make-hash-table)) (n 0)) (dotimes (i 100) (setf (gethash i h) i)) (maphash (lambda (k v) (incf n v)) h) n))
+(aeq 'hash-table-count 100 (let ((h (make-hash-table))) (dotimes (i 100) (setf (gethash i h) i)) (hash-table-count h)))
+
 #| repl |#
 
 (aeq 'repl 23 (read-from-string "23(2)"))
@@ -564,7 +644,7 @@ TESTS = r"""
 (aeq 'print t (string= (princ-to-string 0.9999) "0.9999"))
 (aeq 'print t (string= (princ-to-string 0.99999) "0.99999"))
 (aeq 'print t (string= (princ-to-string 0.999999) "0.999999"))
-(aeq 'print t (string= (princ-to-string 0.9999999) "1.0"))
+(aeq 'print t (string= (princ-to-string 0.9999999) "0.9999999"))
 (aeq 'print t (string= (princ-to-string 1.0) "1.0"))
 (aeq 'print t (string= (princ-to-string 10.0) "10.0"))
 (aeq 'print t (string= (princ-to-string 100.0) "100.0"))
@@ -588,29 +668,32 @@ TESTS = r"""
 (aeq 'print t (string= (princ-to-string 1.001) "1.001"))
 (aeq 'print t (string= (princ-to-string 1.0001) "1.0001"))
 (aeq 'print t (string= (princ-to-string 1.00001) "1.00001"))
-(aeq 'print t (string= (princ-to-string 1.000001) "1.0"))
-(aeq 'print t (string= (princ-to-string 0.0012345678) "0.00123457"))
-(aeq 'print t (string= (princ-to-string 1.2345678E-4) "1.23457e-4"))
-(aeq 'print t (string= (princ-to-string 1234567.9) "1.23457e6"))
-(aeq 'print t (string= (princ-to-string 1.2345679E7) "1.23457e7"))
+(aeq 'print t (string= (princ-to-string 1.000001) "1.000001"))
+(aeq 'print t (string= (princ-to-string 0.0012345678) "0.0012345678"))
+(aeq 'print t (string= (princ-to-string 1.2345678E-4) "1.2345678e-4"))
+(aeq 'print t (string= (princ-to-string 1234567.9) "1.2345679e6"))
+(aeq 'print t (string= (princ-to-string 1.2345679E7) "1.2345679e7"))
 (aeq 'print t (string= (princ-to-string 1.2E-9) "1.2e-9"))
 (aeq 'print t (string= (princ-to-string 9.9E-8) "9.9e-8"))
 (aeq 'print t (string= (princ-to-string 9.9999E-5) "9.9999e-5"))
 (aeq 'print t (string= (princ-to-string 9.01) "9.01"))
-(aeq 'print t (string= (princ-to-string 0.9999999) "1.0"))
-(aeq 'print t (string= (princ-to-string 0.8999999) "0.9"))
+(aeq 'print t (string= (princ-to-string 0.9999999) "0.9999999"))
+(aeq 'print t (string= (princ-to-string 0.8999999) "0.8999999"))
 (aeq 'print t (string= (princ-to-string 0.01) "0.01"))
-(aeq 'print t (string= (princ-to-string 1.2345679) "1.23457"))
-(aeq 'print t (string= (princ-to-string 12.345679) "12.3457"))
-(aeq 'print t (string= (princ-to-string 123.45679) "123.457"))
-(aeq 'print t (string= (princ-to-string 1234.5679) "1234.57"))
-(aeq 'print t (string= (princ-to-string 12345.679) "12345.7"))
-(aeq 'print t (string= (princ-to-string 123456.79) "1.23457e5"))
-(aeq 'print t (string= (princ-to-string 1234567.9) "1.23457e6"))
-(aeq 'print t (string= (princ-to-string 0.12345679) "0.123457"))
-(aeq 'print t (string= (princ-to-string 0.012345679) "0.0123457"))
-(aeq 'print t (string= (princ-to-string 0.0012345678) "0.00123457"))
-(aeq 'print t (string= (princ-to-string 1.2345679E-4) "1.23457e-4"))
+(aeq 'print t (string= (princ-to-string 1.2345679) "1.2345679"))
+(aeq 'print t (string= (princ-to-string 12.345679) "12.345679"))
+(aeq 'print t (string= (princ-to-string 123.45679) "123.45679"))
+(aeq 'print t (string= (princ-to-string 1234.5679) "1234.5679"))
+(aeq 'print t (string= (princ-to-string 12345.679) "12345.679"))
+(aeq 'print t (string= (princ-to-string 123456.79) "1.2345679e5"))
+(aeq 'print t (string= (princ-to-string 1234567.9) "1.2345679e6"))
+(aeq 'print t (string= (princ-to-string 0.12345679) "0.12345679"))
+(aeq 'print t (string= (princ-to-string 0.012345679) "0.012345679"))
+(aeq 'print t (string= (princ-to-string 0.0012345678) "0.0012345678"))
+(aeq 'print t (string= (princ-to-string 1.2345679E-4) "1.2345679e-4"))
+(aeq 'print t (string= (princ-to-string 3.4028235E38) "3.4028235e38"))
+(aeq 'print t (string= (princ-to-string 1.0E-45) "1.0e-45"))
+(aeq 'print t (let ((x (/ 1.0 3))) (= x (read-from-string (princ-to-string x)))))
 
 #| Arithmetic |#
 
@@ -618,7 +701,7 @@ TESTS = r"""
 (aeq '* 9 (* -3 -3))
 (aeq '* 32580 (* 180 181))
 (aeq '* 1 (*))
-(aeq '*  t (string= "-4.29497e9" (princ-to-string (* 2 -2147483648))))
+(aeq '*  t (string= "-4294967296" (princ-to-string (* 2 -2147483648))))
 (aeq '* -2147483648 (* 2 -1073741824))
 (aeq '+ 32767 (+ 32765 1 1))
 (aeq '+ 0 (+))
@@ -627,10 +710,10 @@ TESTS = r"""
 (aeq '/ 2 (/ 60 10 3))
 (aeq '1+ 2.5 (1+ 1.5))
 (aeq '1+ 2147483647 (1+ 2147483646))
-(aeq '1+ t (string= "2.14748e9" (princ-to-string (1+ 2147483647))))
+(aeq '1+ t (string= "2147483648" (princ-to-string (1+ 2147483647))))
 (aeq '1- 0.5 (1- 1.5))
 (aeq '1- -2147483648 (1- -2147483647))
-(aeq '1- t (string= "-2.14748e9" (princ-to-string (1- -2147483648))))
+(aeq '1- t (string= "-2147483649" (princ-to-string (1- -2147483648))))
 
 #| Arithmetic |#
 
@@ -730,7 +813,7 @@ TESTS = r"""
 (aeq 'floor -4 (floor -3.3333333))
 (aeq 'abs 10.0 (abs 10.0))
 (aeq 'abs 10.0 (abs -10.0))
-(aeq 'abs t (string= "2.14748e9" (princ-to-string (abs -2147483648))))
+(aeq 'abs t (string= "2147483648" (princ-to-string (abs -2147483648))))
 (aeq 'abs 2147483647 (abs -2147483647))
 (aeq 'mod 1.0 (mod 13.0 4))
 (aeq 'mod 3.0 (mod -13.0 4))
@@ -759,8 +842,8 @@ TESTS = r"""
 (aeq 'expt 1024 (expt 2 10))
 (aeq 'expt 1024.0 (expt 2.0 10.0))
 (aeq 'expt 1073741824 (expt 2 30))
-(aeq 'expt  t (string= "2.14748e9" (princ-to-string (expt 2 31))))
-(aeq 'expt  t (string= "4.29497e9" (princ-to-string (expt 2 32))))
+(aeq 'expt  t (< (abs (- (expt 2 31) 2147483648.0)) 4096.0))
+(aeq 'expt  t (< (abs (- (expt 2 32) 4294967296.0)) 4096.0))
 (aeq 'expt 1024 (expt -2 10))
 (aeq 'expt -2048 (expt -2 11))
 
@@ -788,6 +871,14 @@ TESTS = r"""
 (aeq 'push nothing (ignore-errors (let ((a #*00000000)) (push 1 (aref a 1)) a)))
 (aeq 'setf nothing (ignore-errors (let ((s "hello")) (setf (char s 5) #\x) s)))
 (aeq 'setf nothing (ignore-errors (let ((s "hello")) (setf (char s 20) #\x) s)))
+(aeq 'read-from-string nothing (ignore-errors (read-from-string (let ((s "")) (dotimes (i 26) (setq s (concatenate 'string s "1234567890"))) s))))
+
+#| escape |#
+
+(defvar escapes 0)
+(progn (ignore-errors (loop (incf escapes 0))) (incf escapes) (dotimes (i 20000) (incf escapes 0)) (incf escapes))
+~
+(aeq 'escape 2 escapes)
 
 #| errors |#
 
@@ -813,8 +904,11 @@ def test():
     talk("", port, 5.0)
 
     for line in TESTS.split("\n"):
-        if line and line.startswith("("):
-            text = talk(line, port)
+        if line == "~":
+            # Escape from the form before, which loops until it's interrupted
+            talk(line, port, 1.0)
+        elif line and line.startswith("("):
+            text = talk(line + "\n", port)
             if "Error:" in text or "Error in" in text:
                 talk("(incf crashes)", port)
 
@@ -0,0 +1,17 @@
+; Times the Lisp Library: list-library, and require of each symbol in *bench-names*.
+; To compare the plain and packed library, build the firmware with LispLibrary.h, and again
+; with #define packedlibrary after running packlibrary.py, and run this on each board.
+; Set *bench-names* to symbols your library defines, then call bench-library.
+; It returns the average time of each in milliseconds.
+
+(defvar *bench-names* nil)
+
+(defun bench-ms (fn n)
+  (let ((start (millis)))
+    (dotimes (i n) (funcall fn))
+    (/ (- (millis) start) (float n))))
+
+(defun bench-library (&optional (n 10))
+  (list
+   (list 'list-library (bench-ms (lambda () (list-library)) n))
+   (list 'require (bench-ms (lambda () (dolist (name *bench-names*) (makunbound name) (require name))) n))))
@@ -0,0 +1,26 @@
+; Compares write-object and read-object with print and read, on the SD card.
+; Call bench-objects: it writes a 25-element list n times each way, 1000 by default, and reads it back.
+; It returns the time of each in milliseconds, and the bytes per object in each form.
+
+(defvar *bench-data*
+  (let (data)
+    (dotimes (i 25 data)
+      (push (list i (* i 1.37) (format nil "item~a" i) 'sym-name #\x) data))))
+
+(defun bench-objects (&optional (n 1000))
+  (let (start times)
+    (setq start (millis))
+    (with-sd-card (s "bench.bin" 2) (dotimes (i n) (write-object *bench-data* s)))
+    (push (list 'write-object (- (millis) start)) times)
+    (setq start (millis))
+    (with-sd-card (s "bench.bin") (dotimes (i n) (read-object s)))
+    (push (list 'read-object (- (millis) start)) times)
+    (setq start (millis))
+    (with-sd-card (s "bench.txt" 2) (dotimes (i n) (print *bench-data* s)))
+    (push (list 'print (- (millis) start)) times)
+    (setq start (millis))
+    (with-sd-card (s "bench.txt") (dotimes (i n) (read s)))
+    (push (list 'read (- (millis) start)) times)
+    (push (list 'binary-bytes (with-sd-card (s "bench.bin") (truncate (file-length s) n))) times)
+    (push (list 'text-bytes (with-sd-card (s "bench.txt") (truncate (file-length s) n))) times)
+    (reverse times)))
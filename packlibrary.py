@@ -0,0 +1,123 @@
+#! /usr/bin/env python3
+"""
+packlibrary.py -- compresses the Lisp Library and boot script at build time
+
+Writes LispLibraryPacked.h, holding the Lisp Library (and optionally a boot
+script to replace the one in ulisp-esp32.ino) compressed with LZSS. With
+#define packedlibrary the firmware reads them through unpacknext(), which
+keeps only a 1024-byte window, so the text is never unpacked in full.
+
+Usage:
+    python3 packlibrary.py LispLibrary.h [--boot boot.lisp] [-o LispLibraryPacked.h]
+
+The library can be a .lisp file, or a header holding a raw string R"lisp(...)lisp".
+"""
+from argparse import ArgumentParser
+import os
+import re
+import time
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+WINDOW = 1024     # UNPACKWINDOW in ulisp.hpp
+MINMATCH = 3
+MAXMATCH = 66
+CANDIDATES = 64   # Earlier positions tried for each match
+
+
+def pack(data):
+    """Compresses data with LZSS, in the format unpacknext() reads."""
+    out = bytearray()
+    chains = {}
+    items, flags, group = 0, 0, bytearray()
+    i = 0
+    while i < len(data):
+        best, distance = 0, 0
+        for j in reversed(chains.get(data[i:i + MINMATCH], [])[-CANDIDATES:]):
+            if i - j > WINDOW:
+                break
+            n = 0
+            while n < MAXMATCH and i + n < len(data) and data[j + n] == data[i + n]:
+                n += 1
+            if n > best:
+                best, distance = n, i - j
+                if n == MAXMATCH:
+                    break
+        if best >= MINMATCH:
+            group += bytes([(distance - 1) & 0xFF, ((distance - 1) >> 8) << 6 | (best - MINMATCH)])
+            step = best
+        else:
+            flags |= 1 << items
+            group.append(data[i])
+            step = 1
+        for k in range(i, i + step):
+            chains.setdefault(data[k:k + MINMATCH], []).append(k)
+        i += step
+        items += 1
+        if items == 8:
+            out.append(flags)
+            out += group
+            items, flags, group = 0, 0, bytearray()
+    if items:
+        out.append(flags)
+        out += group
+    return bytes(out)
+
+
+def unpack(packed, length):
+    """Unpacks data the way unpacknext() does, to check the packer."""
+    out = bytearray()
+    i, items, flags = 0, 0, 0
+    while len(out) < length:
+        if items == 0:
+            flags, items, i = packed[i], 8, i + 1
+        literal = flags & 1
+        flags, items = flags >> 1, items - 1
+        if literal:
+            out.append(packed[i])
+            i += 1
+        else:
+            distance = (packed[i] | (packed[i + 1] >> 6) << 8) + 1
+            for _ in range((packed[i + 1] & 0x3F) + MINMATCH):
+                out.append(out[-distance])
+            i += 2
+    return bytes(out)
+
+
+def source(filename):
+    text = open(filename).read()
+    match = re.search(r'R"lisp\((.*)\)lisp"', text, re.S)
+    return match.group(1) if match else text
+
+
+def array(name, data):
+    rows = [", ".join("0x%02X" % b for b in data[i:i + 16]) for i in range(0, len(data), 16)]
+    return "const uint8_t %s[] PROGMEM = {\n    %s\n};\n" % (name, ",\n    ".join(rows) or "0")
+
+
+def main():
+    parser = ArgumentParser(description="Compresses the Lisp Library for the firmware.")
+    parser.add_argument("library", help="Lisp Library source, a .lisp file or LispLibrary.h")
+    parser.add_argument("--boot", help="boot script to replace the one in ulisp-esp32.ino")
+    parser.add_argument("-o", "--output", default=os.path.join(HERE, "LispLibraryPacked.h"))
+    args = parser.parse_args()
+
+    parts = [("LIBRARYPACKED", "LispLibraryPacked", args.library)]
+    if args.boot:
+        parts.append(("BOOTPACKED", "BootPacked", args.boot))
+    with open(args.output, "w") as out:
+        out.write("// Generated by packlibrary.py - do not edit\n")
+        for define, name, filename in parts:
+            data = source(filename).encode("latin-1")
+            start = time.time()
+            packed = pack(data)
+            elapsed = time.time() - start
+            assert unpack(packed, len(data)) == data
+            report = "%s: %d bytes packed to %d, saving %d bytes (%d%%)" % (
+                os.path.basename(filename), len(data), len(packed), len(data) - len(packed),
+                100 * (len(data) - len(packed)) // max(len(data), 1))
+            print("%s in %.2fs" % (report, elapsed))
+            out.write("\n// %s\n#define %s %d\n%s" % (report, define, len(data), array(name, packed)))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,304 @@
+#! /usr/bin/env python3
+"""
+romlibrary.py -- reads the Lisp Library into read-only cells at build time
+
+Writes RomLibrary.h, holding the forms of the Lisp Library (and optionally a boot
+script) as constant cells that the compiler places in flash. With
+#define romlibrary the firmware evaluates these forms instead of reading
+LispLibrary[]: the definitions take up no workspace, and the garbage collector
+treats the cells as permanently live without marking them.
+
+Builtin symbols are resolved against the builtin tables in ulisp.hpp and the
+extension tables, in the order they are added in ulisp-esp32.ino. The firmware
+checks a signature of those tables, and falls back to the text library if it
+doesn't match.
+
+Usage:
+    python3 romlibrary.py LispLibrary.h [--boot boot.lisp] [-o RomLibrary.h]
+
+The library can be a .lisp file, or a header holding a raw string R"lisp(...)lisp".
+"""
+from argparse import ArgumentParser
+import os
+import re
+import struct
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+TABLES = ["ulisp.hpp", "extensions.hpp", "bignums.hpp"]
+
+BUILTINS = 0xF4240000
+RADIX40 = "\0" + "0123456789abcdefghijklmnopqrstuvwxyz-*$"
+CONTROLCODES = ["Null", "SOH", "STX", "ETX", "EOT", "ENQ", "ACK", "Bell", "Backspace", "Tab",
+                "Newline", "VT", "Page", "Return", "SO", "SI", "DLE", "DC1", "DC2", "DC3", "DC4",
+                "NAK", "SYN", "ETB", "CAN", "EM", "SUB", "Escape", "FS", "GS", "RS", "US", "Space"]
+
+
+def fnv(hash, byte):
+    return ((hash ^ byte) * 16777619) & 0xFFFFFFFF
+
+
+def builtins():
+    """Returns the names of the builtins in table order, and the signature of the tables."""
+    names, signature = [], 2166136261
+    for filename in TABLES:
+        text = open(os.path.join(HERE, filename)).read()
+        strings = dict(re.findall(r'const char (\w+)\[\] = "((?:[^"\\]|\\.)*)";', text))
+        for table in re.findall(r"const tbl_entry_t \w+\[\] = \{(.*?)\n\};", text, re.S):
+            entries = re.findall(r"^\s*\{\s*(\w+),", table, re.M)
+            for entry in entries:
+                name = strings[entry]
+                names.append(name)
+                for byte in name.encode() + b"\0":
+                    signature = fnv(signature, byte)
+            signature = fnv(signature, len(entries))
+    return names, signature
+
+
+def twist(x):
+    return ((x << 2) | ((x & 0xC0000000) >> 30)) & 0xFFFFFFFF
+
+
+def pack40(name):
+    x = 0
+    for i in range(6):
+        x = x * 40 + (RADIX40.index(name[i].lower()) if i < len(name) else 0)
+    return x
+
+
+def valid40(name):
+    return (0 < len(name) <= 6 and all(c.lower() in RADIX40[1:] for c in name)
+            and RADIX40.index(name[0].lower()) >= 11)
+
+
+class Cells:
+    """The cells of the ROM, as C initialisers."""
+
+    def __init__(self, names):
+        self.cells = []
+        self.symbols = {}
+        self.builtins = {name.lower(): i for i, name in reversed(list(enumerate(names)))}
+
+    def new(self, car, cdr):
+        self.cells.append((car, cdr))
+        return len(self.cells) - 1
+
+    def cons(self, car, cdr):
+        return self.new(ref(car), ref(cdr))
+
+    def chars(self, text):
+        data = text.encode("latin-1")
+        first = None
+        for i in reversed(range(0, len(data), 4)):
+            word = int.from_bytes(data[i:i + 4].ljust(4, b"\0"), "big")
+            first = self.new(ref(first), "(object*)0x%08X" % word)
+        return first
+
+    def symbol(self, name):
+        # Builtins and packed names are case-insensitive, long names aren't
+        key = name.lower() if name.lower() in self.builtins or valid40(name) else name
+        if key in self.symbols:
+            return self.symbols[key]
+        if key in self.builtins:
+            index = self.new("(object*)SYMBOL", "(object*)0x%08X" % twist(self.builtins[key] + BUILTINS))
+        elif valid40(name):
+            index = self.new("(object*)SYMBOL", "(object*)0x%08X" % twist(pack40(name)))
+        else:
+            index = self.new("(object*)SYMBOL", ref(self.chars(name)))
+        self.symbols[key] = index
+        return index
+
+
+def ref(index):
+    return "NULL" if index is None else "(object*)&RomCells[%d]" % index
+
+
+class Reader:
+    """Reads Lisp source the way the uLisp reader does, into cells."""
+
+    def __init__(self, text, cells):
+        self.text, self.pos, self.cells = text, 0, cells
+
+    def error(self, message):
+        line = self.text.count("\n", 0, self.pos) + 1
+        raise SystemExit("line %d: %s" % (line, message))
+
+    def skip(self):
+        while self.pos < len(self.text):
+            if self.text[self.pos] in " \t\r\n":
+                self.pos += 1
+            elif self.text[self.pos] == ";":
+                while self.pos < len(self.text) and self.text[self.pos] != "\n":
+                    self.pos += 1
+            elif self.text.startswith("#|", self.pos):
+                end = self.text.find("|#", self.pos)
+                if end < 0:
+                    self.error("unterminated comment")
+                self.pos = end + 2
+            else:
+                return
+
+    def token(self):
+        start = self.pos
+        while self.pos < len(self.text) and self.text[self.pos] not in " \t\r\n()\"#'":
+            self.pos += 1
+        return self.text[start:self.pos]
+
+    def quote(self, name):
+        return self.cells.cons(self.cells.symbol(name), self.cells.cons(self.read(), None))
+
+    def read(self):
+        """Returns the index of the cell read, None for nil, or raises EOFError."""
+        self.skip()
+        if self.pos >= len(self.text):
+            raise EOFError
+        ch = self.text[self.pos]
+        self.pos += 1
+        if ch == "(":
+            return self.readrest()
+        if ch == ")":
+            self.error("unexpected close paren")
+        if ch == "'":
+            return self.quote("quote")
+        if ch == "`":
+            return self.quote("backquote")
+        if ch == ",":
+            if self.text.startswith("@", self.pos):
+                self.pos += 1
+                return self.quote("unquote-splicing")
+            return self.quote("unquote")
+        if ch == '"':
+            return self.string()
+        if ch == "#":
+            return self.dispatch()
+        self.pos -= 1
+        return self.atom(self.token())
+
+    def readrest(self):
+        items, tail = [], None
+        while True:
+            self.skip()
+            if self.pos >= len(self.text):
+                self.error("missing close paren")
+            if self.text[self.pos] == ")":
+                self.pos += 1
+                break
+            if self.text[self.pos] == "." and self.text[self.pos + 1:self.pos + 2] in (" ", "\t", "\r", "\n"):
+                self.pos += 1
+                tail = self.read()
+                self.skip()
+                if self.text[self.pos:self.pos + 1] != ")":
+                    self.error("only one form allowed after reader dot")
+                continue
+            items.append(self.read())
+        for item in reversed(items):
+            tail = self.cells.cons(item, tail)
+        return tail
+
+    def string(self):
+        chars = []
+        while self.pos < len(self.text) and self.text[self.pos] != '"':
+            if self.text[self.pos] == "\\":
+                self.pos += 1
+            chars.append(self.text[self.pos])
+            self.pos += 1
+        self.pos += 1
+        return self.cells.new("(object*)STRING", ref(self.cells.chars("".join(chars))))
+
+    def dispatch(self):
+        ch = self.text[self.pos]
+        self.pos += 1
+        if ch == "'":
+            return self.read()
+        if ch == "\\":
+            name = self.text[self.pos]
+            self.pos += 1
+            if name not in " \t\r\n()\"#'":
+                name += self.token()
+            if len(name) == 1:
+                code = ord(name)
+            elif name.lower() in [c.lower() for c in CONTROLCODES]:
+                code = [c.lower() for c in CONTROLCODES].index(name.lower())
+            elif len(name) == 3 and name.isdigit():
+                code = int(name)
+            else:
+                self.error("unknown character " + name)
+            return self.cells.new("(object*)CHARACTER", "(object*)0x%08X" % code)
+        base = {"b": 2, "o": 8, "x": 16}.get(ch.lower())
+        if base is None:
+            self.error("#%s isn't supported in the ROM library" % ch)
+        token = self.token()
+        try:
+            return self.number(int(token, base))
+        except ValueError:
+            self.error("bad number #%s%s" % (ch, token))
+
+    def number(self, value):
+        if not -0x80000000 <= value <= 0x7FFFFFFF:
+            self.error("bignums aren't supported in the ROM library")
+        return self.cells.new("(object*)NUMBER", "(object*)0x%08X" % (value & 0xFFFFFFFF))
+
+    def atom(self, token):
+        if re.fullmatch(r"[+-]?\d+", token):
+            return self.number(int(token))
+        if re.fullmatch(r"[+-]?(\d+\.?\d*|\.\d+)([eE][+-]?\d+)?", token):
+            bits = struct.unpack("<I", struct.pack("<f", float(token)))[0]
+            return self.cells.new("(object*)FLOAT", "(object*)0x%08X" % bits)
+        if token.lower() == "nil":
+            return None
+        return self.cells.symbol(token)
+
+
+def source(filename):
+    text = open(filename).read()
+    match = re.search(r'R"lisp\((.*)\)lisp"', text, re.S)
+    return match.group(1) if match else text
+
+
+def readforms(filename, cells):
+    reader = Reader(source(filename), cells)
+    forms = []
+    while True:
+        try:
+            forms.append(reader.read())
+        except EOFError:
+            break
+    tail = None
+    for form in reversed(forms):
+        tail = cells.cons(form, tail)
+    return tail, len(forms)
+
+
+def main():
+    parser = ArgumentParser(description="Reads the Lisp Library into read-only cells for the firmware.")
+    parser.add_argument("library", help="Lisp Library source, a .lisp file or LispLibrary.h")
+    parser.add_argument("--boot", help="boot script to run at startup instead of main.lisp")
+    parser.add_argument("-o", "--output", default=os.path.join(HERE, "RomLibrary.h"))
+    args = parser.parse_args()
+
+    names, signature = builtins()
+    cells = Cells(names)
+    library, nlibrary = readforms(args.library, cells)
+    boot, nboot = readforms(args.boot, cells) if args.boot else (None, 0)
+    symbols = sorted(cells.symbols.values())
+
+    body = ",\n".join("    { %s, %s }" % cell for cell in cells.cells)
+    romhash = 2166136261
+    for byte in body.encode():
+        romhash = fnv(romhash, byte)
+    with open(args.output, "w") as out:
+        out.write("// Generated by romlibrary.py from %s - do not edit\n" % os.path.basename(args.library))
+        out.write("// %d library forms, %d boot forms, %d cells\n\n" % (nlibrary, nboot, len(cells.cells)))
+        out.write("#define ROMSIGNATURE 0x%08X\n" % signature)
+        out.write("#define ROMHASH 0x%08X\n" % romhash)
+        out.write("#define ROMCELLS %d\n" % len(cells.cells))
+        out.write("#define ROMSYMBOLS %d\n\n" % len(symbols))
+        out.write("extern const object RomCells[];\n")
+        out.write("const object RomCells[%d] = {\n%s\n};\n\n" % (max(len(cells.cells), 1), body or "    { NULL, NULL }"))
+        out.write("object* const RomSymbols[%d] = { %s };\n" % (max(len(symbols), 1), ", ".join(ref(i) for i in symbols) or "NULL"))
+        out.write("object* const RomLibrary = %s;\n" % ref(library))
+        out.write("object* const RomBoot = %s;\n" % ref(boot))
+    print("%s: %d cells (%d bytes of flash), %d symbols" % (args.output, len(cells.cells), len(cells.cells) * 8, len(symbols)))
+
+
+if __name__ == "__main__":
+    main()
@@ -11,6 +11,8 @@
 #define sdcardsupport
 // #define gfxsupport
 // #define lisplibrary
+// #define romlibrary   // Library and boot script from RomLibrary.h, made by romlibrary.py
+// #define packedlibrary // Library and boot script from LispLibraryPacked.h, made by packlibrary.py
 
 // Includes
 #include "ulisp.hpp"
@@ -20,30 +22,45 @@
 const char foo[] =
   "(pinmode 13 :output)(dotimes(_ 4)(digitalwrite 13 :high)(delay 75)(digitalwrite 13 :low)(delay 75))"
   "(defvar *loaded* nil)"
-  "(defun load(filename)(if(null(search(list filename)*loaded*))(with-sd-card(f filename)(push filename *loaded*)(loop(let((form(read f)))(unless form(return))(eval form))))))"
+  "(defun load(filename)(when(null(search(list filename)*loaded*))(push filename *loaded*)(unless(load-compiled filename)(with-sd-card(f filename)(loop(let((form(read f)))(unless form(return))(eval form)))))))"
   "(if(eq'nothing(ignore-errors(load\"main.lisp\")'a))"
   "(progn(princ\"Error trying to run main.lisp\")(neopixel#xff0000)))"
   "(progn(princ\"main.lisp returned, entering REPL...\")(neopixel#x0000ff))";
 const size_t foolen = arraysize(foo);
 size_t fooi = 0;
+#if defined(packedlibrary) && defined(BOOTPACKED)
+unpack_t BootUnpack;
+#endif
 int getfoo() {
     if (LastChar) {
         char temp = LastChar;
         LastChar = 0;
         return temp;
     }
+#if defined(packedlibrary) && defined(BOOTPACKED)
+    char c = unpacknext(&BootUnpack);
+    return (c != 0) ? c : -1;
+#else
     if (fooi == foolen) return -1;
     char c = foo[fooi];
     fooi++;
     return c;
+#endif
 }
 
 /*
-    sdmain - Run main.lisp on startup
+    sdmain - Load main.img from flash on startup, or failing that run the ROM boot script or main.lisp
 */
 void sdmain() {
     SD.begin();
     if (setjmp(toplevel_handler)) return;
+    if (bootimage()) return;
+#if defined(romlibrary)
+    if (loadfromrom(RomBoot)) return;
+#endif
+#if defined(packedlibrary) && defined(BOOTPACKED)
+    unpackstart(&BootUnpack, BootPacked, BOOTPACKED);
+#endif
     object* fooform;
     for (;;) {
         fooform = read(getfoo);
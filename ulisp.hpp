@@ -23,6 +23,11 @@
 const char LispLibrary[] = "";
 #endif
 
+// Packed Lisp Library and boot script, made by packlibrary.py
+#if defined(packedlibrary)
+#include "LispLibraryPacked.h"
+#endif
+
 #if defined(gfxsupport)
 #define COLOR_WHITE ST77XX_WHITE
 #define COLOR_BLACK ST77XX_BLACK
@@ -54,6 +59,32 @@ Adafruit_ST7789 tft = Adafruit_ST7789(TFT_CS, TFT_DC, MOSI, SCK, TFT_RST);
 #endif
 
 #define MAX_STACK 4000
+#define ESCAPEPOLL 256
+#define CALLCACHESIZE 64
+#define ARGSTACKSIZE 64
+#define EVALSTACKSIZE 32
+#define EVALSTACKMAX 1024
+#define MAXBIGNUM 26  // Words in the largest bignum, which must print in fewer than BUFFERSIZE - 3 digits
+#define HASHSIZE 8     // Initial buckets in a hash table
+#define FORMATCACHESIZE 4  // Compiled format control strings
+#define FORMATBUFFER 256   // Must be longer than the widest ~ field
+#define OUTBUFFERSIZE 64   // Output held for one block write
+#define SERIALRING 1024    // Serial input held until it's read, a power of 2
+#define FILEBUFFERSIZE 512 // Bytes read from or written to a file at a time
+#define WIDEWORDS 24       // Words in the integers used to convert floats to and from decimal
+#define FLOATDIGITS 120    // Significant digits read exactly, more than any float half way point has
+#define IMAGEMAGIC 0x6D497355  // "UsIm", the first word of a workspace image
+#define IMAGEVERSION 1
+#define IMAGEHEADER 7      // Words before the cells in an image
+#define IMAGEROM 0x80000000  // Marks a pointer into the ROM library in an image
+#define UNPACKWINDOW 1024  // Must match the window in packlibrary.py
+#define FASLMAGIC 0x4C534146   // "FASL", the first bytes of a compiled file
+#define FASLVERSION 2
+#define RELOADFILES 4      // Source files whose form hashes reload keeps
+#define KVMAGIC 0x3153564B     // "KVS1", the first bytes of a key-value store
+#define KVKEYSIZE 64       // Bytes in the largest key, once written in binary
+#define KVHEADER 6         // Bytes in a record before its key
+#define KVDEFAULT "/ulisp.kv"  // Store in flash used until kv-open opens another
 
 
 // C Macros
@@ -76,11 +107,13 @@ Adafruit_ST7789 tft = Adafruit_ST7789(TFT_CS, TFT_DC, MOSI, SCK, TFT_RST);
 
 #define integerp(x) ((x) != NULL && (x)->type == NUMBER)
 #define floatp(x) ((x) != NULL && (x)->type == FLOAT)
+#define bignump(x) ((x) != NULL && (x)->type == BIGNUM)
 #define symbolp(x) ((x) != NULL && (x)->type == SYMBOL)
 #define bfunctionp(x) ((x) != NULL && (x)->type == BFUNCTION)
 #define stringp(x) ((x) != NULL && (x)->type == STRING)
 #define characterp(x) ((x) != NULL && (x)->type == CHARACTER)
 #define arrayp(x) ((x) != NULL && (x)->type == ARRAY)
+#define hashtablep(x) ((x) != NULL && (x)->type == HASHTABLE)
 #define streamp(x) ((x) != NULL && (x)->type == STREAM)
 
 #define mark(x) (car(x) = (object*)(((uintptr_t)(car(x))) | MARKBIT))
@@ -96,6 +129,7 @@ Adafruit_ST7789 tft = Adafruit_ST7789(TFT_CS, TFT_DC, MOSI, SCK, TFT_RST);
 #define isbr(x) (x == ')' || x == '(' || x == '"' || x == '#' || x == '\'')
 #define longsymbolp(x) longnamep((x)->name)
 #define longnamep(x) (((x)&0x03) == 0)
+#define inworkspace(x) ((x) >= Workspace && (x) < Workspace + WORKSPACESIZE)
 #define arraysize(x) (sizeof(x) / sizeof(x[0]))
 #define stringifyX(x) #x
 #define stringify(x) stringifyX(x)
@@ -115,6 +149,8 @@ Adafruit_ST7789 tft = Adafruit_ST7789(TFT_CS, TFT_DC, MOSI, SCK, TFT_RST);
 // Constants
 
 #define TRACEMAX 3  // Number of traced functions
+#define STRINGSTREAMS 4  // Nesting depth of with-input-from-string
+#define SEARCHMAX 64      // Longest pattern searched with Horspool or KMP
 enum type {
     ZZERO = 0,
     SYMBOL = 2,
@@ -124,10 +160,12 @@ enum type {
     STREAM = 10,
     CHARACTER = 12,
     FLOAT = 14,
-    ARRAY = 16,
-    STRING = 18,
-    PAIR = 20
-};  // ARRAY, STRING, and PAIR must be last
+    BIGNUM = 16,
+    HASHTABLE = 18,
+    ARRAY = 20,
+    STRING = 22,
+    PAIR = 24
+};  // BIGNUM, HASHTABLE, ARRAY, STRING, and PAIR must be last
 enum token {
     UNUSED,
     OPEN_PAREN,
@@ -153,8 +191,9 @@ const char sdstream[] = "sd";
 const char wifistream[] = "wifi";
 const char stringstream[] = "string";
 const char gfxstream[] = "gfx";
+const char flashstream[] = "flash";
 const char* const streamname[] = {
-    serialstream, i2cstream, spistream, sdstream, wifistream, stringstream, gfxstream
+    serialstream, i2cstream, spistream, sdstream, wifistream, stringstream, gfxstream, flashstream
 };
 enum stream {
     SERIALSTREAM,
@@ -163,7 +202,60 @@ enum stream {
     SDSTREAM,
     WIFISTREAM,
     STRINGSTREAM,
-    GFXSTREAM
+    GFXSTREAM,
+    FLASHSTREAM
+};
+
+// Object tags in compiled files and binary objects
+enum fasltag {
+    FASLNIL,
+    FASLLIST,
+    FASLSYMBOL,
+    FASLNUMBER,
+    FASLFLOAT,
+    FASLCHARACTER,
+    FASLSTRING,
+    FASLTEXT,
+    FASLBIGNUM,
+    FASLARRAY,
+    FASLNAME,      // Symbol with a packed or builtin name
+    FASLLONGNAME,  // Symbol written as its characters
+    FASLLABEL,     // Labels the shared object that follows
+    FASLREF        // Refers back to a labelled object or symbol
+};
+
+// Records in a key-value store
+enum kvrecord {
+    KVPUT = 1,  // Sets a key to the value that follows
+    KVDELETE
+};
+
+// What reloadread() is reading
+enum reloadstate {
+    RELOADSTART,       // White space or comments before the form
+    RELOADCODE,
+    RELOADSPACE,       // White space or comments within the form
+    RELOADSTRING,
+    RELOADESCAPE,      // Character after a backslash in a string
+    RELOADCHARACTER,   // Character after a backslash outside a string
+    RELOADCOMMENT,
+    RELOADSTARTCOMMENT
+};
+
+// Compiled format directives
+enum formatop {
+    FMTTEXT,
+    FMTFRESHLINE,
+    FMTCARET,
+    FMTOPEN,
+    FMTCLOSE,
+    FMTA,
+    FMTS,
+    FMTD,
+    FMTX,
+    FMTB,
+    FMTF,
+    FMTE
 };
 
 // Typedefs
@@ -193,6 +285,7 @@ typedef struct sobject {
 } object;
 
 typedef object* (*fn_ptr_type)(object*, object*);
+typedef object* (*fn_argv_type)(object**, int, object*);
 typedef void (*mapfun_t)(object*, object**);
 
 typedef const struct {
@@ -200,6 +293,7 @@ typedef const struct {
     fn_ptr_type fptr;
     minmax_t minmax;
     const char* doc;
+    fn_argv_type aptr;
 } tbl_entry_t;
 
 typedef struct {
@@ -207,9 +301,87 @@ typedef struct {
     size_t size;
 } mtbl_entry_t;
 
+typedef struct {
+    object* site;
+    symbol_t name;
+    uint32_t epoch;
+    object* function;
+} callcache_t;
+
+typedef struct {
+    object* string;
+    object* program;
+} formatcache_t;
+
+typedef struct {
+    uint8_t data[FILEBUFFERSIZE];
+    int count;  // Bytes in the buffer
+    int index;  // Next byte to read
+} filebuffer_t;
+
+typedef struct {
+    int length;                // Words in use
+    uint32_t word[WIDEWORDS];  // Least significant first
+} wideint_t;
+
+typedef struct {
+    uint8_t type;
+    bool tailcall;
+    int base;
+    object* form;
+    object* env;
+    object* value;
+    object* more;
+} frame_t;
+
+typedef struct {
+    const uint8_t* data;  // Packed bytes
+    int length;           // Characters when unpacked
+    int in;               // Next packed byte
+    int out;              // Characters unpacked so far
+    uint8_t flags;        // Literal or match flag for each of the next items
+    int items;            // Items left in flags
+    int copy;             // Characters left to copy from a match
+    int from;             // Position in the output of the next character to copy
+    char window[UNPACKWINDOW];
+} unpack_t;
+
+typedef struct {
+    uint32_t key;  // Symbol name, or hash of a long name
+    int offset;    // Position of the form in the Lisp Library
+} libraryentry_t;
+
+typedef struct {
+    uint32_t file;      // Hash of the filename
+    int count;          // Forms in the file when it was last reloaded
+    uint32_t* hashes;   // Hash of the text of each form
+} reload_t;
+
+typedef struct {
+    object* obj;
+    int label;  // Label it was written with, or -1
+} share_t;
+
+typedef struct {
+    uint32_t hash;    // Hash of the key
+    uint32_t offset;  // Where its latest record starts in the store, or 0 for an empty slot
+    uint32_t size;    // Bytes in the record
+} kventry_t;
+
+typedef struct {
+    object* chunk;  // Chunk holding the next character
+    int shift;      // Bit position of the next character in the chunk
+    char last;      // Character pushed back by the reader, or 0
+} stringcursor_t;
+
 typedef int (*gfun_t)();
 typedef void (*pfun_t)(char);
 
+// Read-only cells made by romlibrary.py
+#if defined(romlibrary)
+#include "RomLibrary.h"
+#endif
+
 enum builtins : builtin_t {
     NIL,
     TEE,
@@ -250,7 +422,11 @@ enum builtins : builtin_t {
     DIGITALWRITE,
     ANALOGREAD,
     REGISTER,
-    FORMAT
+    FORMAT,
+    GETHASH,
+    KEY,
+    START,
+    END
 };
 
 // Global variables
@@ -268,10 +444,68 @@ builtin_t Context;
 object* tee;
 object* GlobalEnv;
 object* GCStack = NULL;
-object* GlobalString;
+object** ArgStack;
+int ArgTop = 0, ArgSize = 0;
+frame_t* EvalStack;
+int EvalTop = 0, EvalSize = 0;
+callcache_t CallCache[CALLCACHESIZE];
+formatcache_t FormatCache[FORMATCACHESIZE];
+char FormatBuffer[FORMATBUFFER];
+int FormatCount = 0, FormatLength = 0;
+pfun_t FormatPfun;
+char OutBuffer[OUTBUFFERSIZE];
+int OutCount = 0;
+int OutSink = -1;  // Stream, as returned by isstream(), whose output is in OutBuffer
+volatile uint8_t SerialRing[SERIALRING];  // Serial input, put there by serialreceive() as it arrives
+volatile int SerialHead = 0;  // Where serialreceive() puts the next byte
+volatile int SerialTail = 0;  // Next byte for gserial()
+volatile int SerialBusy = 0;  // Set while serialreceive() runs, as it's called from two tasks
+int SerialLine = 0;  // Bytes from SerialTail up to the end of a line, which gserial() can deliver
+int SerialScan = 0;  // Bytes from SerialTail already searched for the end of a line
+uint32_t Epoch = 1;
 object* GlobalStringTail;
 object* Thrown;
-int GlobalStringIndex = 0;
+stringcursor_t* GlobalStringCursor;
+stringcursor_t StringStreams[STRINGSTREAMS];
+object* StringStreamObjects[STRINGSTREAMS];  // The stream object that reads through each cursor
+int StringStreamTop = 0;
+int GlobalStringIndex = 0;  // Characters read from the Lisp Library
+#if defined(packedlibrary)
+unpack_t LibraryUnpack;
+int LibraryAhead = -1;  // Character unpacked by librarypeek(), or -1
+#endif
+libraryentry_t* LibraryIndex;  // Definitions in the Lisp Library, built by libraryindex()
+int LibraryEntries = -1;
+#if defined(romlibrary)
+object* RomNext;  // Next form when reading the ROM library
+#endif
+#if defined(sdcardsupport)
+reload_t Reloaded[RELOADFILES];
+uint32_t* ReloadHashes;  // Hashes collected by reload, until its forms have all been evaluated
+uint32_t ReloadHash;     // Hash of the text of the form being read by reload
+uint8_t ReloadState;
+File* FaslIn;  // Files that compile-file and load-compiled are reading and writing, which are locals of theirs
+filebuffer_t* FaslInBuffer;
+File* FaslOut;
+filebuffer_t* FaslOutBuffer;
+#endif
+share_t* ObjectShares;  // Shared objects and symbols found by write-object, hashed by address
+int ObjectShareSize = 0, ObjectShareCount = 0;
+object** ObjectLabels;  // Labelled objects read by read-object
+int ObjectLabelSize = 0, ObjectLabelCount = 0;
+File KVFile;             // Open key-value store
+filebuffer_t KVBuffer;   // Records added to KVFile that haven't been written yet
+filebuffer_t KVRead;
+kventry_t* KVIndex;      // Latest record for each key in the store, hashed by key, or NULL if it isn't open
+int KVSize = 0, KVCount = 0;
+uint32_t KVLength = 0;   // Bytes in the store, including those in KVBuffer
+uint32_t KVLive = 0;     // Bytes in the header and the records in KVIndex
+uint32_t KVPos = 0;      // Next byte kvread() reads
+uint32_t KVHash, KVBytes;
+uint8_t KVKey[KVKEYSIZE];  // Key being looked up, written in binary
+int KVKeyLength = 0;
+char KVName[BUFFERSIZE];
+bool KVSD = false;       // Store is on the SD card rather than in flash
 uint8_t PrintCount = 0;
 uint8_t BreakLevel = 0;
 char LastChar = 0;
@@ -282,21 +516,30 @@ unsigned int TraceFn[TRACEMAX];
 unsigned int TraceDepth[TRACEMAX];
 
 void* StackBottom;
+uint16_t PollCount = ESCAPEPOLL;
+
+// Evaluator frames
+enum frametype {
+    ARGSFRAME,
+    LETFRAME,
+    TRACEFRAME
+};
 
 // Flags
 enum flag {
     PRINTREADABLY,
     RETURNFLAG,
-    ESCAPE,
     EXITEDITOR,
     LIBRARYLOADED,
     NOESC,
     NOECHO,
     MUFFLEERRORS,
     TAILCALL,
-    INCATCH
+    INCATCH,
+    RAWSERIAL
 };
 volatile flags_t Flags = 1;  // PRINTREADABLY set by default
+volatile bool Escape = false;  // Set by serialreceive() when '~' is typed; not in Flags, as that runs in another task
 
 // Forward references
 bool builtin_keywordp(object*);
@@ -304,11 +547,22 @@ inline bool builtinp(symbol_t name);
 bool keywordp(object*);
 void pfstring(const char*, pfun_t);
 char nthchar(object*, int);
+void cursorstart(stringcursor_t*, object*, int);
+char cursornext(stringcursor_t*);
+void cursorput(stringcursor_t*, char);
+void unreadchar(char, gfun_t);
+void formatuncache(object*);
+void flushoutput();
 void pfl(pfun_t);
 void pln(pfun_t);
 void pserial(char);
 int gserial();
 int glibrary();
+void startlibrary();
+object* nextlibraryform();
+bool romlibraryp();
+builtin_t lookupbuiltin(char*);
+tbl_entry_t* getentry(builtin_t);
 void pstr(char);
 void psymbol(symbol_t, pfun_t);
 void printobject(object*, pfun_t);
@@ -319,6 +573,9 @@ uint32_t pack40(const char*);
 bool valid40(const char*);
 char* cstring(object*, char*, int);
 void pint(int, pfun_t);
+void pbignum(object*, pfun_t);
+float bignumfloat(object*);
+int bignumcompare(object*, object*);
 void pintbase(uint32_t, uint8_t, pfun_t);
 void printstring(object*, pfun_t);
 int subwidthlist(object*, int);
@@ -344,6 +601,10 @@ void repl(object*);
 void prin1object(object*, pfun_t);
 void plispstr(symbol_t, pfun_t);
 void testescape();
+void escape();
+void checkstack(symbol_t);
+void serialreceive();
+int serialescape();
 bool is_macro_call(object*, object*);
 
 inline symbol_t twist(builtin_t x) {
@@ -546,12 +807,14 @@ object* number(int n) {
 
 /*
     makefloat - make a floating point object with value f and return it
-    or return the existing one with the same value
+    or return the existing one with the same bits, so that -0.0 isn't replaced by 0.0
 */
 object* makefloat(float f) {
+    int bits;
+    memcpy(&bits, &f, sizeof(bits));
     for (int i = 0; i < WORKSPACESIZE; i++) {
         object* obj = &Workspace[i];
-        if (obj->type == FLOAT && obj->single_float == f) return obj;
+        if (obj->type == FLOAT && obj->integer == bits) return obj;
     }
     object* ptr = myalloc();
     ptr->type = FLOAT;
@@ -586,9 +849,15 @@ object* cons(object* arg1, object* arg2) {
 
 /*
     symbol - make a symbol object with value name and return it
-    or returns the existing one with the same value
+    or returns the existing one with the same value, which may be in the ROM library
 */
 object* symbol(symbol_t name) {
+#if defined(romlibrary)
+    for (int i = 0; i < ROMSYMBOLS; i++) {
+        object* obj = RomSymbols[i];
+        if (!longsymbolp(obj) && obj->name == name) return obj;
+    }
+#endif
     for (int i = 0; i < WORKSPACESIZE; i++) {
         object* obj = &Workspace[i];
         if (obj->type == SYMBOL && obj->name == name) return obj;
@@ -640,10 +909,17 @@ bool eqsymbols(object* obj, const char* buffer) {
 }
 
 /*
-    internlong - looks through the workspace for an existing occurrence of the long symbol in buffer and returns it,
+    internlong - looks through the ROM library and the workspace for an existing occurrence of the long symbol
+    in buffer and returns it,
     otherwise calls lispstring(buffer) and coerces it to symbol.
 */
 object* internlong(const char* buffer) {
+#if defined(romlibrary)
+    for (int i = 0; i < ROMSYMBOLS; i++) {
+        object* obj = RomSymbols[i];
+        if (longsymbolp(obj) && eqsymbols(obj, buffer)) return obj;
+    }
+#endif
     for (int i = 0; i < WORKSPACESIZE; i++) {
         object* obj = &Workspace[i];
         if (obj->type == SYMBOL && longsymbolp(obj) && eqsymbols(obj, buffer)) return obj;
@@ -713,10 +989,12 @@ object* ss_features(object* args, object* env) {
 
 /*
     markobject - recursively marks reachable objects, starting from obj
+    Cells outside the workspace, in the ROM library, are always live and can't be marked.
 */
 void markobject(object* obj) {
 MARK:
     if (obj == NULL) return;
+    if (!inworkspace(obj)) return;
     if (marked(obj)) return;
 
     object* arg = car(obj);
@@ -734,7 +1012,17 @@ MARK:
         goto MARK;
     }
 
-    if ((type == STRING) || (type == SYMBOL && longsymbolp(obj))) {
+    if (type == HASHTABLE) {  // Mark the count and info cells, then the buckets
+        obj = cdr(obj);
+        for (int i = 0; i < 2; i++) {
+            arg = car(obj);
+            mark(obj);
+            obj = arg;
+        }
+        goto MARK;
+    }
+
+    if ((type == STRING) || (type == BIGNUM) || (type == SYMBOL && longsymbolp(obj))) {
         obj = cdr(obj);
         while (obj != NULL) {
             arg = car(obj);
@@ -771,6 +1059,26 @@ void gc(object* form, object* env) {
     markobject(Thrown);
     markobject(GlobalEnv);
     markobject(GCStack);
+    for (int i = 0; i < ArgTop; i++) markobject(ArgStack[i]);
+    for (int i = 0; i < EvalTop; i++) {
+        frame_t* frame = &EvalStack[i];
+        markobject(frame->form);
+        markobject(frame->env);
+        markobject(frame->value);
+        markobject(frame->more);
+    }
+    for (int i = 0; i < CALLCACHESIZE; i++) {
+        if (CallCache[i].epoch == Epoch) markobject(CallCache[i].function);
+    }
+    for (int i = 0; i < FORMATCACHESIZE; i++) {
+        markobject(FormatCache[i].string);
+        object* word = FormatCache[i].program;
+        while (word != NULL) {
+            object* next = car(word);
+            mark(word);
+            word = next;
+        }
+    }
     markobject(form);
     markobject(env);
     sweep();
@@ -793,8 +1101,10 @@ char* MakeFilename(object* arg, char* buffer) {
     int max = BUFFERSIZE - 1;
     buffer[0] = '/';
     int i = 1;
+    stringcursor_t cursor;
+    cursorstart(&cursor, arg, 0);
     do {
-        char c = nthchar(arg, i - 1);
+        char c = cursornext(&cursor);
         if (c == '\0') break;
         buffer[i++] = c;
     } while (i < max);
@@ -984,6 +1294,7 @@ int checkbitvalue(object* obj) {
 */
 float checkintfloat(object* obj) {
     if (integerp(obj)) return (float)obj->integer;
+    if (bignump(obj)) return bignumfloat(obj);
     if (!floatp(obj)) error(notanumber, obj);
     return obj->single_float;
 }
@@ -1004,6 +1315,17 @@ object* checkstring(object* obj) {
     return obj;
 }
 
+/*
+    checkwritable - check that obj can be changed, which it can't if it's one of the read-only cells of the ROM library
+*/
+void checkwritable(object* obj) {
+#if defined(romlibrary)
+    if (obj != NULL && !inworkspace(obj)) error("can't change a constant in the ROM library", obj);
+#else
+    (void)obj;
+#endif
+}
+
 int isstream(object* obj) {
     if (!streamp(obj)) error("not a stream", obj);
     return obj->integer;
@@ -1040,6 +1362,7 @@ void checkargs(object* args) {
 boolean eq(object* arg1, object* arg2) {
     if (arg1 == arg2) return true;                          // Same object
     if ((arg1 == nil) || (arg2 == nil)) return false;       // Not both values
+    if (bignump(arg1) && bignump(arg2)) return bignumcompare(arg1, arg2) == 0;  // Same bignum
     if (arg1->cdr != arg2->cdr) return false;               // Different values
     if (symbolp(arg1) && symbolp(arg2)) return true;        // Same symbol
     if (integerp(arg1) && integerp(arg2)) return true;      // Same integer
@@ -1084,6 +1407,207 @@ object* checkarguments(object* args, int min, int max) {
     return args;
 }
 
+// Bignums
+
+/*
+    Integers that don't fit in a fixnum are promoted to a BIGNUM object. Like a string, its cdr points to
+    a chain of cells linked through car, each holding one 32-bit word of the value in two's complement,
+    least significant word first. Bignums are kept normalised, so a value that fits in a fixnum is always a NUMBER.
+*/
+
+/*
+    bignumwords - unpacks the integer or bignum arg into w, least significant word first,
+    and returns the number of words
+*/
+int bignumwords(object* arg, uint32_t* w) {
+    if (integerp(arg)) {
+        w[0] = arg->integer;
+        return 1;
+    }
+    int n = 0;
+    for (object* chunk = cdr(arg); chunk != NULL; chunk = car(chunk)) w[n++] = chunk->integer;
+    return n;
+}
+
+/*
+    bignumsign - returns the word that sign-extends the n-word value in w
+*/
+uint32_t bignumsign(uint32_t* w, int n) {
+    return ((int32_t)w[n - 1] < 0) ? 0xFFFFFFFF : 0;
+}
+
+/*
+    bignumextend - sign-extends the n-word value in w to m words
+*/
+void bignumextend(uint32_t* w, int n, int m) {
+    uint32_t sign = bignumsign(w, n);
+    while (n < m) w[n++] = sign;
+}
+
+/*
+    bignumnegate - negates the n-word value in w in place
+*/
+void bignumnegate(uint32_t* w, int n) {
+    uint32_t carry = 1;
+    for (int i = 0; i < n; i++) {
+        w[i] = ~w[i] + carry;
+        carry = carry && (w[i] == 0);
+    }
+}
+
+/*
+    makebignum - returns the n-word value in w as a fixnum if it fits, otherwise as a normalised bignum
+*/
+object* makebignum(uint32_t* w, int n) {
+    uint32_t sign = bignumsign(w, n);
+    while (n > 1 && w[n - 1] == sign && bignumsign(w, n - 1) == sign) n--;
+    if (n == 1) return number(w[0]);
+    if (n > MAXBIGNUM) error2("integer too large");
+    object* chunk = NULL;
+    for (int i = n - 1; i >= 0; i--) {
+        object* cell = myalloc();
+        car(cell) = chunk;
+        cell->integer = w[i];
+        chunk = cell;
+    }
+    object* ptr = myalloc();
+    ptr->type = BIGNUM;
+    cdr(ptr) = chunk;
+    return ptr;
+}
+
+/*
+    integerish - true if obj is an integer or a bignum
+*/
+bool integerish(object* obj) {
+    return integerp(obj) || bignump(obj);
+}
+
+/*
+    bignumminusp - true if the integer or bignum arg is negative
+*/
+bool bignumminusp(object* arg) {
+    if (integerp(arg)) return arg->integer < 0;
+    object* chunk = cdr(arg);
+    while (car(chunk) != NULL) chunk = car(chunk);
+    return chunk->integer < 0;
+}
+
+/*
+    bignumadd - adds arg2 to arg1, or subtracts it if sub is true, and returns the exact result
+*/
+object* bignumadd(object* arg1, object* arg2, bool sub) {
+    uint32_t a[MAXBIGNUM + 1], b[MAXBIGNUM + 1];
+    int na = bignumwords(arg1, a), nb = bignumwords(arg2, b);
+    int n = (na > nb ? na : nb) + 1;
+    bignumextend(a, na, n);
+    bignumextend(b, nb, n);
+    uint32_t carry = sub;
+    for (int i = 0; i < n; i++) {
+        uint64_t t = (uint64_t)a[i] + (sub ? ~b[i] : b[i]) + carry;
+        a[i] = t;
+        carry = t >> 32;
+    }
+    return makebignum(a, n);
+}
+
+/*
+    bignummultiply - multiplies arg1 by arg2 and returns the exact result
+*/
+object* bignummultiply(object* arg1, object* arg2) {
+    uint32_t a[MAXBIGNUM], b[MAXBIGNUM], r[2 * MAXBIGNUM + 1];
+    int na = bignumwords(arg1, a), nb = bignumwords(arg2, b);
+    bool neg = false;
+    if (bignumsign(a, na)) {
+        bignumnegate(a, na);
+        neg = !neg;
+    }
+    if (bignumsign(b, nb)) {
+        bignumnegate(b, nb);
+        neg = !neg;
+    }
+    // Multiply the magnitudes as unsigned numbers
+    int n = na + nb + 1;
+    for (int i = 0; i < n; i++) r[i] = 0;
+    for (int i = 0; i < na; i++) {
+        uint32_t carry = 0;
+        for (int j = 0; j < nb; j++) {
+            uint64_t t = (uint64_t)a[i] * b[j] + r[i + j] + carry;
+            r[i + j] = t;
+            carry = t >> 32;
+        }
+        r[i + nb] = carry;
+    }
+    if (neg) bignumnegate(r, n);
+    return makebignum(r, n);
+}
+
+/*
+    negatebignum - returns the exact negation of the integer or bignum arg
+*/
+object* negatebignum(object* arg) {
+    uint32_t w[MAXBIGNUM + 1];
+    int n = bignumwords(arg, w);
+    bignumextend(w, n, n + 1);
+    bignumnegate(w, n + 1);
+    return makebignum(w, n + 1);
+}
+
+/*
+    bignumcompare - compares two integers or bignums and returns -1, 0, or 1
+*/
+int bignumcompare(object* arg1, object* arg2) {
+    uint32_t a[MAXBIGNUM], b[MAXBIGNUM];
+    int na = bignumwords(arg1, a), nb = bignumwords(arg2, b);
+    int n = na > nb ? na : nb;
+    bignumextend(a, na, n);
+    bignumextend(b, nb, n);
+    if (a[n - 1] != b[n - 1]) return ((int32_t)a[n - 1] < (int32_t)b[n - 1]) ? -1 : 1;
+    for (int i = n - 2; i >= 0; i--) {
+        if (a[i] != b[i]) return (a[i] < b[i]) ? -1 : 1;
+    }
+    return 0;
+}
+
+/*
+    bignumfloat - returns the integer or bignum arg converted to a float
+*/
+float bignumfloat(object* arg) {
+    uint32_t w[MAXBIGNUM];
+    int n = bignumwords(arg, w);
+    bool neg = bignumsign(w, n);
+    if (neg) bignumnegate(w, n);
+    float f = 0.0;
+    for (int i = n - 1; i >= 0; i--) f = f * 4294967296.0 + w[i];
+    return neg ? -f : f;
+}
+
+/*
+    bignumread - converts the digits in buffer, with an optional sign, to an integer in the specified base
+*/
+object* bignumread(char* buffer, int base) {
+    uint32_t w[MAXBIGNUM + 1];
+    int n = 1;
+    w[0] = 0;
+    bool neg = (*buffer == '-');
+    if (*buffer == '-' || *buffer == '+') buffer++;
+    while (*buffer != '\0') {
+        uint32_t carry = digitvalue(*buffer++);
+        for (int i = 0; i < n; i++) {
+            uint64_t t = (uint64_t)w[i] * base + carry;
+            w[i] = t;
+            carry = t >> 32;
+        }
+        if (carry != 0) {
+            if (n == MAXBIGNUM) error2("integer too large");
+            w[n++] = carry;
+        }
+    }
+    w[n++] = 0;
+    if (neg) bignumnegate(w, n);
+    return makebignum(w, n);
+}
+
 // Mathematical helper functions
 
 /*
@@ -1114,15 +1638,16 @@ object* subtract_floats(object* args, float fresult) {
 
 /*
     negate - used by fn_subtract with one argument
-    If the result is an integer, and negating it doesn't overflow, keep the result as an integer.
-    Otherwise convert the result to a float, negate it, and return the result as a Lisp float.
+    If the argument is an integer, and negating it doesn't overflow, keep the result as an integer.
+    Otherwise negate an integer or bignum exactly as a bignum, or a float as a Lisp float.
 */
 object* negate(object* arg) {
     if (integerp(arg)) {
         int result = arg->integer;
-        if (result == INT_MIN) return makefloat(-result);
+        if (result == INT_MIN) return negatebignum(arg);
         else return number(-result);
-    } else if (floatp(arg)) return makefloat(-(arg->single_float));
+    } else if (bignump(arg)) return negatebignum(arg);
+    else if (floatp(arg)) return makefloat(-(arg->single_float));
     else error(notanumber, arg);
     return nil;
 }
@@ -1140,6 +1665,54 @@ object* multiply_floats(object* args, float fresult) {
     return makefloat(fresult);
 }
 
+/*
+    add_bignums - used by fn_add once the running total overflows
+    Adds the numbers in args to the integer or bignum total, and returns the exact result,
+    or continues with add_floats if it finds a floating-point argument.
+*/
+object* add_bignums(object* args, object* total) {
+    while (args != NULL) {
+        object* arg = car(args);
+        if (floatp(arg)) return add_floats(args, checkintfloat(total));
+        else if (integerish(arg)) total = bignumadd(total, arg, false);
+        else error(notanumber, arg);
+        args = cdr(args);
+    }
+    return total;
+}
+
+/*
+    subtract_bignums - used by fn_subtract once the running total overflows
+    Subtracts the numbers in args from the integer or bignum total, and returns the exact result,
+    or continues with subtract_floats if it finds a floating-point argument.
+*/
+object* subtract_bignums(object* args, object* total) {
+    while (args != NULL) {
+        object* arg = car(args);
+        if (floatp(arg)) return subtract_floats(args, checkintfloat(total));
+        else if (integerish(arg)) total = bignumadd(total, arg, true);
+        else error(notanumber, arg);
+        args = cdr(args);
+    }
+    return total;
+}
+
+/*
+    multiply_bignums - used by fn_multiply once the running total overflows
+    Multiplies the integer or bignum total by the numbers in args, and returns the exact result,
+    or continues with multiply_floats if it finds a floating-point argument.
+*/
+object* multiply_bignums(object* args, object* total) {
+    while (args != NULL) {
+        object* arg = car(args);
+        if (floatp(arg)) return multiply_floats(args, checkintfloat(total));
+        else if (integerish(arg)) total = bignummultiply(total, arg);
+        else error(notanumber, arg);
+        args = cdr(args);
+    }
+    return total;
+}
+
 /*
     divide_floats - used by fn_divide
     Converts the numbers in args to floats, divides fresult by them, and returns the result as a Lisp float.
@@ -1171,6 +1744,11 @@ object* compare(object* args, bool lt, bool gt, bool eq) {
             if (!lt && ((arg1->integer) < (arg2->integer))) return nil;
             if (!eq && ((arg1->integer) == (arg2->integer))) return nil;
             if (!gt && ((arg1->integer) > (arg2->integer))) return nil;
+        } else if (integerish(arg1) && integerish(arg2)) {
+            int c = bignumcompare(arg1, arg2);
+            if (!lt && (c < 0)) return nil;
+            if (!eq && (c == 0)) return nil;
+            if (!gt && (c > 0)) return nil;
         } else {
             if (!lt && (checkintfloat(arg1) < checkintfloat(arg2))) return nil;
             if (!eq && (checkintfloat(arg1) == checkintfloat(arg2))) return nil;
@@ -1210,6 +1788,19 @@ object* testargument(object* args) {
     return test;
 }
 
+/*
+    keyargument - handles the :key argument for functions that accept it
+*/
+object* keyargument(object* args) {
+    object* key = nil;
+    if (args != NULL) {
+        if (cdr(args) == NULL) error("dangling keyword", first(args));
+        if (isbuiltin(first(args), KEY)) key = second(args);
+        else error("unsupported keyword", first(args));
+    }
+    return key;
+}
+
 /*
     assoc - looks for key in an association list and returns the matching pair, or nil if not found
 */
@@ -1401,7 +1992,7 @@ object* readbitarray(gfun_t gfun) {
         tail = cell;
         ch = gfun();
     }
-    LastChar = ch;
+    unreadchar(ch, gfun);
     int size = listlength(head);
     object* array = makearray(cons(number(size), NULL), number(0), true);
     size = (size + sizeof(int) * 8 - 1) / (sizeof(int) * 8);
@@ -1475,6 +2066,210 @@ void printarray(object* array, pfun_t pfun) {
     }
 }
 
+// Hash tables
+
+/*
+    A hash table's cdr points to a cell holding the number of entries; its car points to a cell holding
+    the test and the rehash position, whose car points to a cons of the bucket array and the old bucket array.
+    Each bucket is an association list. When the table grows the entries are moved from the old buckets
+    one bucket per access, so a large table never pauses to rehash everything at once.
+*/
+
+#define HASHEQ 0
+#define HASHEQUAL 1
+
+#define hashcount(t) (cdr(t)->integer)
+#define hashinfo(t) car(cdr(t))
+#define hashtest(t) (hashinfo(t)->integer & 1)
+#define hashbuckets(t) car(car(hashinfo(t)))
+#define hasholdbuckets(t) cdr(car(hashinfo(t)))
+
+/*
+    hashchunks - hashes the characters in a chain of string chunks
+*/
+uint32_t hashchunks(object* chunk, uint32_t h) {
+    while (chunk != NULL) {
+        h = h * 31 + chunk->chars;
+        chunk = car(chunk);
+    }
+    return h;
+}
+
+/*
+    hashobject - returns a hash of obj that's consistent with eq, or with equal if test is HASHEQUAL
+    Long symbols and strings are hashed by their characters, conses to a limited depth.
+    Other objects hash by workspace index rather than address, so that tables survive save-image.
+*/
+uint32_t hashobject(object* obj, int test, int depth) {
+    if (obj == NULL) return 0;
+    if (consp(obj)) {
+        if (test != HASHEQUAL) return obj - Workspace;
+        if (depth == 0) return 17;
+        return hashobject(car(obj), test, depth - 1) * 31 + hashobject(cdr(obj), test, depth - 1);
+    }
+    switch (obj->type) {
+        case NUMBER:
+        case CHARACTER:
+        case FLOAT: return obj->integer;
+        case BIGNUM: return hashchunks(cdr(obj), BIGNUM);
+        case SYMBOL: return longsymbolp(obj) ? hashchunks(cdr(obj), SYMBOL) : obj->name;
+        case STRING: return (test == HASHEQUAL) ? hashchunks(cdr(obj), STRING) : obj - Workspace;
+        default: return obj - Workspace;
+    }
+}
+
+/*
+    hashsize - returns the number of buckets in a bucket array
+*/
+int hashsize(object* buckets) {
+    return car(cddr(buckets))->integer;
+}
+
+/*
+    hashbucket - returns a pointer to the bucket in buckets for key
+*/
+object** hashbucket(object* buckets, object* key, int test) {
+    int size = hashsize(buckets);
+    uint32_t h = hashobject(key, test, 4);
+    h = h ^ (h >> 16);
+    return arrayref(buckets, h & (size - 1), size);
+}
+
+/*
+    makebuckets - returns a bucket array of size buckets, which must be a power of 2
+*/
+object* makebuckets(int size) {
+    return makearray(cons(number(size), NULL), nil, false);
+}
+
+/*
+    makehashtable - returns an empty hash table using test HASHEQ or HASHEQUAL
+*/
+object* makehashtable(int test) {
+    object* info = myalloc();
+    car(info) = cons(makebuckets(HASHSIZE), nil);
+    info->integer = test;
+    object* count = myalloc();
+    car(count) = info;
+    count->integer = 0;
+    object* ptr = myalloc();
+    ptr->type = HASHTABLE;
+    cdr(ptr) = count;
+    return ptr;
+}
+
+/*
+    rehashstep - moves the entries in the next old bucket, if any, to the new buckets
+*/
+void rehashstep(object* table) {
+    object* old = hasholdbuckets(table);
+    if (old == NULL) return;
+    object* info = hashinfo(table);
+    int test = hashtest(table), size = hashsize(old), pos = info->integer >> 1;
+    object** bucket = arrayref(old, pos, size);
+    while (*bucket != NULL) {
+        object* cell = *bucket;
+        *bucket = cdr(cell);
+        object** newbucket = hashbucket(hashbuckets(table), car(car(cell)), test);
+        cdr(cell) = *newbucket;
+        *newbucket = cell;
+    }
+    pos++;
+    if (pos == size) {
+        hasholdbuckets(table) = nil;
+        pos = 0;
+    }
+    info->integer = pos << 1 | test;
+}
+
+/*
+    hashfind - looks for key in table, and returns the (key . value) pair or nil if not found
+*/
+object* hashfind(object* table, object* key) {
+    int test = hashtest(table);
+    rehashstep(table);
+    object* buckets = hashbuckets(table);
+    while (buckets != NULL) {
+        object* list = *hashbucket(buckets, key, test);
+        while (list != NULL) {
+            object* pair = car(list);
+            if (test == HASHEQUAL ? equal(key, car(pair)) : eq(key, car(pair))) return pair;
+            list = cdr(list);
+        }
+        buckets = (buckets == hashbuckets(table)) ? hasholdbuckets(table) : NULL;
+    }
+    return nil;
+}
+
+/*
+    hashadd - adds a (key . value) pair to table, growing it if necessary, and returns the pair
+    The key mustn't already be in the table.
+*/
+object* hashadd(object* table, object* key, object* value) {
+    int size = hashsize(hashbuckets(table));
+    if (hashcount(table) >= 2 * size) {
+        while (hasholdbuckets(table) != NULL) rehashstep(table);
+        object* buckets = car(hashinfo(table));
+        cdr(buckets) = car(buckets);
+        car(buckets) = makebuckets(size * 2);
+    }
+    object** bucket = hashbucket(hashbuckets(table), key, hashtest(table));
+    object* pair = cons(key, value);
+    push(pair, *bucket);
+    hashcount(table)++;
+    return pair;
+}
+
+/*
+    hashremove - removes key from table, and returns true if it was found
+*/
+bool hashremove(object* table, object* key) {
+    int test = hashtest(table);
+    rehashstep(table);
+    object* buckets = hashbuckets(table);
+    while (buckets != NULL) {
+        object** prev = hashbucket(buckets, key, test);
+        while (*prev != NULL) {
+            object* pair = car(*prev);
+            if (test == HASHEQUAL ? equal(key, car(pair)) : eq(key, car(pair))) {
+                *prev = cdr(*prev);
+                hashcount(table)--;
+                return true;
+            }
+            prev = &cdr(*prev);
+        }
+        buckets = (buckets == hashbuckets(table)) ? hasholdbuckets(table) : NULL;
+    }
+    return false;
+}
+
+/*
+    hashplace - returns a pointer to the value for key in table, adding it with value def if it's not found
+*/
+object** hashplace(object* table, object* key, object* def) {
+    object* pair = hashfind(table, key);
+    if (pair == NULL) pair = hashadd(table, key, def);
+    return &cdr(pair);
+}
+
+/*
+    hashset - sets the value for key in table to value, adding it if it's not found, and returns value
+*/
+object* hashset(object* table, object* key, object* value) {
+    object* pair = hashfind(table, key);
+    if (pair == NULL) hashadd(table, key, value);
+    else cdr(pair) = value;
+    return value;
+}
+
+/*
+    checkhashtable - check that obj is a hash table
+*/
+object* checkhashtable(object* obj) {
+    if (!hashtablep(obj)) error("argument is not a hash table", obj);
+    return obj;
+}
+
 // String utilities
 
 void indent(uint8_t spaces, char ch, pfun_t pfun) {
@@ -1486,7 +2281,6 @@ void indent(uint8_t spaces, char ch, pfun_t pfun) {
 */
 object* startstring() {
     object* string = newstring();
-    GlobalString = string;
     GlobalStringTail = string;
     return string;
 }
@@ -1603,29 +2397,85 @@ object** getcharplace(object* string, int n, int* shift) {
 }
 
 /*
-    nthchar - returns the nth character from a Lisp string
+    cursorstart - sets cursor to read string starting from character n
 */
-char nthchar(object* string, int n) {
+void cursorstart(stringcursor_t* cursor, object* string, int n) {
     int shift;
-    object** arg = getcharplace(string, n, &shift);
-    if (*arg == NULL) return '\0';
-    return (((*arg)->chars) >> ((-shift - 2) << 3)) & 0xFF;
+    cursor->chunk = *getcharplace(string, n, &shift);
+    cursor->shift = (-shift - 2) << 3;
+    cursor->last = 0;
 }
 
 /*
-    gstr - reads a character from a string stream
+    cursornext - returns the next character from cursor and advances it, or 0 at the end of the string
+    Walks the chunks in order, so reading a whole string is linear in its length.
 */
-int gstr() {
-    if (LastChar) {
-        char temp = LastChar;
-        LastChar = 0;
-        return temp;
+char cursornext(stringcursor_t* cursor) {
+    if (cursor->chunk == NULL) return '\0';
+    char ch = (cursor->chunk->chars >> cursor->shift) & 0xFF;
+    if (cursor->shift == 0) {
+        cursor->chunk = car(cursor->chunk);
+        cursor->shift = (sizeof(int) - 1) * 8;
+    } else cursor->shift = cursor->shift - 8;
+    return ch;
+}
+
+/*
+    cursorput - replaces the next character at cursor with ch and advances it
+*/
+void cursorput(stringcursor_t* cursor, char ch) {
+    object* chunk = cursor->chunk;
+    chunk->chars = (chunk->chars & ~(0xFF << cursor->shift)) | (uint8_t)ch << cursor->shift;
+    cursornext(cursor);
+}
+
+/*
+    nthchar - returns the nth character from a Lisp string
+*/
+char nthchar(object* string, int n) {
+    int shift;
+    object** arg = getcharplace(string, n, &shift);
+    if (*arg == NULL) return '\0';
+    return (((*arg)->chars) >> ((-shift - 2) << 3)) & 0xFF;
+}
+
+/*
+    gstr - reads a character from a string stream
+*/
+int gstr() {
+    if (GlobalStringCursor->last) {
+        char temp = GlobalStringCursor->last;
+        GlobalStringCursor->last = 0;
+        return temp;
     }
-    char c = nthchar(GlobalString, GlobalStringIndex++);
+    char c = cursornext(GlobalStringCursor);
     if (c != 0) return c;
     return '\n';  // -1?
 }
 
+/*
+    gstrstream - reads a character from a string input stream, returning -1 at the end of the string
+*/
+int gstrstream() {
+    if (GlobalStringCursor->last) {
+        char temp = GlobalStringCursor->last;
+        GlobalStringCursor->last = 0;
+        return temp;
+    }
+    char c = cursornext(GlobalStringCursor);
+    if (c != 0) return c;
+    return -1;
+}
+
+/*
+    unreadchar - pushes back ch, the last character read by the reader, so gfun returns it next
+    String streams keep their own pushback, so reading another stream in between doesn't take it.
+*/
+void unreadchar(char ch, gfun_t gfun) {
+    if (gfun == gstr || gfun == gstrstream) GlobalStringCursor->last = ch;
+    else LastChar = ch;
+}
+
 /*
     pstr - prints a character to a string stream
 */
@@ -1891,9 +2741,19 @@ object* findvalue(object* var, object* env) {
     return pair;
 }
 
+/*
+    redefine - called before the value in a binding is replaced; if it held a function,
+    bumps Epoch so that eval() won't use any call-site cache entries that refer to it
+*/
+void redefine(object* pair) {
+    object* val = cdr(pair);
+    if (consp(val) || bfunctionp(val)) Epoch++;
+}
+
 // Handling closures
 
 object* closure(bool tc, symbol_t name, object* function, object* args, object** env) {
+    checkstack(name);
     object* state = car(function);
     function = cdr(function);
     int trace = 0;
@@ -2006,18 +2866,24 @@ object* apply(object* function, object* args, object* env) {
 object** place(object* args, object* env, int* bit) {
 PLACE:
     *bit = -1;
-    if (atom(args)) return &cdr(findvalue(args, env));
+    if (atom(args)) {
+        object* pair = findvalue(args, env);
+        redefine(pair);
+        return &cdr(pair);
+    }
     object* function = first(args);
     if (symbolp(function)) {
         symbol_t sname = function->name;
         if (sname == sym(CAR) || sname == sym(FIRST)) {
             object* value = eval(second(args), env);
             if (!listp(value)) error(canttakecar, value);
+            checkwritable(value);
             return &car(value);
         }
         if (sname == sym(CDR) || sname == sym(REST)) {
             object* value = eval(second(args), env);
             if (!listp(value)) error(canttakecdr, value);
+            checkwritable(value);
             return &cdr(value);
         }
         if (sname == sym(NTH)) {
@@ -2036,16 +2902,19 @@ PLACE:
                 }
                 i--;
             }
+            checkwritable(list);
             return &car(list);
         }
         if (sname == sym(CHAR)) {
             int index = checkinteger(eval(third(args), env));
             object* string = checkstring(eval(second(args), env));
+            checkwritable(string);
             object** loc = getcharplace(string, index, bit);
             if ((*loc) == NULL || (((((*loc)->chars) >> ((-(*bit) - 2) << 3)) & 0xFF) == 0)) {
                 Context = CHAR;
                 error(indexrange, number(index));
             }
+            formatuncache(string);
             return loc;
         }
         if (sname == sym(AREF)) {
@@ -2056,6 +2925,20 @@ PLACE:
             }
             return getarray(array, cddr(args), env, bit);
         }
+        if (sname == sym(GETHASH)) {
+            object* key = eval(second(args), env);
+            protect(key);
+            object* table = eval(third(args), env);
+            if (!hashtablep(table)) {
+                Context = GETHASH;
+                error("second argument is not a hash table", table);
+            }
+            protect(table);
+            object* def = (cdr(cddr(args)) != NULL) ? eval(first(cdr(cddr(args))), env) : nil;
+            unprotect();
+            unprotect();
+            return hashplace(table, key, def);
+        }
     } else if (is_macro_call(args, env)) {
         function = eval(function, env);
         goto PLACE;
@@ -2064,6 +2947,27 @@ PLACE:
     return nil;
 }
 
+/*
+    setgethash - stores value in the place (gethash key hash-table [default]), where args is the list of arguments
+    Unlike place(), this only adds the entry once the other arguments have been evaluated.
+*/
+void setgethash(object* args, object* value, object* env) {
+    protect(value);
+    object* key = eval(first(args), env);
+    protect(key);
+    object* table = eval(second(args), env);
+    if (!hashtablep(table)) {
+        Context = GETHASH;
+        error("second argument is not a hash table", table);
+    }
+    protect(table);
+    if (cddr(args) != NULL) eval(third(args), env);
+    hashset(table, key, value);
+    unprotect();
+    unprotect();
+    unprotect();
+}
+
 // Checked car and cdr
 
 /*
@@ -2148,6 +3052,7 @@ void mapcarfun(object* result, object** tail) {
 void mapcanfun(object* result, object** tail) {
     if (cdr(*tail) != NULL) error(notproper, *tail);
     while (consp(result)) {
+        checkwritable(*tail);
         cdr(*tail) = result;
         *tail = result;
         result = cdr(result);
@@ -2324,20 +3229,100 @@ inline int i2c1read() {
 }
 #endif
 inline int serial1read() {
+    flushoutput();
     while (!Serial1.available()) testescape();
     return Serial1.read();
 }
+/*
+    filereadbyte - returns the next byte from file, refilling buffer a block at a time, or -1 at the end of the file
+*/
+int filereadbyte(File& file, filebuffer_t* buffer) {
+    if (buffer->index == buffer->count) {
+        int n = file.read(buffer->data, FILEBUFFERSIZE);
+        buffer->index = 0;
+        buffer->count = (n > 0) ? n : 0;
+        if (buffer->count == 0) return -1;
+    }
+    return buffer->data[buffer->index++];
+}
+
+/*
+    fileflush - writes the bytes held in buffer to file
+*/
+void fileflush(File& file, filebuffer_t* buffer) {
+    int n = buffer->count;
+    if (n == 0) return;
+    buffer->count = 0;
+    if (file.write(buffer->data, n) != (size_t)n) {
+        Context = NIL;
+        error2("failed to write to file");
+    }
+}
+
+/*
+    filewritebyte - adds a byte to buffer, writing it to file a block at a time
+*/
+void filewritebyte(File& file, filebuffer_t* buffer, char c) {
+    if (buffer->count == FILEBUFFERSIZE) fileflush(file, buffer);
+    buffer->data[buffer->count++] = c;
+}
+
 #if defined(sdcardsupport)
 File SDpfile, SDgfile;
+filebuffer_t SDpbuffer, SDgbuffer;
 inline int SDread() {
     if (LastChar) {
         char temp = LastChar;
         LastChar = 0;
         return temp;
     }
-    return SDgfile.read();
+    return filereadbyte(SDgfile, &SDgbuffer);
+}
+#endif
+#if defined(LITTLEFS)
+File FSpfile, FSgfile;
+filebuffer_t FSpbuffer, FSgbuffer;
+inline int FSread() {
+    if (LastChar) {
+        char temp = LastChar;
+        LastChar = 0;
+        return temp;
+    }
+    return filereadbyte(FSgfile, &FSgbuffer);
+}
+#endif
+
+/*
+    fileupdate - prepares a file open for update, which is read through gbuffer and written through pbuffer,
+    for reading or writing
+    Moving back over the bytes read ahead before writing, and seeking after writing, also makes the
+    switch between reading and writing that the file system needs.
+*/
+void fileupdate(File& file, filebuffer_t* gbuffer, filebuffer_t* pbuffer, bool output) {
+    if (output) {
+        if (gbuffer->count == 0) return;
+        file.seek(file.position() - (gbuffer->count - gbuffer->index) - (LastChar ? 1 : 0), SeekSet);
+        gbuffer->count = 0;
+        gbuffer->index = 0;
+        LastChar = 0;
+    } else if (gbuffer->count == 0) {
+        fileflush(file, pbuffer);
+        file.seek(file.position(), SeekSet);
+    }
 }
+
+/*
+    streamupdate - prepares the file behind stream for reading or writing if it's an update stream, address 3
+*/
+void streamupdate(int stream, bool output) {
+    if ((stream & 0xFF) != 3) return;
+#if defined(sdcardsupport)
+    if (stream >> 8 == SDSTREAM) fileupdate(SDpfile, &SDgbuffer, &SDpbuffer, output);
 #endif
+#if defined(LITTLEFS)
+    if (stream >> 8 == FLASHSTREAM) fileupdate(FSpfile, &FSgbuffer, &FSpbuffer, output);
+#endif
+}
 
 WiFiClient client;
 WiFiServer server(80);
@@ -2348,10 +3333,37 @@ inline int WiFiread() {
         LastChar = 0;
         return temp;
     }
+    flushoutput();
     while (!client.available()) testescape();
     return client.read();
 }
 
+/*
+    flushoutput - writes any buffered output to its stream as one block
+*/
+void flushoutput() {
+    int n = OutCount;
+    if (n == 0) return;
+    OutCount = 0;
+    int streamtype = OutSink >> 8;
+    if (streamtype == SERIALSTREAM) {
+        if ((OutSink & 0xFF) == 0) Serial.write((const uint8_t*)OutBuffer, n);
+        else Serial1.write((const uint8_t*)OutBuffer, n);
+    } else if (streamtype == WIFISTREAM) client.write((const uint8_t*)OutBuffer, n);
+}
+
+/*
+    pbuffer - adds a character to the output buffer for stream, first flushing output for any other stream
+*/
+void pbuffer(int stream, char c) {
+    if (stream != OutSink) {
+        flushoutput();
+        OutSink = stream;
+    }
+    if (OutCount == OUTBUFFERSIZE) flushoutput();
+    OutBuffer[OutCount++] = c;
+}
+
 void serialbegin(int address, int baud) {
     if (address == 1) Serial1.begin((long)baud * 100);
     else error("port not supported", number(address));
@@ -2359,6 +3371,7 @@ void serialbegin(int address, int baud) {
 
 void serialend(int address) {
     if (address == 1) {
+        flushoutput();
         Serial1.flush();
         Serial1.end();
     }
@@ -2384,10 +3397,24 @@ gfun_t gstreamfun(object* args) {
         else if (address == 1) gfun = serial1read;
     }
 #if defined(sdcardsupport)
-    else if (streamtype == SDSTREAM)
+    else if (streamtype == SDSTREAM) {
+        streamupdate(streamtype << 8 | address, false);
         gfun = (gfun_t)SDread;
+    }
+#endif
+#if defined(LITTLEFS)
+    else if (streamtype == FLASHSTREAM) {
+        streamupdate(streamtype << 8 | address, false);
+        gfun = (gfun_t)FSread;
+    }
 #endif
     else if (streamtype == WIFISTREAM) gfun = (gfun_t)WiFiread;
+    else if (streamtype == STRINGSTREAM) {
+        // A stream that outlived its with-input-from-string has the address of a slot that may have been reused
+        if (address == 0 || address > StringStreamTop || StringStreamObjects[address - 1] != first(args)) error2("not an open string input stream");
+        GlobalStringCursor = &StringStreams[address - 1];
+        gfun = gstrstream;
+    }
     else error2("unknown stream type");
     return gfun;
 }
@@ -2404,18 +3431,19 @@ inline void i2c1write(char c) {
 }
 #endif
 inline void serial1write(char c) {
-    Serial1.write(c);
+    pbuffer(SERIALSTREAM << 8 | 1, c);
 }
 inline void WiFiwrite(char c) {
-    client.write(c);
+    pbuffer(WIFISTREAM << 8, c);
 }
 #if defined(sdcardsupport)
 inline void SDwrite(char c) {
-    int w = SDpfile.write(c);
-    if (w != 1) {
-        Context = NIL;
-        error2("failed to write to file");
-    }
+    filewritebyte(SDpfile, &SDpbuffer, c);
+}
+#endif
+#if defined(LITTLEFS)
+inline void FSwrite(char c) {
+    filewritebyte(FSpfile, &FSpbuffer, c);
 }
 #endif
 #if defined(gfxsupport)
@@ -2443,11 +3471,20 @@ pfun_t pstreamfun(object* args) {
         if (address == 0) pfun = pserial;
         else if (address == 1) pfun = serial1write;
     } else if (streamtype == STRINGSTREAM) {
+        if (address != 0) error2("not an output stream");
         pfun = pstr;
     }
 #if defined(sdcardsupport)
-    else if (streamtype == SDSTREAM)
+    else if (streamtype == SDSTREAM) {
+        streamupdate(streamtype << 8 | address, true);
         pfun = (pfun_t)SDwrite;
+    }
+#endif
+#if defined(LITTLEFS)
+    else if (streamtype == FLASHSTREAM) {
+        streamupdate(streamtype << 8 | address, true);
+        pfun = (pfun_t)FSwrite;
+    }
 #endif
 #if defined(gfxsupport)
     else if (streamtype == GFXSTREAM) pfun = (pfun_t)gfxwrite;
@@ -2503,7 +3540,16 @@ void nonote(int pin) {
 
 void initsleep() {}
 
+// Escape
+
+void initescape() {
+#if !ARDUINO_USB_CDC_ON_BOOT
+    Serial.onReceive(serialreceive);
+#endif
+}
+
 void doze(int secs) {
+    flushoutput();
     delay(1000 * secs);
 }
 
@@ -2624,6 +3670,23 @@ void superprint(object* form, int lm, pfun_t pfun) {
     }
 }
 
+/*
+    editkey - reads one key for the tree editor as soon as it's typed, rather than waiting for a whole line,
+    and echoes it; returns Return or Enter as '\n', ignoring the '\n' of a "\r\n" pair
+*/
+char editkey() {
+    static bool cr = false;
+    bool raw = tstflag(RAWSERIAL);
+    setflag(RAWSERIAL);
+    char c = gserial();
+    if (c == '\n' && cr) c = gserial();
+    if (!raw) clrflag(RAWSERIAL);
+    cr = (c == '\r');
+    if (cr) c = '\n';
+    if (c != '\n' && !tstflag(NOECHO)) pserial(c);
+    return c;
+}
+
 /*
     edit - the Lisp tree editor
     Steps through a function definition, editing it a bit at a time, using single-key editing commands.
@@ -2631,7 +3694,7 @@ void superprint(object* form, int lm, pfun_t pfun) {
 object* edit(object* fun) {
     while (1) {
         if (tstflag(EXITEDITOR)) return fun;
-        char c = gserial();
+        char c = editkey();
         if (c == 'q') setflag(EXITEDITOR);
         else if (c == 'b') return fun;
         else if (c == 'r') fun = read(gserial);
@@ -2694,6 +3757,7 @@ object* sp_defun(object* args, object* env) {
     object* val = cons(bsymbol(LAMBDA), cdr(args));
     object* pair = value(var->name, GlobalEnv);
     if (consp(var) && !pair) pair = find_setf_func(GlobalEnv, second(var));
+    Epoch++;
     if (pair != NULL) cdr(pair) = val;
     else push(cons(var, val), GlobalEnv);
     return var;
@@ -2714,6 +3778,7 @@ object* sp_defvar(object* args, object* env) {
         clrflag(NOESC);
     }
     object* pair = value(var->name, GlobalEnv);
+    Epoch++;
     if (pair != NULL) cdr(pair) = val;
     else push(cons(var, val), GlobalEnv);
     return var;
@@ -2729,6 +3794,7 @@ object* sp_defmacro(object* args, object* env) {
     if (!symbolp(var)) error(notasymbol, var);
     object* val = cons(bsymbol(MACRO), cdr(args));
     object* pair = value(var->name, GlobalEnv);
+    Epoch++;
     if (pair != NULL) cdr(pair) = val;
     else push(cons(var, val), GlobalEnv);
     return var;
@@ -2745,6 +3811,7 @@ object* sp_setq(object* args, object* env) {
         if (cdr(args) == NULL) error2(oddargs);
         object* pair = findvalue(first(args), env);
         arg = eval(second(args), env);
+        redefine(pair);
         cdr(pair) = arg;
         args = cddr(args);
     }
@@ -2939,6 +4006,10 @@ object* sp_setf(object* args, object* env) {
             }
         }
         arg = eval(second(args), env);
+        if (consp(placeform) && symbolp(first(placeform)) && first(placeform)->name == sym(GETHASH)) {
+            setgethash(cdr(placeform), arg, env);
+            goto next;
+        }
         loc = place(placeform, env, &bit);
         if (bit == -1) *loc = arg;
         else if (bit < -1) (*loc)->chars = ((*loc)->chars & ~(0xff << ((-bit - 2) << 3))) | checkchar(arg) << ((-bit - 2) << 3);
@@ -3094,6 +4165,7 @@ object* sp_formillis(object* args, object* env) {
     unsigned long now, total = 0;
     if (param != NULL) total = checkinteger(eval(first(param), env));
     progn_no_tc(cdr(args), env);
+    flushoutput();
     do {
         now = millis() - start;
         testescape();
@@ -3144,6 +4216,30 @@ object* sp_withoutputtostring(object* args, object* env) {
     return string;
 }
 
+/*
+    (with-input-from-string (str string) form*)
+    Evaluates the forms with str bound to a string-stream that reads from string.
+    Each stream keeps its own position, so the forms can be nested.
+*/
+object* sp_withinputfromstring(object* args, object* env) {
+    object* params = checkarguments(args, 2, 2);
+    object* var = first(params);
+    object* string = checkstring(eval(second(params), env));
+    if (StringStreamTop == STRINGSTREAMS) error2("string streams nested too deeply");
+    protect(string);
+    cursorstart(&StringStreams[StringStreamTop], string, 0);
+    object* str = stream(STRINGSTREAM, StringStreamTop + 1);
+    StringStreamObjects[StringStreamTop] = str;
+    StringStreamTop++;
+    object* pair = cons(var, str);
+    push(pair, env);
+    object* forms = cdr(args);
+    object* result = progn_no_tc(forms, env);
+    StringStreamTop--;
+    unprotect();
+    return result;
+}
+
 /*
     (with-serial (str port [baud]) form*)
     Evaluates the forms with str bound to a serial-stream using port.
@@ -3248,7 +4344,8 @@ object* sp_withspi(object* args, object* env) {
 /*
     (with-sd-card (str filename [mode]) form*)
     Evaluates the forms with str bound to an sd-stream reading from or writing to the file filename.
-    If mode is omitted the file is read, otherwise 0 means read, 1 write-append, or 2 write-overwrite.
+    If mode is omitted the file is read, otherwise 0 means read, 1 write-append, 2 write-overwrite,
+    or 3 update, which keeps the contents so that records can be read and rewritten with file-position.
 */
 object* sp_withsdcard(object* args, object* env) {
 #if defined(sdcardsupport)
@@ -3267,21 +4364,100 @@ object* sp_withsdcard(object* args, object* env) {
     const char* oflag = FILE_READ;
     if (mode == 1) oflag = FILE_APPEND;
     else if (mode == 2) oflag = FILE_WRITE;
+    else if (mode == 3) oflag = "r+";
     if (mode >= 1) {
         char buffer[BUFFERSIZE];
         SDpfile = SD.open(MakeFilename(filename, buffer), oflag);
         if (!SDpfile) error("problem writing to SD card or invalid filename", filename);
+        SDpbuffer.count = 0;
+        if (mode == 3) {
+            SDgfile = SDpfile;  // Read and written through the same file
+            SDgbuffer.count = 0;
+            SDgbuffer.index = 0;
+        }
     } else {
         char buffer[BUFFERSIZE];
         SDgfile = SD.open(MakeFilename(filename, buffer), oflag);
         if (!SDgfile) error("problem reading from SD card or invalid filename", filename);
+        SDgbuffer.count = 0;
+        SDgbuffer.index = 0;
     }
-    object* pair = cons(var, stream(SDSTREAM, 1));
+    object* pair = cons(var, stream(SDSTREAM, (mode == 3) ? 3 : (mode >= 1) ? 2 : 1));
     push(pair, env);
     object* forms = cdr(args);
     object* result = progn_no_tc(forms, env);
-    if (mode >= 1) SDpfile.close();
-    else SDgfile.close();
+    if (mode >= 1) {
+        fileflush(SDpfile, &SDpbuffer);
+        SDpfile.close();
+        if (mode == 3) SDgfile = File();
+    } else SDgfile.close();
+    return result;
+#else
+    (void)args, (void)env;
+    error2("not supported");
+    return nil;
+#endif
+}
+
+/*
+    flashbegin - mounts the LittleFS filesystem in flash, formatting it the first time
+*/
+void flashbegin() {
+#if defined(LITTLEFS)
+    if (!LittleFS.begin(true)) error2("problem mounting flash filesystem");
+#else
+    error2("not supported");
+#endif
+}
+
+/*
+    (with-flash-file (str filename [mode]) form*)
+    Evaluates the forms with str bound to a flash-stream reading from or writing to the file filename
+    in the LittleFS filesystem in flash. Mode is as for with-sd-card.
+*/
+object* sp_withflashfile(object* args, object* env) {
+#if defined(LITTLEFS)
+    object* params = checkarguments(args, 2, 3);
+    object* var = first(params);
+    params = cdr(params);
+    if (params == NULL) error2("no filename specified");
+    builtin_t temp = Context;
+    object* filename = eval(first(params), env);
+    Context = temp;
+    if (!stringp(filename)) error("filename is not a string", filename);
+    params = cdr(params);
+    flashbegin();
+    int mode = 0;
+    if (params != NULL && first(params) != NULL) mode = checkinteger(first(params));
+    const char* oflag = FILE_READ;
+    if (mode == 1) oflag = FILE_APPEND;
+    else if (mode == 2) oflag = FILE_WRITE;
+    else if (mode == 3) oflag = "r+";
+    char buffer[BUFFERSIZE];
+    if (mode >= 1) {
+        FSpfile = LittleFS.open(MakeFilename(filename, buffer), oflag);
+        if (!FSpfile) error("problem writing to flash or invalid filename", filename);
+        FSpbuffer.count = 0;
+        if (mode == 3) {
+            FSgfile = FSpfile;  // Read and written through the same file
+            FSgbuffer.count = 0;
+            FSgbuffer.index = 0;
+        }
+    } else {
+        FSgfile = LittleFS.open(MakeFilename(filename, buffer), oflag);
+        if (!FSgfile) error("problem reading from flash or invalid filename", filename);
+        FSgbuffer.count = 0;
+        FSgbuffer.index = 0;
+    }
+    object* pair = cons(var, stream(FLASHSTREAM, (mode == 3) ? 3 : (mode >= 1) ? 2 : 1));
+    push(pair, env);
+    object* forms = cdr(args);
+    object* result = progn_no_tc(forms, env);
+    if (mode >= 1) {
+        fileflush(FSpfile, &FSpbuffer);
+        FSpfile.close();
+        if (mode == 3) FSgfile = File();
+    } else FSgfile.close();
     return result;
 #else
     (void)args, (void)env;
@@ -3290,6 +4466,77 @@ object* sp_withsdcard(object* args, object* env) {
 #endif
 }
 
+/*
+    (directory [dirname])
+    Returns a list of the names of the files in a directory in flash, default the root directory.
+    The names of subdirectories end in a slash.
+*/
+object* fn_directory(object* args, object* env) {
+    (void)env;
+#if defined(LITTLEFS)
+    flashbegin();
+    char buffer[BUFFERSIZE];
+    const char* dirname = "/";
+    if (args != NULL) dirname = MakeFilename(checkstring(first(args)), buffer);
+    File dir = LittleFS.open(dirname);
+    if (!dir || !dir.isDirectory()) error("not a directory", (args != NULL) ? first(args) : nil);
+    object* result = cons(NULL, NULL);
+    object* tail = result;
+    protect(result);
+    File file = dir.openNextFile();
+    while (file) {
+        snprintf(buffer, BUFFERSIZE, file.isDirectory() ? "%s/" : "%s", file.name());
+        cdr(tail) = cons(lispstring(buffer), NULL);
+        tail = cdr(tail);
+        file.close();
+        file = dir.openNextFile();
+    }
+    dir.close();
+    unprotect();
+    return cdr(result);
+#else
+    (void)args;
+    error2("not supported");
+    return nil;
+#endif
+}
+
+/*
+    (delete-file filename)
+    Deletes a file in flash. Returns t if it was deleted, or nil if it couldn't be.
+*/
+object* fn_deletefile(object* args, object* env) {
+    (void)env;
+#if defined(LITTLEFS)
+    flashbegin();
+    char buffer[BUFFERSIZE];
+    return LittleFS.remove(MakeFilename(checkstring(first(args)), buffer)) ? tee : nil;
+#else
+    (void)args;
+    error2("not supported");
+    return nil;
+#endif
+}
+
+/*
+    (rename-file filename newname)
+    Renames a file in flash. Returns t if it was renamed, or nil if it couldn't be.
+*/
+object* fn_renamefile(object* args, object* env) {
+    (void)env;
+#if defined(LITTLEFS)
+    flashbegin();
+    char buffer[BUFFERSIZE], buffer2[BUFFERSIZE];
+    MakeFilename(checkstring(first(args)), buffer);
+    MakeFilename(checkstring(second(args)), buffer2);
+    return LittleFS.rename(buffer, buffer2) ? tee : nil;
+#else
+    (void)args;
+    error2("not supported");
+    return nil;
+#endif
+}
+
 // Tail-recursive forms
 
 /*
@@ -3513,6 +4760,7 @@ object* fn_setfn(object* args, object* env) {
         if (cdr(args) == NULL) error2(oddargs);
         object* pair = findvalue(first(args), env);
         arg = second(args);
+        redefine(pair);
         cdr(pair) = arg;
         args = cddr(args);
     }
@@ -3949,7 +5197,7 @@ object* fn_mapcon(object* args, object* env) {
 /*
     (+ number*)
     Adds its arguments together.
-    If each argument is an integer, and the running total doesn't overflow, the result is an integer,
+    If each argument is an integer the result is an integer, promoted to a bignum if it overflows,
     otherwise a floating-point number.
 */
 object* fn_add(object* args, object* env) {
@@ -3961,12 +5209,13 @@ object* fn_add(object* args, object* env) {
         else if (integerp(arg)) {
             int val = arg->integer;
             if (val < 1) {
-                if (INT_MIN - val > result) return add_floats(args, (float)result);
+                if (INT_MIN - val > result) return add_bignums(args, number(result));
             } else {
-                if (INT_MAX - val < result) return add_floats(args, (float)result);
+                if (INT_MAX - val < result) return add_bignums(args, number(result));
             }
             result = result + val;
-        } else error(notanumber, arg);
+        } else if (bignump(arg)) return add_bignums(args, number(result));
+        else error(notanumber, arg);
         args = cdr(args);
     }
     return number(result);
@@ -3976,7 +5225,7 @@ object* fn_add(object* args, object* env) {
     (- number*)
     If there is one argument, negates the argument.
     If there are two or more arguments, subtracts the second and subsequent arguments from the first argument.
-    If each argument is an integer, and the running total doesn't overflow, returns the result as an integer,
+    If each argument is an integer the result is an integer, promoted to a bignum if it overflows,
     otherwise a floating-point number.
 */
 object* fn_subtract(object* args, object* env) {
@@ -3985,6 +5234,7 @@ object* fn_subtract(object* args, object* env) {
     args = cdr(args);
     if (args == NULL) return negate(arg);
     else if (floatp(arg)) return subtract_floats(args, arg->single_float);
+    else if (bignump(arg)) return subtract_bignums(args, arg);
     else if (integerp(arg)) {
         int result = arg->integer;
         while (args != NULL) {
@@ -3993,12 +5243,13 @@ object* fn_subtract(object* args, object* env) {
             else if (integerp(arg)) {
                 int val = (car(args))->integer;
                 if (val < 1) {
-                    if (INT_MAX + val < result) return subtract_floats(args, result);
+                    if (INT_MAX + val < result) return subtract_bignums(args, number(result));
                 } else {
-                    if (INT_MIN + val > result) return subtract_floats(args, result);
+                    if (INT_MIN + val > result) return subtract_bignums(args, number(result));
                 }
                 result = result - val;
-            } else error(notanumber, arg);
+            } else if (bignump(arg)) return subtract_bignums(args, number(result));
+            else error(notanumber, arg);
             args = cdr(args);
         }
         return number(result);
@@ -4009,7 +5260,7 @@ object* fn_subtract(object* args, object* env) {
 /*
     (* number*)
     Multiplies its arguments together.
-    If each argument is an integer, and the running total doesn't overflow, the result is an integer,
+    If each argument is an integer the result is an integer, promoted to a bignum if it overflows,
     otherwise it's a floating-point number.
 */
 object* fn_multiply(object* args, object* env) {
@@ -4020,9 +5271,10 @@ object* fn_multiply(object* args, object* env) {
         if (floatp(arg)) return multiply_floats(args, result);
         else if (integerp(arg)) {
             int64_t val = result * (int64_t)(arg->integer);
-            if ((val > INT_MAX) || (val < INT_MIN)) return multiply_floats(args, result);
+            if ((val > INT_MAX) || (val < INT_MIN)) return multiply_bignums(args, number(result));
             result = val;
-        } else error(notanumber, arg);
+        } else if (bignump(arg)) return multiply_bignums(args, number(result));
+        else error(notanumber, arg);
         args = cdr(args);
     }
     return number(result);
@@ -4049,15 +5301,17 @@ object* fn_divide(object* args, object* env) {
             if (i == 0) error2("division by zero");
             else if (i == 1) return number(1);
             else return makefloat(1.0 / i);
-        } else error(notanumber, arg);
+        } else if (bignump(arg)) return makefloat(1.0 / bignumfloat(arg));
+        else error(notanumber, arg);
     }
     // Multiple arguments
     if (floatp(arg)) return divide_floats(args, arg->single_float);
+    else if (bignump(arg)) return divide_floats(args, bignumfloat(arg));
     else if (integerp(arg)) {
         int result = arg->integer;
         while (args != NULL) {
             arg = car(args);
-            if (floatp(arg)) {
+            if (floatp(arg) || bignump(arg)) {
                 return divide_floats(args, result);
             } else if (integerp(arg)) {
                 int i = arg->integer;
@@ -4102,7 +5356,7 @@ object* fn_mod(object* args, object* env) {
 /*
     (1+ number)
     Adds one to its argument and returns it.
-    If the argument is an integer the result is an integer if possible;
+    If the argument is an integer the result is an integer, promoted to a bignum if it overflows;
     otherwise it's a floating-point number.
 */
 object* fn_oneplus(object* args, object* env) {
@@ -4111,16 +5365,17 @@ object* fn_oneplus(object* args, object* env) {
     if (floatp(arg)) return makefloat((arg->single_float) + 1.0);
     else if (integerp(arg)) {
         int result = arg->integer;
-        if (result == INT_MAX) return makefloat((arg->integer) + 1.0);
+        if (result == INT_MAX) return bignumadd(arg, number(1), false);
         else return number(result + 1);
-    } else error(notanumber, arg);
+    } else if (bignump(arg)) return bignumadd(arg, number(1), false);
+    else error(notanumber, arg);
     return nil;
 }
 
 /*
     (1- number)
     Subtracts one from its argument and returns it.
-    If the argument is an integer the result is an integer if possible;
+    If the argument is an integer the result is an integer, promoted to a bignum if it overflows;
     otherwise it's a floating-point number.
 */
 object* fn_oneminus(object* args, object* env) {
@@ -4129,16 +5384,17 @@ object* fn_oneminus(object* args, object* env) {
     if (floatp(arg)) return makefloat((arg->single_float) - 1.0);
     else if (integerp(arg)) {
         int result = arg->integer;
-        if (result == INT_MIN) return makefloat((arg->integer) - 1.0);
+        if (result == INT_MIN) return bignumadd(arg, number(1), true);
         else return number(result - 1);
-    } else error(notanumber, arg);
+    } else if (bignump(arg)) return bignumadd(arg, number(1), true);
+    else error(notanumber, arg);
     return nil;
 }
 
 /*
     (abs number)
     Returns the absolute, positive value of its argument.
-    If the argument is an integer the result will be returned as an integer if possible,
+    If the argument is an integer the result will be returned as an integer, promoted to a bignum if necessary,
     otherwise a floating-point number.
 */
 object* fn_abs(object* args, object* env) {
@@ -4147,9 +5403,10 @@ object* fn_abs(object* args, object* env) {
     if (floatp(arg)) return makefloat(abs(arg->single_float));
     else if (integerp(arg)) {
         int result = arg->integer;
-        if (result == INT_MIN) return makefloat(abs((float)result));
+        if (result == INT_MIN) return negatebignum(arg);
         else return number(abs(result));
-    } else error(notanumber, arg);
+    } else if (bignump(arg)) return bignumminusp(arg) ? negatebignum(arg) : arg;
+    else error(notanumber, arg);
     return nil;
 }
 
@@ -4219,6 +5476,8 @@ object* fn_noteq(object* args, object* env) {
             object* arg2 = first(nargs);
             if (integerp(arg1) && integerp(arg2)) {
                 if ((arg1->integer) == (arg2->integer)) return nil;
+            } else if (integerish(arg1) && integerish(arg2)) {
+                if (bignumcompare(arg1, arg2) == 0) return nil;
             } else if ((checkintfloat(arg1) == checkintfloat(arg2))) return nil;
             nargs = cdr(nargs);
         }
@@ -4281,6 +5540,7 @@ object* fn_plusp(object* args, object* env) {
     object* arg = first(args);
     if (floatp(arg)) return ((arg->single_float) > 0.0) ? tee : nil;
     else if (integerp(arg)) return ((arg->integer) > 0) ? tee : nil;
+    else if (bignump(arg)) return bignumminusp(arg) ? nil : tee;
     else error(notanumber, arg);
     return nil;
 }
@@ -4294,6 +5554,7 @@ object* fn_minusp(object* args, object* env) {
     object* arg = first(args);
     if (floatp(arg)) return ((arg->single_float) < 0.0) ? tee : nil;
     else if (integerp(arg)) return ((arg->integer) < 0) ? tee : nil;
+    else if (bignump(arg)) return bignumminusp(arg) ? tee : nil;
     else error(notanumber, arg);
     return nil;
 }
@@ -4307,6 +5568,7 @@ object* fn_zerop(object* args, object* env) {
     object* arg = first(args);
     if (floatp(arg)) return ((arg->single_float) == 0.0) ? tee : nil;
     else if (integerp(arg)) return ((arg->integer) == 0) ? tee : nil;
+    else if (bignump(arg)) return nil;
     else error(notanumber, arg);
     return nil;
 }
@@ -4317,7 +5579,7 @@ object* fn_zerop(object* args, object* env) {
 */
 object* fn_oddp(object* args, object* env) {
     (void)env;
-    int arg = checkinteger(first(args));
+    int arg = bignump(first(args)) ? cdr(first(args))->integer : checkinteger(first(args));
     return ((arg & 1) == 1) ? tee : nil;
 }
 
@@ -4327,7 +5589,7 @@ object* fn_oddp(object* args, object* env) {
 */
 object* fn_evenp(object* args, object* env) {
     (void)env;
-    int arg = checkinteger(first(args));
+    int arg = bignump(first(args)) ? cdr(first(args))->integer : checkinteger(first(args));
     return ((arg & 1) == 0) ? tee : nil;
 }
 
@@ -4339,7 +5601,7 @@ object* fn_evenp(object* args, object* env) {
 */
 object* fn_integerp(object* args, object* env) {
     (void)env;
-    return integerp(first(args)) ? tee : nil;
+    return integerish(first(args)) ? tee : nil;
 }
 
 /*
@@ -4349,7 +5611,7 @@ object* fn_integerp(object* args, object* env) {
 object* fn_numberp(object* args, object* env) {
     (void)env;
     object* arg = first(args);
-    return (integerp(arg) || floatp(arg)) ? tee : nil;
+    return (integerish(arg) || floatp(arg)) ? tee : nil;
 }
 
 // Floating-point functions
@@ -4676,36 +5938,157 @@ object* fn_stringgreatereq(object* args, object* env) {
     return m == -1 ? nil : number(m);
 }
 
+// Sorting
+
+typedef struct {
+    object* predicate;
+    object* key;
+    object* compare;  // Reused argument list for the predicate
+    object* env;
+    int fast;  // 1 if the predicate is <, -1 if it's >, otherwise 0
+} sort_t;
+
+/*
+    sortspec - sets up sort for the predicate and key function, protecting the argument list it uses
+    The caller must unprotect() it.
+*/
+void sortspec(sort_t* sort, object* predicate, object* key, object* env) {
+    sort->predicate = predicate;
+    sort->key = key;
+    sort->env = env;
+    sort->fast = 0;
+    if (bfunctionp(predicate) && builtinp(predicate->name)) {
+        fn_ptr_type fn = lookupfn(builtin(predicate->name));
+        if (fn == fn_less) sort->fast = 1;
+        else if (fn == fn_greater) sort->fast = -1;
+    }
+    sort->compare = cons(NULL, cons(NULL, NULL));
+    protect(sort->compare);
+}
+
 /*
-    (sort list test)
-    Destructively sorts list according to the test function, using an insertion sort, and returns the sorted list.
+    sortbefore - returns true if a should sort before b
+    Compares fixnums directly when the predicate is < or >, otherwise applies the key and the predicate.
 */
-object* fn_sort(object* args, object* env) {
-    if (first(args) == NULL) return nil;
-    object* list = cons(nil, first(args));
-    protect(list);
-    object* predicate = second(args);
-    object* compare = cons(NULL, cons(NULL, NULL));
-    protect(compare);
-    object* ptr = cdr(list);
-    while (cdr(ptr) != NULL) {
-        object* go = list;
-        while (go != ptr) {
-            car(compare) = car(cdr(ptr));
-            car(cdr(compare)) = car(cdr(go));
-            if (apply(predicate, compare, env)) break;
-            go = cdr(go);
-        }
-        if (go != ptr) {
-            object* obj = cdr(ptr);
-            cdr(ptr) = cdr(obj);
-            cdr(obj) = cdr(go);
-            cdr(go) = obj;
-        } else ptr = cdr(ptr);
+bool sortbefore(sort_t* sort, object* a, object* b) {
+    object* compare = sort->compare;
+    if (sort->key != NULL) {
+        car(compare) = apply(sort->key, cons(a, NULL), sort->env);
+        car(cdr(compare)) = apply(sort->key, cons(b, NULL), sort->env);
+    } else {
+        car(compare) = a;
+        car(cdr(compare)) = b;
+    }
+    object* x = car(compare);
+    object* y = car(cdr(compare));
+    if (sort->fast != 0 && integerp(x) && integerp(y)) {
+        return (sort->fast > 0) ? (x->integer < y->integer) : (x->integer > y->integer);
+    }
+    return apply(sort->predicate, compare, sort->env) != NULL;
+}
+
+/*
+    takerun - moves the first width cells of the list in rest to run
+*/
+void takerun(object** run, object** rest, int width) {
+    *run = *rest;
+    if (*run == NULL) return;
+    object* p = *run;
+    for (int i = 1; i < width && cdr(p) != NULL; i++) p = cdr(p);
+    *rest = cdr(p);
+    cdr(p) = nil;
+}
+
+/*
+    sortlist - destructively sorts list with a bottom-up merge sort, relinking the cells without allocating
+    The merge is stable. The pieces of the list in progress are kept in slots so they stay reachable
+    if the predicate causes a garbage collection.
+*/
+object* sortlist(object* list, sort_t* sort) {
+    object* slots = cons(cons(nil, list), cons(nil, cons(nil, cons(nil, nil))));
+    protect(slots);
+    object* head = car(slots);
+    object** a = &car(cdr(slots));
+    object** b = &car(cddr(slots));
+    object** rest = &car(cdr(cddr(slots)));
+    for (int width = 1;; width = width * 2) {
+        *rest = cdr(head);
+        cdr(head) = nil;
+        object* tail = head;
+        int merges = 0;
+        while (*rest != NULL) {
+            merges++;
+            takerun(a, rest, width);
+            takerun(b, rest, width);
+            // Merge the two runs onto the tail
+            while (*a != NULL && *b != NULL) {
+                object** from = sortbefore(sort, car(*b), car(*a)) ? b : a;
+                cdr(tail) = *from;
+                tail = *from;
+                *from = cdr(*from);
+            }
+            cdr(tail) = (*a != NULL) ? *a : *b;
+            while (cdr(tail) != NULL) tail = cdr(tail);
+            *a = nil;
+            *b = nil;
+        }
+        if (merges <= 1) break;
     }
     unprotect();
+    return cdr(head);
+}
+
+/*
+    sortvector - sorts the elements of a one-dimensional array in place with a heapsort
+*/
+void sortvector(object* array, sort_t* sort) {
+    object* dimensions = cddr(array);
+    if (cdr(dimensions) != NULL) error("array must be one-dimensional", array);
+    int size = first(dimensions)->integer;
+    if (size < 0) error("can't sort a bit array", array);
+    for (int end = size, start = size / 2; end > 1;) {
+        if (start > 0) start--;  // Build the heap
+        else {                   // Move the largest element to the end
+            end--;
+            object** p = arrayref(array, 0, size);
+            object** q = arrayref(array, end, size);
+            object* temp = *p;
+            *p = *q;
+            *q = temp;
+        }
+        // Sift down
+        int root = start;
+        while (2 * root + 1 < end) {
+            int child = 2 * root + 1;
+            if (child + 1 < end && sortbefore(sort, *arrayref(array, child, size), *arrayref(array, child + 1, size))) child++;
+            object** r = arrayref(array, root, size);
+            object** c = arrayref(array, child, size);
+            if (!sortbefore(sort, *r, *c)) break;
+            object* temp = *r;
+            *r = *c;
+            *c = temp;
+            root = child;
+        }
+    }
+}
+
+/*
+    (sort sequence test [:key function])
+    Destructively sorts a list or vector according to the test function, and returns the sorted sequence.
+    Lists are sorted with a stable merge sort; vectors are sorted in place.
+*/
+object* fn_sort(object* args, object* env) {
+    object* seq = first(args);
+    if (seq == NULL) return nil;
+    sort_t sort;
+    sortspec(&sort, second(args), keyargument(cddr(args)), env);
+    if (arrayp(seq)) sortvector(seq, &sort);
+    else if (listp(seq)) {
+        for (object* list = seq; consp(list); list = cdr(list)) checkwritable(list);
+        seq = sortlist(seq, &sort);
+    } else error("argument is not a list or vector", seq);
     unprotect();
-    return cdr(list);
+    return seq;
 }
 
 /*
@@ -4776,8 +6159,10 @@ object* fn_subseq(object* args, object* env) {
         if (start > end || end > length) error2(indexrange);
         object* result = newstring();
         object* tail = result;
+        stringcursor_t cursor;
+        cursorstart(&cursor, arg, start);
         for (int i = start; i < end; i++) {
-            char ch = nthchar(arg, i);
+            char ch = cursornext(&cursor);
             buildstring(ch, &tail);
         }
         return result;
@@ -4785,44 +6170,152 @@ object* fn_subseq(object* args, object* env) {
     return nil;
 }
 
+// Searching
+
 /*
-    (search pattern target [:test function])
-    Returns the index of the first occurrence of pattern in target, or nil if it's not found.
-    The target can be a list or string. If it's a list a test function can be specified; default eq.
+    searchstring - returns the index of the first occurrence of pattern in target between start and end, or -1
+    Uses Boyer-Moore-Horspool, holding the current window of the target in a ring buffer
 */
-object* fn_search(object* args, object* env) {
-    (void)env;
-    object* pattern = first(args);
-    object* target = second(args);
-    if (pattern == NULL) return number(0);
-    else if (target == NULL) return nil;
-    else if (listp(pattern) && listp(target)) {
-        object* test = testargument(cddr(args));
-        int l = listlength(target);
-        int m = listlength(pattern);
-        for (int i = 0; i <= l - m; i++) {
-            object* target1 = target;
-            while (pattern != NULL && apply(test, cons(car(target1), cons(car(pattern), NULL)), env) != NULL) {
-                pattern = cdr(pattern);
-                target1 = cdr(target1);
-            }
-            if (pattern == NULL) return number(i);
-            pattern = first(args);
-            target = cdr(target);
+int searchstring(object* pattern, object* target, int start, int end) {
+    int m = stringlength(pattern);
+    if (m == 0) return start;
+    if (end - start < m) return -1;
+    stringcursor_t t, p;
+    cursorstart(&t, target, start);
+    if (m > SEARCHMAX) {
+        for (int i = start; i <= end - m; i++) {
+            stringcursor_t t1 = t;
+            cursorstart(&p, pattern, 0);
+            int j = 0;
+            while (j < m && cursornext(&t1) == cursornext(&p)) j++;
+            if (j == m) return i;
+            cursornext(&t);
         }
-        return nil;
-    } else if (stringp(pattern) && stringp(target)) {
-        if (cddr(args) != NULL) error2("use of :test argument not supported for strings");
-        int l = stringlength(target);
-        int m = stringlength(pattern);
-        for (int i = 0; i <= l - m; i++) {
+        return -1;
+    }
+    char pat[SEARCHMAX], window[SEARCHMAX];
+    uint8_t skip[256];
+    cursorstart(&p, pattern, 0);
+    for (int j = 0; j < m; j++) pat[j] = cursornext(&p);
+    for (int c = 0; c < 256; c++) skip[c] = m;
+    for (int j = 0; j < m - 1; j++) skip[(uint8_t)pat[j]] = m - 1 - j;
+    for (int j = 0; j < m; j++) window[j] = cursornext(&t);
+    int i = start, w = 0;  // window[w] holds target[i]
+    while (true) {
+        char last = window[(w + m - 1) % m];
+        if (last == pat[m - 1]) {
             int j = 0;
-            while (j < m && nthchar(target, i + j) == nthchar(pattern, j)) j++;
-            if (j == m) return number(i);
+            while (j < m - 1 && window[(w + j) % m] == pat[j]) j++;
+            if (j == m - 1) return i;
         }
-        return nil;
-    } else error2("arguments are not both lists or strings");
-    return nil;
+        int shift = skip[(uint8_t)last];
+        if (i + m + shift > end) return -1;
+        for (int k = 0; k < shift; k++) window[(w + k) % m] = cursornext(&t);
+        i = i + shift;
+        w = (w + shift) % m;
+    }
+}
+
+/*
+    searchmatch - compares an element of the target with an element of the pattern
+    kind is 0 for eq, 1 for equal, or -1 to call the test function
+*/
+bool searchmatch(object* x, object* y, int kind, object* test, object* env) {
+    if (kind == 0) return eq(x, y);
+    if (kind == 1) return equal(x, y);
+    return apply(test, cons(x, cons(y, NULL)), env) != NULL;
+}
+
+/*
+    searchlist - returns the index of the first occurrence of the list pattern in target between start and end, or -1
+    Uses Knuth-Morris-Pratt when the test is eq, eql, or equal, so the target is never rescanned
+*/
+int searchlist(object* pattern, object* target, int start, int end, object* test, object* env) {
+    int m = listlength(pattern);
+    if (m == 0) return start;
+    for (int i = 0; i < start; i++) target = cdr(target);
+    int kind = -1;
+    if ((symbolp(test) || bfunctionp(test)) && builtinp(test->name)) {
+        fn_ptr_type fn = lookupfn(builtin(test->name));
+        if (fn == fn_eq) kind = 0;
+        else if (fn == fn_equal) kind = 1;
+    }
+    if (kind == -1 || m > SEARCHMAX) {
+        for (int i = start; i <= end - m; i++) {
+            object* t = target;
+            object* p = pattern;
+            while (p != NULL && searchmatch(car(t), car(p), kind, test, env)) {
+                p = cdr(p);
+                t = cdr(t);
+            }
+            if (p == NULL) return i;
+            target = cdr(target);
+        }
+        return -1;
+    }
+    object* pat[SEARCHMAX];
+    uint8_t fail[SEARCHMAX];
+    for (int j = 0; j < m; j++) {
+        pat[j] = car(pattern);
+        pattern = cdr(pattern);
+    }
+    int k = 0;
+    fail[0] = 0;
+    for (int j = 1; j < m; j++) {
+        while (k > 0 && !searchmatch(pat[j], pat[k], kind, test, env)) k = fail[k - 1];
+        if (searchmatch(pat[j], pat[k], kind, test, env)) k++;
+        fail[j] = k;
+    }
+    k = 0;
+    for (int i = start; i < end; i++) {
+        object* x = car(target);
+        target = cdr(target);
+        while (k > 0 && !searchmatch(x, pat[k], kind, test, env)) k = fail[k - 1];
+        if (searchmatch(x, pat[k], kind, test, env)) k++;
+        if (k == m) return i - m + 1;
+    }
+    return -1;
+}
+
+/*
+    (search pattern target [:test function] [:start n] [:end m])
+    Returns the index of the first occurrence of pattern in target, or nil if it's not found.
+    The target can be a list or string. If it's a list a test function can be specified; default eq.
+    Only the part of target from :start up to :end is searched, but the index is counted from the beginning.
+*/
+object* fn_search(object* args, object* env) {
+    object* pattern = first(args);
+    object* target = second(args);
+    object* test = NULL;
+    int start = 0, end = -1;
+    for (object* keys = cddr(args); keys != NULL; keys = cddr(keys)) {
+        if (cdr(keys) == NULL) error("dangling keyword", first(keys));
+        object* keyword = first(keys);
+        if (isbuiltin(keyword, TEST)) test = second(keys);
+        else if (isbuiltin(keyword, START)) {
+            start = checkinteger(second(keys));
+            if (start < 0) error(indexnegative, second(keys));
+        } else if (isbuiltin(keyword, END)) {
+            if (second(keys) != NULL) end = checkinteger(second(keys));
+        } else error("unsupported keyword", keyword);
+    }
+    if (pattern == NULL) return number(start);
+    else if (target == NULL) return nil;
+    int index;
+    if (listp(pattern) && listp(target)) {
+        int length = listlength(target);
+        if (end == -1) end = length;
+        if (start > end || end > length) error2(indexrange);
+        if (test == NULL) test = bfunction_from_symbol(bsymbol(EQ));
+        index = searchlist(pattern, target, start, end, test, env);
+    } else if (stringp(pattern) && stringp(target)) {
+        if (test != NULL) error2("use of :test argument not supported for strings");
+        int length = stringlength(target);
+        if (end == -1) end = length;
+        if (start > end || end > length) error2(indexrange);
+        index = searchstring(pattern, target, start, end);
+    } else error2("arguments are not both lists or strings");
+    return (index < 0) ? nil : number(index);
 }
 
 /*
@@ -4832,10 +6325,12 @@ object* fn_search(object* args, object* env) {
 object* fn_readfromstring(object* args, object* env) {
     (void)env;
     object* arg = checkstring(first(args));
-    GlobalString = arg;
-    GlobalStringIndex = 0;
+    stringcursor_t cursor;
+    cursorstart(&cursor, arg, 0);
+    stringcursor_t* outer = GlobalStringCursor;
+    GlobalStringCursor = &cursor;
     object* val = read(gstr);
-    LastChar = 0;
+    GlobalStringCursor = outer;
     return val;
 }
 
@@ -4985,6 +6480,7 @@ object* fn_makunbound(object* args, object* env) {
     object* var = first(args);
     if (!symbolp(var)) error(notasymbol, var);
     delassoc(var, &GlobalEnv);
+    Epoch++;
     return var;
 }
 
@@ -5130,433 +6626,2736 @@ object* fn_writeline(object* args, object* env) {
     return nil;
 }
 
+// Bulk input and output
+
 /*
-    (restart-i2c stream [read-p])
-    Restarts an i2c-stream.
-    If read-p is nil or omitted the stream is written to.
-    If read-p is an integer it specifies the number of bytes to be read from the stream.
+    sequencelength - returns the length of a string or of a one-dimensional array that can hold bytes
 */
-object* fn_restarti2c(object* args, object* env) {
-    (void)env;
-    int stream = isstream(first(args));
-    args = cdr(args);
-    int read = 0;  // Write
-    I2Ccount = 0;
-    if (args != NULL) {
-        object* rw = first(args);
-        if (integerp(rw)) I2Ccount = rw->integer;
-        read = (rw != NULL);
+int sequencelength(object* seq) {
+    if (stringp(seq)) return stringlength(seq);
+    if (arrayp(seq)) {
+        object* dims = cddr(seq);
+        if (cdr(dims) == NULL && car(dims)->integer >= 0) return car(dims)->integer;
     }
-    int address = stream & 0xFF;
-    if (stream >> 8 != I2CSTREAM) error2("not an i2c stream");
-    TwoWire* port;
-    if (address < 128) port = &Wire;
-#if defined(ULISP_I2C1)
-    else port = &Wire1;
-#endif
-    return I2Crestart(port, address & 0x7F, read) ? tee : nil;
+    error("argument is not a string or vector", seq);
+    return 0;
 }
 
 /*
-    (gc)
-    Forces a garbage collection and prints the number of objects collected, and the time taken.
+    sequencerange - gets the :start and :end keywords for a sequence of the given length
 */
-object* fn_gc(object* obj, object* env) {
-    int initial = Freespace;
-    unsigned long start = micros();
-    gc(obj, env);
-    unsigned long elapsed = micros() - start;
-    pfstring("Space: ", pserial);
-    pint(Freespace - initial, pserial);
-    pfstring(" bytes, Time: ", pserial);
-    pint(elapsed, pserial);
-    pfstring(" us\n", pserial);
-    return nil;
+void sequencerange(object* keys, int length, int* start, int* end) {
+    *start = 0;
+    *end = length;
+    while (keys != NULL) {
+        if (cdr(keys) == NULL) error("dangling keyword", first(keys));
+        object* keyword = first(keys);
+        if (isbuiltin(keyword, START)) *start = checkinteger(second(keys));
+        else if (isbuiltin(keyword, END)) {
+            if (second(keys) != NULL) *end = checkinteger(second(keys));
+        } else error("unsupported keyword", keyword);
+        keys = cddr(keys);
+    }
+    if (*start < 0 || *start > *end || *end > length) error2(indexrange);
 }
 
 /*
-    (room)
-    Returns the number of free Lisp cells remaining.
+    readsequence - reads bytes with gfun into a string or vector from start up to end,
+    and returns the index of the first element not replaced
 */
-object* fn_room(object* args, object* env) {
-    (void)args, (void)env;
-    return number(Freespace);
+int readsequence(object* seq, gfun_t gfun, int start, int end) {
+    int i = start;
+    if (i == end) return i;
+    checkwritable(seq);
+    if (stringp(seq)) {
+        formatuncache(seq);
+        stringcursor_t cursor;
+        cursorstart(&cursor, seq, start);
+        while (i < end) {
+            int c = gfun();
+            if (c == -1) break;
+            if (c == 0) error2("can't read a zero byte into a string");  // It would end the string
+            cursorput(&cursor, c);
+            i++;
+        }
+    } else {
+        object* bytes[256];
+        memset(bytes, 0, sizeof(bytes));
+        int size = car(cddr(seq))->integer;
+        while (i < end) {
+            int c = gfun();
+            if (c == -1) break;
+            c = c & 0xFF;
+            if (bytes[c] == NULL) bytes[c] = number(c);
+            *arrayref(seq, i, size) = bytes[c];
+            i++;
+        }
+    }
+    return i;
 }
 
 /*
-    (cls)
-    Prints a clear-screen character.
+    writesequence - writes the characters or bytes of a string or vector from start up to end with pfun
 */
-object* fn_cls(object* args, object* env) {
-    (void)args, (void)env;
-    pserial(12);
-    return nil;
+void writesequence(object* seq, pfun_t pfun, int start, int end) {
+    if (start == end) return;
+    if (stringp(seq)) {
+        stringcursor_t cursor;
+        cursorstart(&cursor, seq, start);
+        for (int i = start; i < end; i++) pfun(cursornext(&cursor));
+    } else {
+        int size = car(cddr(seq))->integer;
+        for (int i = start; i < end; i++) pfun(checkinteger(*arrayref(seq, i, size)));
+    }
 }
 
-// Arduino procedures
-
 /*
-    (pinmode pin mode)
-    Sets the input/output mode of an Arduino pin number, and returns nil.
-    The mode parameter can be an integer, a keyword, or t or nil.
+    (read-sequence sequence stream [:start n] [:end m])
+    Reads bytes from stream into a string or vector, replacing the elements from start up to end.
+    Returns the index of the first element not replaced, which is less than end if the stream ran out.
+    A zero byte can't be read into a string.
 */
-object* fn_pinmode(object* args, object* env) {
+object* fn_readsequence(object* args, object* env) {
     (void)env;
-    int pin;
-    object* arg = first(args);
-    if (builtin_keywordp(arg)) pin = checkkeyword(arg);
-    else pin = checkinteger(first(args));
-    int pm = INPUT;
-    arg = second(args);
-    if (builtin_keywordp(arg)) pm = checkkeyword(arg);
-    else if (integerp(arg)) {
-        int mode = arg->integer;
-        if (mode == 1) pm = OUTPUT;
-        else if (mode == 2) pm = INPUT_PULLUP;
-#if defined(INPUT_PULLDOWN)
-        else if (mode == 4) pm = INPUT_PULLDOWN;
-#endif
-    } else if (arg != nil) pm = OUTPUT;
-    pinMode(pin, pm);
-    return nil;
+    object* seq = first(args);
+    int start, end;
+    sequencerange(cddr(args), sequencelength(seq), &start, &end);
+    gfun_t gfun = gstreamfun(cdr(args));
+    return number(readsequence(seq, gfun, start, end));
 }
 
 /*
-    (digitalread pin)
-    Reads the state of the specified Arduino pin number and returns t (high) or nil (low).
+    (write-sequence sequence stream [:start n] [:end m])
+    Writes the characters of a string, or the bytes in a vector of integers, from start up to end to stream.
+    Returns the sequence.
 */
-object* fn_digitalread(object* args, object* env) {
+object* fn_writesequence(object* args, object* env) {
     (void)env;
-    int pin;
-    object* arg = first(args);
-    if (builtin_keywordp(arg)) pin = checkkeyword(arg);
-    else pin = checkinteger(arg);
-    if (digitalRead(pin) != 0) return tee;
-    else return nil;
+    object* seq = first(args);
+    int start, end;
+    sequencerange(cddr(args), sequencelength(seq), &start, &end);
+    pfun_t pfun = pstreamfun(cdr(args));
+    writesequence(seq, pfun, start, end);
+    return seq;
 }
 
 /*
-    (digitalwrite pin state)
-    Sets the state of the specified Arduino pin number.
+    streamfile - finds the file and buffer behind an sd-stream or flash-stream,
+    and returns true if it is open for writing; errors for other streams
+    An update stream is open for both, and is prepared for writing if output is true, or reading otherwise.
 */
-object* fn_digitalwrite(object* args, object* env) {
-    (void)env;
-    int pin;
-    object* arg = first(args);
-    if (builtin_keywordp(arg)) pin = checkkeyword(arg);
-    else pin = checkinteger(arg);
-    arg = second(args);
-    int mode;
-    if (builtin_keywordp(arg)) mode = checkkeyword(arg);
-    else if (integerp(arg)) mode = arg->integer ? HIGH : LOW;
-    else mode = (arg != nil) ? HIGH : LOW;
-    digitalWrite(pin, mode);
-    return arg;
+bool streamfile(object* arg, File** file, filebuffer_t** buffer, bool output) {
+    int stream = isstream(arg);
+    if ((stream & 0xFF) == 3) streamupdate(stream, output);
+    else output = (stream & 0xFF) == 2;
+#if defined(sdcardsupport)
+    if (stream >> 8 == SDSTREAM) {
+        *file = output ? &SDpfile : &SDgfile;
+        *buffer = output ? &SDpbuffer : &SDgbuffer;
+        return output;
+    }
+#endif
+#if defined(LITTLEFS)
+    if (stream >> 8 == FLASHSTREAM) {
+        *file = output ? &FSpfile : &FSgfile;
+        *buffer = output ? &FSpbuffer : &FSgbuffer;
+        return output;
+    }
+#endif
+    error("not a file stream", arg);
+    return false;
 }
 
 /*
-    (analogread pin)
-    Reads the specified Arduino analogue pin number and returns the value.
+    fileposition - returns the position in the file of the next byte read or written through buffer
 */
-object* fn_analogread(object* args, object* env) {
-    (void)env;
-    int pin;
-    object* arg = first(args);
-    if (builtin_keywordp(arg)) pin = checkkeyword(arg);
-    else {
-        pin = checkinteger(arg);
-        checkanalogread(pin);
-    }
-    return number(analogRead(pin));
+int fileposition(File* file, filebuffer_t* buffer, bool output) {
+    if (output) return file->position() + buffer->count;
+    return file->position() - (buffer->count - buffer->index) - (LastChar ? 1 : 0);
 }
 
 /*
-    (analogreadresolution bits)
-    Specifies the resolution for the analogue inputs on platforms that support it.
-    The default resolution on all platforms is 10 bits.
+    fileseek - moves the next byte read or written through buffer to position, and returns true if it succeeded
 */
-object* fn_analogreadresolution(object* args, object* env) {
-    (void)env;
-    object* arg = first(args);
-    analogReadResolution(checkinteger(arg));
-    return arg;
+bool fileseek(File* file, filebuffer_t* buffer, bool output, int position) {
+    if (output) fileflush(*file, buffer);
+    else {
+        buffer->count = 0;
+        buffer->index = 0;
+        LastChar = 0;
+    }
+    return position >= 0 && file->seek(position, SeekSet);
 }
 
 /*
-    (analogwrite pin value)
-    Writes the value to the specified Arduino pin number.
+    (file-length stream)
+    Returns the length in bytes of the file open on an sd-stream or flash-stream, or nil for other streams.
 */
-object* fn_analogwrite(object* args, object* env) {
+object* fn_filelength(object* args, object* env) {
     (void)env;
-    int pin;
-    object* arg = first(args);
-    if (builtin_keywordp(arg)) pin = checkkeyword(arg);
-    else pin = checkinteger(arg);
-    checkanalogwrite(pin);
-    object* value = second(args);
-#ifdef toneimplemented
-    analogWrite
-#else
-    dacWrite
-#endif
-      (pin, checkinteger(value));
-    return value;
+    int stream = isstream(first(args)) >> 8;
+    if (stream != SDSTREAM && stream != FLASHSTREAM) return nil;
+    File* file;
+    filebuffer_t* buffer;
+    if (streamfile(first(args), &file, &buffer, true)) fileflush(*file, buffer);
+    return number(file->size());
 }
 
 /*
-    (delay number)
-    Delays for a specified number of milliseconds.
+    (file-position stream [position])
+    Returns the position of the next byte to be read or written on an sd-stream or flash-stream.
+    If position is given, moves to that byte of the file and returns t, or nil if it couldn't.
 */
-object* fn_delay(object* args, object* env) {
+object* fn_fileposition(object* args, object* env) {
     (void)env;
-    object* arg1 = first(args);
-    unsigned long start = millis();
-    unsigned long total = checkinteger(arg1);
-    do testescape();
-    while (millis() - start < total);
-    return arg1;
+    File* file;
+    filebuffer_t* buffer;
+    bool output = streamfile(first(args), &file, &buffer, false);
+    if (cdr(args) == NULL) return number(fileposition(file, buffer, output));
+    return fileseek(file, buffer, output, checkinteger(second(args))) ? tee : nil;
 }
 
 /*
-    (millis)
-    Returns the time in milliseconds that uLisp has been running.
+    (read-record stream size index)
+    Reads record number index, of size bytes, from a file stream and returns it as a vector of bytes,
+    or nil if the file doesn't contain the whole record.
 */
-object* fn_millis(object* args, object* env) {
-    (void)args, (void)env;
-    return number(millis());
+object* fn_readrecord(object* args, object* env) {
+    (void)env;
+    File* file;
+    filebuffer_t* buffer;
+    if (streamfile(first(args), &file, &buffer, false)) error2("not an input stream");
+    int size = checkinteger(second(args)), index = checkinteger(third(args));
+    if (size <= 0) error("invalid record size", second(args));
+    if (index < 0) error(indexnegative, third(args));
+    if (!fileseek(file, buffer, false, size * index)) return nil;
+    object* record = makearray(cons(number(size), NULL), number(0), false);
+    protect(record);
+    int n = readsequence(record, gstreamfun(args), 0, size);
+    unprotect();
+    return (n == size) ? record : nil;
 }
 
 /*
-    (sleep secs)
-    Puts the processor into a low-power sleep mode for secs.
-    Only supported on some platforms. On other platforms it does delay(1000*secs).
+    (write-record stream size index sequence)
+    Writes a string or vector of bytes as record number index, of size bytes, to a file stream.
+    The record is padded with zeros or truncated to size. Returns the sequence.
 */
-object* fn_sleep(object* args, object* env) {
+object* fn_writerecord(object* args, object* env) {
     (void)env;
-    object* arg1 = first(args);
-    doze(checkinteger(arg1));
-    return arg1;
+    File* file;
+    filebuffer_t* buffer;
+    if (!streamfile(first(args), &file, &buffer, true)) error2("not an output stream");
+    int size = checkinteger(second(args)), index = checkinteger(third(args));
+    if (size <= 0) error("invalid record size", second(args));
+    if (index < 0) error(indexnegative, third(args));
+    object* seq = first(cdr(cddr(args)));
+    int length = sequencelength(seq);
+    if (!fileseek(file, buffer, true, size * index)) error2("can't move to record");
+    pfun_t pfun = pstreamfun(args);
+    writesequence(seq, pfun, 0, (length < size) ? length : size);
+    for (int i = length; i < size; i++) pfun(0);
+    return seq;
 }
 
+// Workspace images
+
 /*
-    (note [pin] [note] [octave])
-    Generates a square wave on pin.
-    The argument note represents the note in the well-tempered scale, from 0 to 11,  
-    where 0 represents C, 1 represents C#, and so on.
-    The argument octave can be from 3 to 6. If omitted it defaults to 0.
-    When called with no arguments, turns off the PWM on the last-used pin.
+    tablesignature - returns a hash of the names in the builtin symbol tables, which fix the meaning of
+    the builtin symbols saved in an image, a FASL file, or the ROM library
+    romlibrary.py computes the same hash. It's worked out again only if a table has been added since.
 */
-object* fn_note(object* args, object* env) {
-    (void)env;
-    static int pin = 255;
-    if (args != NULL) {
-        pin = checkinteger(first(args));
-        int note = 48, octave = 0;
-        if (cdr(args) != NULL) {
-            note = checkinteger(second(args));
-            if (cddr(args) != NULL) octave = checkinteger(third(args));
+uint32_t tablesignature() {
+    static size_t tables = 0;  // NumTables when hash was worked out
+    static uint32_t hash;
+    if (tables == NumTables) return hash;
+    tables = NumTables;
+    hash = 2166136261u;
+    for (size_t n = 0; n < NumTables; n++) {
+        for (int i = 0; i < Metatable[n].size; i++) {
+            const char* name = Metatable[n].table[i].string;
+            while (*name) hash = (hash ^ (uint8_t)*name++) * 16777619u;
+            hash = hash * 16777619u;  // The terminating zero, so that "ab","c" and "a","bc" differ
         }
-        playnote(pin, note, octave);
-    } else nonote(pin);
-    return nil;
+        hash = (hash ^ Metatable[n].size) * 16777619u;
+    }
+    return hash;
 }
 
 /*
-    (register address [value])
-    Reads or writes the value of a peripheral register.
-    If value is not specified the function returns the value of the register at address.
-    If value is specified the value is written to the register at address and the function returns value.
+    imagesignature - returns the signature of the firmware an image is valid for,
+    which includes the ROM library because images can point into it
 */
-object* fn_register(object* args, object* env) {
-    (void)env;
-    object* arg = first(args);
-    int addr;
-    if (builtin_keywordp(arg)) addr = checkkeyword(arg);
-    else addr = checkinteger(first(args));
-    if (cdr(args) == NULL) return number(*(uint32_t*)addr);
-    (*(uint32_t*)addr) = checkinteger(second(args));
-    return second(args);
+uint32_t imagesignature() {
+#if defined(romlibrary)
+    return tablesignature() ^ ROMHASH;
+#else
+    return tablesignature();
+#endif
 }
 
-// Tree Editor
-
 /*
-    (edit 'function)
-    Calls the Lisp tree editor to allow you to edit a function definition.
+    imagefile - opens the file named by the first argument for save-image or load-image,
+    in flash or, if the second argument is non-nil, on the SD card
 */
-object* fn_edit(object* args, object* env) {
-    object* fun = first(args);
-    object* pair = findvalue(fun, env);
-    clrflag(EXITEDITOR);
-    object* arg = edit(eval(fun, env));
-    cdr(pair) = arg;
-    return arg;
+File imagefile(object* args, const char* oflag) {
+    object* filename = checkstring(first(args));
+    char buffer[BUFFERSIZE];
+    File file;
+    if (cdr(args) != NULL && second(args) != NULL) {
+#if defined(sdcardsupport)
+        SD.begin();
+        file = SD.open(MakeFilename(filename, buffer), oflag);
+#else
+        error2("not supported");
+#endif
+    } else {
+        flashbegin();
+#if defined(LITTLEFS)
+        file = LittleFS.open(MakeFilename(filename, buffer), oflag);
+#endif
+    }
+    if (!file) error("problem opening image file", filename);
+    return file;
+}
+
+/*
+    imageindex - returns the workspace index of a pointer in an image, counting from 1 so that NULL is 0
+    Pointers into the ROM library are saved as their index in RomCells[] with the IMAGEROM bit set.
+*/
+uint32_t imageindex(object* obj) {
+    if (obj == NULL) return 0;
+#if defined(romlibrary)
+    if (!inworkspace(obj)) return IMAGEROM | (obj - RomCells);
+#endif
+    return (obj - Workspace) + 1;
+}
+
+/*
+    imagevalid - returns true if index, saved by imageindex(), is a valid pointer in an image of size cells
+*/
+bool imagevalid(uint32_t index, uint32_t size) {
+#if defined(romlibrary)
+    if (index & IMAGEROM) return (index & ~IMAGEROM) < ROMCELLS;
+#endif
+    return index <= size;
+}
+
+/*
+    imagepointer - returns the pointer saved by imageindex() as index
+*/
+object* imagepointer(uint32_t index) {
+    if (index == 0) return NULL;
+#if defined(romlibrary)
+    if (index & IMAGEROM) return (object*)&RomCells[index & ~IMAGEROM];
+#endif
+    return &Workspace[index - 1];
+}
+
+/*
+    imagewrite - writes a word to an image, least significant byte first
+    A failed write is only noted in buffer->index, because cells are marked while an image is written.
+*/
+void imagewrite(File& file, filebuffer_t* buffer, uint32_t word) {
+    for (int i = 0; i < 4; i++) {
+        if (buffer->count == FILEBUFFERSIZE) {
+            if (file.write(buffer->data, FILEBUFFERSIZE) != FILEBUFFERSIZE) buffer->index = 1;
+            buffer->count = 0;
+        }
+        buffer->data[buffer->count++] = word & 0xFF;
+        word = word >> 8;
+    }
+}
+
+/*
+    imageread - reads a word from an image
+*/
+uint32_t imageread(File& file, filebuffer_t* buffer) {
+    uint32_t word = 0;
+    for (int i = 0; i < 4; i++) word = word | (uint32_t)(filereadbyte(file, buffer) & 0xFF) << (i * 8);
+    return word;
+}
+
+/*
+    imagecell - writes a cell to an image and marks it
+    Bit 0 of kind says its car is a pointer, and bit 1 that its cdr is.
+*/
+void imagecell(File& file, filebuffer_t* buffer, object* obj, int kind) {
+    imagewrite(file, buffer, (obj - Workspace) | (uint32_t)kind << 30);
+    imagewrite(file, buffer, (kind & 1) ? imageindex(car(obj)) : (uint32_t)(uintptr_t)car(obj));
+    imagewrite(file, buffer, (kind & 2) ? imageindex(cdr(obj)) : (uint32_t)(uintptr_t)cdr(obj));
+    mark(obj);
+}
+
+/*
+    imageobject - writes the cells reachable from obj to an image, following the same paths as markobject()
+*/
+void imageobject(File& file, filebuffer_t* buffer, object* obj) {
+    while (obj != NULL && inworkspace(obj) && !marked(obj)) {
+        object* arg = car(obj);
+        unsigned int type = obj->type;
+        if (type >= PAIR || type == ZZERO) {  // cons
+            imagecell(file, buffer, obj, 3);
+            imageobject(file, buffer, arg);
+            obj = cdr(obj);
+        } else if (type == ARRAY) {
+            imagecell(file, buffer, obj, 2);
+            obj = cdr(obj);
+        } else if (type == HASHTABLE) {  // The count and info cells, then the buckets
+            imagecell(file, buffer, obj, 2);
+            obj = cdr(obj);
+            for (int i = 0; i < 2; i++) {
+                arg = car(obj);
+                imagecell(file, buffer, obj, 1);
+                obj = arg;
+            }
+        } else if (type == STRING || type == BIGNUM || (type == SYMBOL && longsymbolp(obj))) {
+            imagecell(file, buffer, obj, 2);
+            obj = cdr(obj);
+            while (obj != NULL) {
+                arg = car(obj);
+                imagecell(file, buffer, obj, 1);
+                obj = arg;
+            }
+        } else {
+            imagecell(file, buffer, obj, 0);
+            obj = NULL;
+        }
+    }
+}
+
+/*
+    loadimage - replaces the workspace with the image in file, and returns the number of cells loaded,
+    or -1 if the file isn't a complete image made by this firmware, in which case the workspace is unchanged
+*/
+int loadimage(File& file) {
+    filebuffer_t buffer;
+    buffer.count = 0;
+    buffer.index = 0;
+    if (imageread(file, &buffer) != IMAGEMAGIC) return -1;
+    if (imageread(file, &buffer) != IMAGEVERSION) return -1;
+    if (imageread(file, &buffer) != imagesignature()) return -1;
+    uint32_t size = imageread(file, &buffer);
+    uint32_t cells = imageread(file, &buffer);
+    uint32_t env = imageread(file, &buffer), t = imageread(file, &buffer);
+    if (size > WORKSPACESIZE || cells > size || !imagevalid(env, size) || !imagevalid(t, size)) return -1;
+    if (file.size() != (IMAGEHEADER + cells * 3) * 4) return -1;
+    // Check every index before changing anything
+    for (uint32_t i = 0; i < cells; i++) {
+        uint32_t index = imageread(file, &buffer);
+        int kind = index >> 30;
+        uint32_t a = imageread(file, &buffer), d = imageread(file, &buffer);
+        if ((index & 0x3FFFFFFF) >= size) return -1;
+        if (((kind & 1) && !imagevalid(a, size)) || ((kind & 2) && !imagevalid(d, size))) return -1;
+    }
+    file.seek(IMAGEHEADER * 4, SeekSet);
+    buffer.count = 0;
+    buffer.index = 0;
+    for (uint32_t i = 0; i < cells; i++) {
+        uint32_t index = imageread(file, &buffer);
+        int kind = index >> 30;
+        uint32_t a = imageread(file, &buffer), d = imageread(file, &buffer);
+        object* obj = &Workspace[index & 0x3FFFFFFF];
+        car(obj) = (kind & 1) ? imagepointer(a) : (object*)(uintptr_t)a;
+        cdr(obj) = (kind & 2) ? imagepointer(d) : (object*)(uintptr_t)d;
+        mark(obj);
+    }
+    sweep();
+    GlobalEnv = imagepointer(env);
+    tee = imagepointer(t);
+    GCStack = NULL;
+    Thrown = NULL;
+    for (int i = 0; i < FORMATCACHESIZE; i++) {
+        FormatCache[i].string = NULL;
+        FormatCache[i].program = NULL;
+    }
+    Epoch++;
+    return cells;
+}
+
+/*
+    bootimage - loads /main.img from flash if there is a valid one, and returns true if it did
+*/
+bool bootimage() {
+#if defined(LITTLEFS)
+    // Don't format the flash at boot if it won't mount
+    if (!LittleFS.begin(false) || !LittleFS.exists("/main.img")) return false;
+    File file = LittleFS.open("/main.img", FILE_READ);
+    if (!file) return false;
+    int cells = loadimage(file);
+    file.close();
+    return cells >= 0;
+#else
+    return false;
+#endif
+}
+
+/*
+    (save-image filename [sd])
+    Saves the global definitions as an image file in flash, or on the SD card if sd is non-nil.
+    Returns the number of cells saved.
+*/
+object* fn_saveimage(object* args, object* env) {
+    (void)env;
+    File file = imagefile(args, FILE_WRITE);
+    markobject(GlobalEnv);
+    markobject(tee);
+    uint32_t cells = 0;
+    for (int i = 0; i < WORKSPACESIZE; i++) {
+        object* obj = &Workspace[i];
+        if (marked(obj)) {
+            unmark(obj);
+            cells++;
+        }
+    }
+    filebuffer_t buffer;
+    buffer.count = 0;
+    buffer.index = 0;
+    imagewrite(file, &buffer, IMAGEMAGIC);
+    imagewrite(file, &buffer, IMAGEVERSION);
+    imagewrite(file, &buffer, imagesignature());
+    imagewrite(file, &buffer, WORKSPACESIZE);
+    imagewrite(file, &buffer, cells);
+    imagewrite(file, &buffer, imageindex(GlobalEnv));
+    imagewrite(file, &buffer, imageindex(tee));
+    imageobject(file, &buffer, GlobalEnv);
+    imageobject(file, &buffer, tee);
+    for (int i = 0; i < WORKSPACESIZE; i++) {
+        object* obj = &Workspace[i];
+        if (marked(obj)) unmark(obj);
+    }
+    if (buffer.index) {
+        file.close();
+        error2("failed to write to file");
+    }
+    fileflush(file, &buffer);
+    file.close();
+    return number(cells);
+}
+
+/*
+    (load-image filename [sd])
+    Replaces the workspace with an image saved by save-image, and returns to the REPL.
+    Images saved by firmware with different builtins are rejected.
+*/
+object* fn_loadimage(object* args, object* env) {
+    (void)env;
+    File file = imagefile(args, FILE_READ);
+    int cells = loadimage(file);
+    file.close();
+    if (cells < 0) error("not an image for this firmware", first(args));
+    // The forms being evaluated were in the old workspace, so don't return to them
+    pint(cells, pserial);
+    pfstring(" cells loaded", pserial);
+    pln(pserial);
+    handler = &toplevel_handler;
+    longjmp(toplevel_handler, 1);
+    return nil;
+}
+
+// Binary objects
+
+/*
+    binword - writes an unsigned number, seven bits per byte
+*/
+void binword(uint32_t n, pfun_t pfun) {
+    while (n >= 0x80) {
+        pfun((n & 0x7F) | 0x80);
+        n = n >> 7;
+    }
+    pfun(n);
+}
+
+/*
+    binlong - writes four bytes, least significant first
+*/
+void binlong(uint32_t n, pfun_t pfun) {
+    for (int i = 0; i < 4; i++) {
+        pfun(n & 0xFF);
+        n = n >> 8;
+    }
+}
+
+/*
+    binchars - writes the length and characters of a string or long symbol
+*/
+void binchars(object* string, pfun_t pfun) {
+    int n = stringlength(string);
+    binword(n, pfun);
+    stringcursor_t cursor;
+    cursorstart(&cursor, string, 0);
+    for (int i = 0; i < n; i++) pfun(cursornext(&cursor));
+}
+
+/*
+    binbyte - reads a byte
+*/
+uint8_t binbyte(gfun_t gfun) {
+    int c = gfun();
+    if (c == -1) error2("data is truncated");
+    return c;
+}
+
+/*
+    binreadword - reads an unsigned number written by binword()
+*/
+uint32_t binreadword(gfun_t gfun) {
+    uint32_t n = 0;
+    int shift = 0;
+    uint8_t c;
+    do {
+        c = binbyte(gfun);
+        if (shift < 32) n = n | (uint32_t)(c & 0x7F) << shift;
+        shift = shift + 7;
+    } while (c & 0x80);
+    return n;
+}
+
+/*
+    binreadlong - reads four bytes written by binlong()
+*/
+uint32_t binreadlong(gfun_t gfun) {
+    uint32_t n = 0;
+    for (int i = 0; i < 4; i++) n = n | (uint32_t)binbyte(gfun) << (i * 8);
+    return n;
+}
+
+/*
+    binreadchars - reads a string written by binchars()
+*/
+object* binreadchars(gfun_t gfun) {
+    int n = binreadword(gfun);
+    object* string = newstring();
+    object* tail = string;
+    for (int i = 0; i < n; i++) buildstring(binbyte(gfun), &tail);
+    return string;
+}
+
+/*
+    sharefind - returns the entry for obj in ObjectShares, or NULL
+*/
+share_t* sharefind(object* obj) {
+    if (ObjectShareCount == 0) return NULL;
+    int mask = ObjectShareSize - 1;
+    for (int i = ((uintptr_t)obj >> 3) & mask; ObjectShares[i].obj != NULL; i = (i + 1) & mask) {
+        if (ObjectShares[i].obj == obj) return &ObjectShares[i];
+    }
+    return NULL;
+}
+
+/*
+    shareadd - adds obj to ObjectShares, which grows to stay at most half full, and returns its entry
+    Returns NULL if there's no room to grow it.
+*/
+share_t* shareadd(object* obj) {
+    if (2 * (ObjectShareCount + 1) > ObjectShareSize) {
+        int size = ObjectShareSize ? ObjectShareSize * 2 : 16;
+        share_t* shares = (share_t*)calloc(size, sizeof(share_t));
+        if (shares == NULL) return NULL;
+        share_t* old = ObjectShares;
+        int oldsize = ObjectShareSize;
+        ObjectShares = shares;
+        ObjectShareSize = size;
+        ObjectShareCount = 0;
+        for (int i = 0; i < oldsize; i++) {
+            if (old[i].obj != NULL) *shareadd(old[i].obj) = old[i];
+        }
+        free(old);
+    }
+    int mask = ObjectShareSize - 1;
+    int i = ((uintptr_t)obj >> 3) & mask;
+    while (ObjectShares[i].obj != NULL) i = (i + 1) & mask;
+    ObjectShares[i].obj = obj;
+    ObjectShares[i].label = -1;
+    ObjectShareCount++;
+    return &ObjectShares[i];
+}
+
+/*
+    sharereset - empties ObjectShares and ObjectLabels, freeing what a write-object or read-object
+    that stopped with an error left behind
+*/
+void sharereset() {
+    free(ObjectShares);
+    ObjectShares = NULL;
+    ObjectShareSize = ObjectShareCount = 0;
+    free(ObjectLabels);
+    ObjectLabels = NULL;
+    ObjectLabelSize = ObjectLabelCount = 0;
+}
+
+/*
+    bitarrayp - returns true if array is a bit array, which is identified by a negative first dimension
+*/
+bool bitarrayp(object* array) {
+    object* dims = cddr(array);
+    return dims != NULL && first(dims)->integer < 0;
+}
+
+/*
+    arraycells - returns the number of elements in array, or of words if it's a bit array
+*/
+int arraycells(object* array) {
+    int size = 1;
+    for (object* dims = cddr(array); dims != NULL; dims = cdr(dims)) size = size * abs(first(dims)->integer);
+    if (bitarrayp(array)) size = (size + sizeof(int) * 8 - 1) / (sizeof(int) * 8);
+    return size;
+}
+
+/*
+    objectshares - marks the conses, strings and arrays reachable from obj, adding the ones reached more
+    than once to ObjectShares; returns an object that can't be written, or the one that didn't fit in ObjectShares,
+    or NULL. Cells outside the workspace, in the ROM library, can't be marked, so they are treated as unshared.
+*/
+object* objectshares(object* obj) {
+    while (obj != NULL) {
+        if (inworkspace(obj) && marked(obj)) {
+            if (sharefind(obj) == NULL && shareadd(obj) == NULL) return obj;  // No room
+            return NULL;
+        }
+        unsigned int type = obj->type;
+        bool markable = inworkspace(obj);
+        if (type >= PAIR || type == ZZERO) {
+            object* arg = car(obj);
+            if (markable) mark(obj);
+            object* bad = objectshares(arg);
+            if (bad != NULL) return bad;
+            obj = cdr(obj);
+        } else if (type == ARRAY) {
+            if (markable) mark(obj);
+            if (bitarrayp(obj)) return NULL;
+            int size = arraycells(obj);
+            for (int i = 0; i < size; i++) {
+                object* bad = objectshares(*arrayref(obj, i, size));
+                if (bad != NULL) return bad;
+            }
+            return NULL;
+        } else if (type == STRING) {
+            if (markable) mark(obj);
+            return NULL;
+        } else if (type == SYMBOL || type == NUMBER || type == FLOAT || type == CHARACTER || type == BIGNUM) return NULL;
+        else return obj;
+    }
+    return NULL;
+}
+
+/*
+    objectunmark - clears the marks set by objectshares() on the objects reachable from obj
+*/
+void objectunmark(object* obj) {
+    while (obj != NULL && inworkspace(obj) && marked(obj)) {
+        unmark(obj);
+        unsigned int type = obj->type;
+        if (type >= PAIR || type == ZZERO) {
+            objectunmark(car(obj));
+            obj = cdr(obj);
+        } else if (type == ARRAY) {
+            if (bitarrayp(obj)) return;
+            int size = arraycells(obj);
+            for (int i = 0; i < size; i++) objectunmark(*arrayref(obj, i, size));
+            return;
+        } else return;
+    }
+}
+
+/*
+    objectprepare - finds the shared objects in obj with objectshares(), giving an error if it can't be written
+*/
+void objectprepare(object* obj) {
+    sharereset();
+    object* bad = objectshares(obj);
+    objectunmark(obj);
+    if (bad != NULL) {
+        sharereset();
+        if (consp(bad) || stringp(bad) || arrayp(bad)) error2("no room for shared objects");
+        error("can't write object", bad);
+    }
+}
+
+/*
+    sharerelabel - forgets the labels objectwrite() gave, so that the same object can be written again
+*/
+void sharerelabel() {
+    for (int i = 0; i < ObjectShareSize; i++) ObjectShares[i].label = -1;
+    ObjectLabelCount = 0;
+}
+
+/*
+    objectwrite - writes obj in binary to pfun, after objectshares() has found its shared objects
+    The first time a shared object is written it's given the next label, and after that it's written
+    as a reference to the label. Every symbol is labelled in the same way.
+*/
+void objectwrite(object* obj, pfun_t pfun) {
+    if (obj == NULL) {
+        pfun(FASLNIL);
+        return;
+    }
+    share_t* share = sharefind(obj);
+    if (share != NULL && share->label >= 0) {
+        pfun(FASLREF);
+        binword(share->label, pfun);
+        return;
+    }
+    if (symbolp(obj)) {
+        if (share == NULL) share = shareadd(obj);
+        if (share == NULL) error2("no room for shared objects");
+        share->label = ObjectLabelCount++;
+        symbol_t name = obj->name;
+        if (longnamep(name)) {
+            pfun(FASLLONGNAME);
+            binchars(obj, pfun);
+        } else if (untwist(name) >= BUILTINS) {
+            const char* s = getentry((builtin_t)(untwist(name) - BUILTINS))->string;
+            pfun(FASLLONGNAME);
+            binword(strlen(s), pfun);
+            while (*s != 0) pfun(*s++);
+        } else {
+            pfun(FASLNAME);
+            binlong(name, pfun);
+        }
+        return;
+    }
+    if (share != NULL) {
+        share->label = ObjectLabelCount++;
+        pfun(FASLLABEL);
+    }
+    if (consp(obj)) {
+        int n = 0;
+        object* tail = obj;
+        do {
+            n++;
+            tail = cdr(tail);
+        } while (consp(tail) && sharefind(tail) == NULL);
+        pfun(FASLLIST);
+        binword(n, pfun);
+        for (int i = 0; i < n; i++) {
+            objectwrite(car(obj), pfun);
+            obj = cdr(obj);
+        }
+        objectwrite(tail, pfun);
+    } else if (integerp(obj)) {
+        pfun(FASLNUMBER);
+        binword((uint32_t)obj->integer << 1 ^ (uint32_t)(obj->integer >> 31), pfun);
+    } else if (floatp(obj)) {
+        pfun(FASLFLOAT);
+        binlong(obj->integer, pfun);
+    } else if (characterp(obj)) {
+        pfun(FASLCHARACTER);
+        binword((uint8_t)obj->chars, pfun);
+    } else if (stringp(obj)) {
+        pfun(FASLSTRING);
+        binchars(obj, pfun);
+    } else if (bignump(obj)) {
+        uint32_t w[MAXBIGNUM];
+        int n = bignumwords(obj, w);
+        pfun(FASLBIGNUM);
+        binword(n, pfun);
+        for (int i = 0; i < n; i++) binlong(w[i], pfun);
+    } else if (arrayp(obj)) {
+        object* dims = cddr(obj);
+        int size = arraycells(obj);
+        pfun(FASLARRAY);
+        binword(listlength(dims), pfun);
+        for (; dims != NULL; dims = cdr(dims)) {
+            int d = first(dims)->integer;
+            binword((uint32_t)d << 1 ^ (uint32_t)(d >> 31), pfun);
+        }
+        bool bitp = bitarrayp(obj);
+        for (int i = 0; i < size; i++) {
+            object* element = *arrayref(obj, i, size);
+            if (bitp) binlong(element->integer, pfun);
+            else objectwrite(element, pfun);
+        }
+    }
+}
+
+/*
+    objectlabel - gives obj the label label, for read-object
+*/
+void objectlabel(int label, object* obj) {
+    if (label >= 0) ObjectLabels[label] = obj;
+}
+
+/*
+    objectnewlabel - reserves the next label for read-object and returns it
+*/
+int objectnewlabel() {
+    if (ObjectLabelCount == ObjectLabelSize) {
+        int size = ObjectLabelSize ? ObjectLabelSize * 2 : 16;
+        object** labels = (object**)realloc(ObjectLabels, size * sizeof(object*));
+        if (labels == NULL) error2("no room for labels");
+        ObjectLabels = labels;
+        ObjectLabelSize = size;
+    }
+    ObjectLabels[ObjectLabelCount] = NULL;
+    return ObjectLabelCount++;
+}
+
+/*
+    objectread - reads the rest of an object written by objectwrite(), after its first byte tag, from gfun
+*/
+object* objectread(gfun_t gfun, uint8_t tag) {
+    int label = -1;
+    if (tag == FASLLABEL) {
+        label = objectnewlabel();
+        tag = binbyte(gfun);
+        if (tag != FASLLIST && tag != FASLSTRING && tag != FASLARRAY) error2("binary object is corrupt");
+    }
+    if (tag == FASLNIL) return nil;
+    if (tag == FASLREF) {
+        uint32_t index = binreadword(gfun);
+        if (index >= (uint32_t)ObjectLabelCount) error2("binary object is corrupt");
+        return ObjectLabels[index];
+    }
+    if (tag == FASLLIST) {
+        int n = binreadword(gfun);
+        if (n == 0) error2("binary object is corrupt");
+        object* head = cons(NULL, NULL);
+        objectlabel(label, head);
+        object* tail = head;
+        car(head) = objectread(gfun, binbyte(gfun));
+        for (int i = 1; i < n; i++) {
+            cdr(tail) = cons(NULL, NULL);
+            tail = cdr(tail);
+            car(tail) = objectread(gfun, binbyte(gfun));
+        }
+        cdr(tail) = objectread(gfun, binbyte(gfun));
+        return head;
+    }
+    if (tag == FASLNAME || tag == FASLLONGNAME) label = objectnewlabel();
+    if (tag == FASLNAME) {
+        object* sym = symbol(binreadlong(gfun));
+        objectlabel(label, sym);
+        return sym;
+    }
+    if (tag == FASLLONGNAME) {
+        char buffer[BUFFERSIZE];
+        int length = binreadword(gfun);
+        if (length >= BUFFERSIZE) error2("binary object is corrupt");
+        for (int i = 0; i < length; i++) buffer[i] = binbyte(gfun);
+        buffer[length] = '\0';
+        builtin_t x = lookupbuiltin(buffer);
+        object* sym = (x == NIL) ? nil : (x != ENDFUNCTIONS) ? bsymbol(x) : buftosymbol(buffer);
+        objectlabel(label, sym);
+        return sym;
+    }
+    if (tag == FASLNUMBER) {
+        uint32_t z = binreadword(gfun);
+        return number((int)(z >> 1) ^ -(int)(z & 1));
+    }
+    if (tag == FASLFLOAT) {
+        uint32_t bits = binreadlong(gfun);
+        float f;
+        memcpy(&f, &bits, sizeof(f));
+        return makefloat(f);
+    }
+    if (tag == FASLCHARACTER) return character(binreadword(gfun));
+    if (tag == FASLSTRING) {
+        object* string = binreadchars(gfun);
+        objectlabel(label, string);
+        return string;
+    }
+    if (tag == FASLBIGNUM) {
+        uint32_t w[MAXBIGNUM];
+        int n = binreadword(gfun);
+        if (n == 0 || n > MAXBIGNUM) error2("binary object is corrupt");
+        for (int i = 0; i < n; i++) w[i] = binreadlong(gfun);
+        return makebignum(w, n);
+    }
+    if (tag == FASLARRAY) {
+        int rank = binreadword(gfun);
+        object* head = cons(NULL, NULL);
+        object* tail = head;
+        bool bitp = false;
+        for (int i = 0; i < rank; i++) {
+            uint32_t z = binreadword(gfun);
+            int d = (int)(z >> 1) ^ -(int)(z & 1);
+            if (i == 0 && d < 0) {
+                bitp = true;
+                d = -d;
+            }
+            if (d < 0) error2("binary object is corrupt");
+            cdr(tail) = cons(number(d), NULL);
+            tail = cdr(tail);
+        }
+        object* array = makearray(cdr(head), NULL, bitp);
+        objectlabel(label, array);
+        int size = arraycells(array);
+        for (int i = 0; i < size; i++) {
+            object** element = arrayref(array, i, size);
+            if (bitp) *element = number(binreadlong(gfun));
+            else *element = objectread(gfun, binbyte(gfun));
+        }
+        return array;
+    }
+    error2("binary object is corrupt");
+    return nil;
+}
+
+/*
+    checkbinarystream - checks that stream can carry the bytes of a binary object
+    String streams can't, as they can't hold a zero byte.
+*/
+void checkbinarystream(object* stream) {
+    if (isstream(stream) >> 8 == STRINGSTREAM) error("string streams can't hold binary objects", stream);
+}
+
+/*
+    (write-object object stream)
+    Writes object to stream in a compact binary form that read-object reads back, and returns object.
+    Conses, integers, floats, characters, strings, symbols and arrays can be written,
+    and shared or circular structure is preserved. The stream can't be a string stream.
+*/
+object* fn_writeobject(object* args, object* env) {
+    (void)env;
+    object* obj = first(args);
+    checkbinarystream(second(args));
+    pfun_t pfun = pstreamfun(cdr(args));
+    objectprepare(obj);
+    objectwrite(obj, pfun);
+    sharereset();
+    return obj;
+}
+
+/*
+    (read-object stream)
+    Reads an object written by write-object from stream, and returns it, or nil at the end of the stream.
+*/
+object* fn_readobject(object* args, object* env) {
+    (void)env;
+    checkbinarystream(first(args));
+    gfun_t gfun = gstreamfun(args);
+    int tag = gfun();
+    if (tag == -1) return nil;
+    sharereset();
+    object* obj = objectread(gfun, tag);
+    sharereset();
+    return obj;
+}
+
+// Key-value store
+
+/*
+    kvfs - returns the filesystem holding the store, in flash or on the SD card, after starting it
+*/
+fs::FS& kvfs() {
+#if defined(sdcardsupport)
+    if (KVSD) {
+        SD.begin();
+        return SD;
+    }
+#endif
+    flashbegin();
+    return LittleFS;
+}
+
+/*
+    kvflush - writes the records held in KVBuffer to the end of the store
+*/
+void kvflush() {
+    if (KVBuffer.count == 0) return;
+    KVFile.seek(0, SeekEnd);
+    fileflush(KVFile, &KVBuffer);
+    KVFile.flush();
+}
+
+/*
+    kvappend - adds a byte to the end of the store, which is written a block at a time
+*/
+void kvappend(char c) {
+    if (KVBuffer.count == FILEBUFFERSIZE) kvflush();
+    KVBuffer.data[KVBuffer.count++] = c;
+    KVLength++;
+}
+
+/*
+    kvwrite - adds a byte of a record to the end of the store, and to the record's checksum
+*/
+void kvwrite(char c) {
+    KVHash = (KVHash ^ (uint8_t)c) * 16777619u;
+    kvappend(c);
+}
+
+/*
+    kvcount - counts the bytes of a value written in binary, for kv-put
+*/
+void kvcount(char c) {
+    (void)c;
+    KVBytes++;
+}
+
+/*
+    kvkeybyte - adds a byte to the key being written in binary to KVKey
+*/
+void kvkeybyte(char c) {
+    if (KVKeyLength == KVKEYSIZE) error2("key is too long");
+    KVKey[KVKeyLength++] = c;
+}
+
+/*
+    kvseek - sets the position that kvread() reads from
+*/
+void kvseek(uint32_t pos) {
+    KVPos = pos;
+    KVRead.index = KVRead.count = 0;
+    if (pos < KVLength - KVBuffer.count) KVFile.seek(pos);
+}
+
+/*
+    kvread - returns the next byte of the store, from the file or from KVBuffer, or -1 at the end
+*/
+int kvread() {
+    uint32_t written = KVLength - KVBuffer.count;
+    if (KVPos >= KVLength) return -1;
+    if (KVPos >= written) return KVBuffer.data[KVPos++ - written];
+    KVPos++;
+    return filereadbyte(KVFile, &KVRead);
+}
+
+/*
+    kvreadrecord - returns the next byte of the record being read, adding it to the record's checksum
+*/
+int kvreadrecord() {
+    int c = kvread();
+    if (c != -1) KVHash = (KVHash ^ c) * 16777619u;
+    return c;
+}
+
+/*
+    kvkey - writes key in binary to KVKey, and returns its hash
+*/
+uint32_t kvkey(object* key) {
+    objectprepare(key);
+    KVKeyLength = 0;
+    objectwrite(key, kvkeybyte);
+    sharereset();
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < KVKeyLength; i++) hash = (hash ^ KVKey[i]) * 16777619u;
+    return hash;
+}
+
+/*
+    kvsamekey - tests whether the record for entry has the key in KVKey
+*/
+bool kvsamekey(kventry_t* entry) {
+    uint32_t resume = KVPos;
+    kvseek(entry->offset + 1);
+    bool same = (kvread() == KVKeyLength);
+    kvseek(entry->offset + KVHEADER);
+    for (int i = 0; same && i < KVKeyLength; i++) same = (kvread() == KVKey[i]);
+    kvseek(resume);
+    return same;
+}
+
+/*
+    kvfind - returns the entry in KVIndex for the key in KVKey, whose hash is hash, or NULL
+*/
+kventry_t* kvfind(uint32_t hash) {
+    int mask = KVSize - 1;
+    for (int i = hash & mask; KVIndex[i].offset != 0; i = (i + 1) & mask) {
+        if (KVIndex[i].hash == hash && kvsamekey(&KVIndex[i])) return &KVIndex[i];
+    }
+    return NULL;
+}
+
+/*
+    kvplace - puts an entry in the first empty slot after its hash in KVIndex
+*/
+void kvplace(kventry_t entry) {
+    int mask = KVSize - 1;
+    int i = entry.hash & mask;
+    while (KVIndex[i].offset != 0) i = (i + 1) & mask;
+    KVIndex[i] = entry;
+}
+
+/*
+    kvinsert - adds an entry to KVIndex, which grows to stay at most half full
+*/
+void kvinsert(uint32_t hash, uint32_t offset, uint32_t size) {
+    if (2 * (KVCount + 1) > KVSize) {
+        kventry_t* index = (kventry_t*)calloc(KVSize * 2, sizeof(kventry_t));
+        if (index == NULL) error2("no room for the key-value index");
+        kventry_t* old = KVIndex;
+        int oldsize = KVSize;
+        KVIndex = index;
+        KVSize = oldsize * 2;
+        for (int i = 0; i < oldsize; i++) {
+            if (old[i].offset != 0) kvplace(old[i]);
+        }
+        free(old);
+    }
+    kventry_t entry = { hash, offset, size };
+    kvplace(entry);
+    KVCount++;
+}
+
+/*
+    kvremove - removes entry from KVIndex, moving back the entries after it that would no longer be found
+*/
+void kvremove(kventry_t* entry) {
+    int mask = KVSize - 1;
+    int hole = entry - KVIndex;
+    for (int i = (hole + 1) & mask; KVIndex[i].offset != 0; i = (i + 1) & mask) {
+        int home = KVIndex[i].hash & mask;
+        // Leave the entry if its home slot is after the hole, cyclically
+        bool stays = (hole <= i) ? (hole < home && home <= i) : (hole < home || home <= i);
+        if (!stays) {
+            KVIndex[hole] = KVIndex[i];
+            hole = i;
+        }
+    }
+    KVIndex[hole].offset = 0;
+    KVCount--;
+}
+
+/*
+    kvupdate - records in KVIndex that the record of type type at offset is the latest for the key in KVKey,
+    whose entry is entry, or NULL if it had none
+*/
+void kvupdate(kventry_t* entry, uint8_t type, uint32_t hash, uint32_t offset, uint32_t size) {
+    if (entry != NULL) {
+        KVLive = KVLive - entry->size;
+        if (type == KVDELETE) kvremove(entry);
+        else {
+            entry->offset = offset;
+            entry->size = size;
+            KVLive = KVLive + size;
+        }
+    } else if (type == KVPUT) {
+        kvinsert(hash, offset, size);
+        KVLive = KVLive + size;
+    }
+}
+
+/*
+    kvrecord - starts a record of type type for the key in KVKey, with a value of valuelength bytes to follow
+*/
+void kvrecord(uint8_t type, uint32_t valuelength) {
+    KVHash = 2166136261u;
+    kvwrite(type);
+    kvwrite(KVKeyLength);
+    binlong(valuelength, kvwrite);
+    for (int i = 0; i < KVKeyLength; i++) kvwrite(KVKey[i]);
+}
+
+/*
+    kvscan - adds the records in the store after the header to KVIndex, and returns where the last complete one ends,
+    or 0 if the store is corrupt
+    Only the last record can have been cut short by a power failure, which ends the scan. Any other record whose
+    checksum is wrong is skipped, but one whose header is wrong means the records after it can't be found.
+*/
+uint32_t kvscan() {
+    uint32_t pos = 4;
+    kvseek(pos);
+    for (;;) {
+        KVHash = 2166136261u;
+        int type = kvreadrecord();
+        int keylength = kvreadrecord();
+        uint32_t valuelength = 0;
+        for (int i = 0; i < 4; i++) {
+            int c = kvreadrecord();
+            if (c == -1) return pos;  // The end of the store, or a header cut short
+            valuelength = valuelength | (uint32_t)c << (i * 8);
+        }
+        if ((type != KVPUT && type != KVDELETE) || keylength <= 0 || keylength > KVKEYSIZE) return 0;
+        uint32_t size = KVHEADER + keylength + valuelength + 4;
+        if (valuelength > KVLength || size > KVLength - pos) return pos;
+        uint32_t hash = 2166136261u;
+        for (int i = 0; i < keylength; i++) {
+            KVKey[i] = kvreadrecord();
+            hash = (hash ^ KVKey[i]) * 16777619u;
+        }
+        for (uint32_t i = 0; i < valuelength; i++) kvreadrecord();
+        uint32_t checksum = KVHash, stored = 0;
+        for (int i = 0; i < 4; i++) stored = stored | (uint32_t)kvread() << (i * 8);
+        if (stored != checksum) {
+            if (pos + size == KVLength) return pos;
+            pos = pos + size;
+            continue;
+        }
+        KVKeyLength = keylength;
+        kvupdate(kvfind(hash), type, hash, pos, size);
+        pos = pos + size;
+    }
+}
+
+/*
+    kvtempname - returns the name of the file that kvcompact() writes, in buffer
+*/
+char* kvtempname(char* buffer) {
+    strcpy(buffer, KVName);
+    strcat(buffer, ".tmp");
+    return buffer;
+}
+
+/*
+    kvclose - writes any records held in KVBuffer, and closes the store
+*/
+void kvclose() {
+    if (KVIndex == NULL) return;
+    kvflush();
+    KVFile.close();
+    free(KVIndex);
+    KVIndex = NULL;
+    KVSize = KVCount = 0;
+}
+
+/*
+    kvcompact - copies the latest record for each key to a new file, which replaces the store,
+    and returns the number of bytes reclaimed
+*/
+uint32_t kvcompact() {
+    kvflush();
+    fs::FS& fs = kvfs();
+    char temp[BUFFERSIZE];
+    File file = fs.open(kvtempname(temp), FILE_WRITE);
+    if (!file) error2("problem writing key-value store");
+    filebuffer_t buffer;
+    buffer.count = 0;
+    uint32_t length = 4;
+    for (int i = 0; i < 4; i++) filewritebyte(file, &buffer, KVMAGIC >> (i * 8));
+    for (int i = 0; i < KVSize; i++) {
+        if (KVIndex[i].offset == 0) continue;
+        kvseek(KVIndex[i].offset);
+        for (uint32_t j = 0; j < KVIndex[i].size; j++) filewritebyte(file, &buffer, kvread());
+        length = length + KVIndex[i].size;
+    }
+    fileflush(file, &buffer);
+    file.close();
+    // If this stops before the rename, kvopen() finishes it
+    KVFile.close();
+    fs.remove(KVName);
+    if (fs.rename(temp, KVName)) KVFile = fs.open(KVName, "a+");
+    if (!KVFile) {
+        free(KVIndex);
+        KVIndex = NULL;
+        KVSize = KVCount = 0;
+        error2("problem replacing key-value store");
+    }
+    uint32_t offset = 4;
+    for (int i = 0; i < KVSize; i++) {
+        if (KVIndex[i].offset == 0) continue;
+        KVIndex[i].offset = offset;
+        offset = offset + KVIndex[i].size;
+    }
+    uint32_t reclaimed = KVLength - length;
+    KVLength = KVLive = length;
+    return reclaimed;
+}
+
+/*
+    kvopen - opens the store in the file name, in flash or on the SD card, creating it if it doesn't exist,
+    and reads the index of its keys
+*/
+void kvopen(const char* name, bool sd) {
+    kvclose();
+    if (strlen(name) + 4 >= BUFFERSIZE) error2("filename is too long");
+    KVSD = sd;
+    fs::FS& fs = kvfs();
+    strcpy(KVName, name);
+    char temp[BUFFERSIZE];
+    if (!fs.exists(KVName) && fs.exists(kvtempname(temp))) fs.rename(temp, KVName);
+    KVFile = fs.open(KVName, "a+");
+    if (!KVFile) error2("problem opening key-value store");
+    KVIndex = (kventry_t*)calloc(16, sizeof(kventry_t));
+    if (KVIndex == NULL) {
+        KVFile.close();
+        error2("no room for the key-value index");
+    }
+    KVSize = 16;
+    KVCount = 0;
+    KVBuffer.count = 0;
+    KVLength = KVFile.size();
+    KVLive = 4;
+    if (KVLength == 0) {
+        binlong(KVMAGIC, kvappend);
+        kvflush();
+        return;
+    }
+    uint32_t magic = 0;
+    kvseek(0);
+    for (int i = 0; i < 4; i++) magic = magic | (uint32_t)kvread() << (i * 8);
+    if (magic != KVMAGIC) {
+        kvclose();
+        error2("not a key-value store");
+    }
+    uint32_t end = kvscan();
+    if (end == 0) {
+        kvclose();
+        error2("key-value store is corrupt");
+    }
+    // Drop a record that was only partly written when the power failed
+    if (end < KVLength) kvcompact();
+}
+
+/*
+    kvstart - opens the default store if no store is open
+*/
+void kvstart() {
+    if (KVIndex == NULL) kvopen(KVDEFAULT, false);
+}
+
+/*
+    (kv-open filename [sd])
+    Opens the key-value store in the file filename in flash or, if sd is non-nil, on the SD card,
+    creating it if it doesn't exist, and returns the number of keys in it.
+*/
+object* fn_kvopen(object* args, object* env) {
+    (void)env;
+    object* filename = checkstring(first(args));
+    bool sd = (cdr(args) != NULL && second(args) != NULL);
+#if !defined(sdcardsupport)
+    if (sd) error2("not supported");
+#endif
+    char buffer[BUFFERSIZE];
+    kvopen(MakeFilename(filename, buffer), sd);
+    return number(KVCount);
+}
+
+/*
+    (kv-put key value)
+    Sets key to value in the key-value store, and returns value.
+*/
+object* fn_kvput(object* args, object* env) {
+    (void)env;
+    object* value = second(args);
+    kvstart();
+    uint32_t hash = kvkey(first(args));
+    kventry_t* entry = kvfind(hash);
+    objectprepare(value);
+    KVBytes = 0;
+    objectwrite(value, kvcount);
+    sharerelabel();
+    uint32_t offset = KVLength;
+    kvrecord(KVPUT, KVBytes);
+    objectwrite(value, kvwrite);
+    sharereset();
+    binlong(KVHash, kvappend);
+    kvupdate(entry, KVPUT, hash, offset, KVLength - offset);
+    return value;
+}
+
+/*
+    (kv-get key [default])
+    Returns the value of key in the key-value store, or default if it has none.
+*/
+object* fn_kvget(object* args, object* env) {
+    (void)env;
+    kvstart();
+    kventry_t* entry = kvfind(kvkey(first(args)));
+    if (entry == NULL) return (cdr(args) != NULL) ? second(args) : nil;
+    kvseek(entry->offset + KVHEADER + KVKeyLength);
+    sharereset();
+    object* value = objectread(kvread, binbyte(kvread));
+    sharereset();
+    return value;
+}
+
+/*
+    (kv-delete key)
+    Removes key from the key-value store, and returns t, or nil if it wasn't there.
+*/
+object* fn_kvdelete(object* args, object* env) {
+    (void)env;
+    kvstart();
+    uint32_t hash = kvkey(first(args));
+    kventry_t* entry = kvfind(hash);
+    if (entry == NULL) return nil;
+    uint32_t offset = KVLength;
+    kvrecord(KVDELETE, 0);
+    binlong(KVHash, kvappend);
+    kvupdate(entry, KVDELETE, hash, offset, KVLength - offset);
+    return tee;
+}
+
+/*
+    (kv-compact)
+    Rewrites the key-value store without the records that later ones have replaced or deleted,
+    and returns the number of bytes reclaimed.
+*/
+object* fn_kvcompact(object* args, object* env) {
+    (void)args, (void)env;
+    kvstart();
+    return number(kvcompact());
+}
+
+// Serial input
+
+/*
+    (serial-raw flag)
+    Switches raw serial input on if flag is true, or off if it's nil, and returns flag.
+*/
+object* fn_serialraw(object* args, object* env) {
+    (void)env;
+    object* flag = first(args);
+    if (flag == nil) clrflag(RAWSERIAL);
+    else setflag(RAWSERIAL);
+    return flag;
+}
+
+// Compiled files
+
+#if defined(sdcardsupport)
+/*
+    faslfilename - makes the name of the FASL file for the source file filename in buffer,
+    by replacing its extension with .fasl
+*/
+char* faslfilename(object* filename, char* buffer) {
+    MakeFilename(filename, buffer);
+    int dot = strlen(buffer);
+    for (int i = dot - 1; i > 0 && buffer[i] != '/'; i--) {
+        if (buffer[i] == '.') {
+            dot = i;
+            break;
+        }
+    }
+    if (dot > BUFFERSIZE - 6) dot = BUFFERSIZE - 6;
+    strcpy(&buffer[dot], ".fasl");
+    return buffer;
+}
+
+/*
+    faslsource - reads a character of the source file compile-file is reading
+*/
+int faslsource() {
+    if (LastChar) {
+        char temp = LastChar;
+        LastChar = 0;
+        return temp;
+    }
+    return filereadbyte(*FaslIn, FaslInBuffer);
+}
+
+/*
+    faslbyte - reads a byte of the FASL file load-compiled is reading
+*/
+int faslbyte() {
+    return filereadbyte(*FaslIn, FaslInBuffer);
+}
+
+/*
+    faslwrite - writes a byte to the FASL file compile-file is writing
+*/
+void faslwrite(char c) {
+    filewritebyte(*FaslOut, FaslOutBuffer, c);
+}
+
+/*
+    faslsymbols - pushes the symbols in form that aren't already on the list *symbols onto it
+*/
+void faslsymbols(object* form, object** symbols) {
+    while (consp(form)) {
+        faslsymbols(car(form), symbols);
+        form = cdr(form);
+    }
+    if (!symbolp(form)) return;
+    for (object* list = *symbols; list != NULL; list = cdr(list)) {
+        if (car(list) == form) return;
+    }
+    push(form, *symbols);
+}
+
+/*
+    faslobject - writes obj to a FASL file; symbols are written as their position in the list symbols
+    Objects with no binary form, such as arrays, are written as their printed representation.
+*/
+void faslobject(object* obj, object* symbols) {
+    if (obj == NULL) faslwrite(FASLNIL);
+    else if (consp(obj)) {
+        int n = 0;
+        object* tail = obj;
+        while (consp(tail)) {
+            n++;
+            tail = cdr(tail);
+        }
+        faslwrite(FASLLIST);
+        binword(n, faslwrite);
+        while (consp(obj)) {
+            faslobject(car(obj), symbols);
+            obj = cdr(obj);
+        }
+        faslobject(tail, symbols);
+    } else if (symbolp(obj)) {
+        int index = 0;
+        while (car(symbols) != obj) {
+            symbols = cdr(symbols);
+            index++;
+        }
+        faslwrite(FASLSYMBOL);
+        binword(index, faslwrite);
+    } else if (integerp(obj)) {
+        faslwrite(FASLNUMBER);
+        binword((uint32_t)obj->integer << 1 ^ (uint32_t)(obj->integer >> 31), faslwrite);
+    } else if (floatp(obj)) {
+        faslwrite(FASLFLOAT);
+        binlong(obj->integer, faslwrite);
+    } else if (characterp(obj)) {
+        faslwrite(FASLCHARACTER);
+        binword((uint8_t)obj->chars, faslwrite);
+    } else if (stringp(obj)) {
+        faslwrite(FASLSTRING);
+        binchars(obj, faslwrite);
+    } else {
+        object* text = startstring();
+        printobject(obj, pstr);
+        faslwrite(FASLTEXT);
+        binchars(text, faslwrite);
+    }
+}
+
+/*
+    faslread - reads an object written by faslobject(), looking up symbols in the vector symbols of size n
+*/
+object* faslread(object* symbols, int n) {
+    uint8_t tag = binbyte(faslbyte);
+    if (tag == FASLNIL) return nil;
+    if (tag == FASLLIST) {
+        int length = binreadword(faslbyte);
+        object* head = NULL;
+        object* tail = NULL;
+        for (int i = 0; i < length; i++) {
+            object* cell = cons(faslread(symbols, n), NULL);
+            if (head == NULL) head = cell;
+            else cdr(tail) = cell;
+            tail = cell;
+        }
+        object* rest = faslread(symbols, n);
+        if (tail == NULL) return rest;
+        cdr(tail) = rest;
+        return head;
+    }
+    if (tag == FASLSYMBOL) {
+        uint32_t index = binreadword(faslbyte);
+        if (index >= (uint32_t)n) error2("FASL file is corrupt");
+        return *arrayref(symbols, index, n);
+    }
+    if (tag == FASLNUMBER) {
+        uint32_t z = binreadword(faslbyte);
+        return number((int)(z >> 1) ^ -(int)(z & 1));
+    }
+    if (tag == FASLFLOAT) {
+        uint32_t bits = binreadlong(faslbyte);
+        float f;
+        memcpy(&f, &bits, sizeof(f));
+        return makefloat(f);
+    }
+    if (tag == FASLCHARACTER) return character(binreadword(faslbyte));
+    if (tag == FASLSTRING) return binreadchars(faslbyte);
+    if (tag == FASLTEXT) return fn_readfromstring(cons(binreadchars(faslbyte), NULL), NULL);
+    error2("FASL file is corrupt");
+    return nil;
+}
+
+/*
+    reloadread - reads a character from the SD card like SDread, and adds it to ReloadHash
+    Comments and runs of white space outside strings count as one space, and aren't counted before the form,
+    so only edits to the text of the form itself change its hash.
+*/
+int reloadread() {
+    if (LastChar) {
+        char temp = LastChar;
+        LastChar = 0;
+        return temp;
+    }
+    int c = filereadbyte(SDgfile, &SDgbuffer);
+    uint8_t state = ReloadState;
+    if (c == -1) return c;
+    if (state == RELOADCOMMENT || state == RELOADSTARTCOMMENT) {
+        if (c == '\n') ReloadState = (state == RELOADCOMMENT) ? RELOADSPACE : RELOADSTART;
+        return c;
+    }
+    if (state == RELOADSTRING) {
+        if (c == '"') ReloadState = RELOADCODE;
+        else if (c == '\\') ReloadState = RELOADESCAPE;
+    } else if (state == RELOADESCAPE) ReloadState = RELOADSTRING;
+    else if (state == RELOADCHARACTER) ReloadState = RELOADCODE;
+    else if (c == ';') {
+        ReloadState = (state == RELOADSTART) ? RELOADSTARTCOMMENT : RELOADCOMMENT;
+        return c;
+    } else if (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+        if (state == RELOADCODE) ReloadState = RELOADSPACE;
+        return c;
+    } else {
+        if (state == RELOADSPACE) ReloadHash = (ReloadHash ^ ' ') * 16777619u;
+        ReloadState = (c == '"') ? RELOADSTRING : (c == '\\') ? RELOADCHARACTER : RELOADCODE;
+    }
+    ReloadHash = (ReloadHash ^ c) * 16777619u;
+    return c;
+}
+
+/*
+    reloadentry - returns the entry in Reloaded for the file whose name has the hash file,
+    or the entry to replace if the file hasn't been reloaded
+*/
+reload_t* reloadentry(uint32_t file) {
+    reload_t* entry = &Reloaded[file % RELOADFILES];
+    for (int i = 0; i < RELOADFILES; i++) {
+        if (Reloaded[i].hashes == NULL) entry = &Reloaded[i];
+        else if (Reloaded[i].file == file) return &Reloaded[i];
+    }
+    return entry;
+}
+
+/*
+    reloadedp - returns true if a form with the hash hash was in the file when entry was last reloaded
+*/
+bool reloadedp(reload_t* entry, uint32_t hash) {
+    for (int i = 0; i < entry->count; i++) {
+        if (entry->hashes[i] == hash) return true;
+    }
+    return false;
+}
+#endif
+
+/*
+    (compile-file filename)
+    Reads the Lisp source file filename on the SD card and writes its forms, in a binary form that
+    loads without the reader, to a file with the extension .fasl. Returns the name of the FASL file.
+*/
+object* fn_compilefile(object* args, object* env) {
+#if defined(sdcardsupport)
+    (void)env;
+    object* filename = checkstring(first(args));
+    char buffer[BUFFERSIZE];
+    SD.begin();
+    File source = SD.open(MakeFilename(filename, buffer), FILE_READ);
+    if (!source) error("problem reading from SD card or invalid filename", filename);
+    File fasl;
+    filebuffer_t sourcebuffer, faslbuffer;
+    sourcebuffer.count = 0;
+    sourcebuffer.index = 0;
+    faslbuffer.count = 0;
+    jmp_buf dynamic_handler;
+    jmp_buf* previous_handler = handler;
+    handler = &dynamic_handler;
+    if (setjmp(dynamic_handler)) {
+        // Close the files, and pass the error on
+        handler = previous_handler;
+        source.close();
+        fasl.close();
+        GCStack = NULL;
+        longjmp(*handler, 1);
+    }
+    FaslIn = &source;
+    FaslInBuffer = &sourcebuffer;
+    LastChar = 0;
+    // The symbols come first in the FASL file, so the source is read once to find them, and again for the forms,
+    // so that only one form at a time is in the workspace
+    object* symbols = cons(NULL, NULL);
+    protect(symbols);
+    int forms = 0;
+    for (;;) {
+        object* form = read(faslsource);
+        if (form == NULL) break;
+        faslsymbols(form, &car(symbols));
+        forms++;
+    }
+    symbols = car(symbols);
+    uint32_t size = source.size(), written = source.getLastWrite();
+    fileseek(&source, &sourcebuffer, false, 0);
+    fasl = SD.open(faslfilename(filename, buffer), FILE_WRITE);
+    if (!fasl) error("problem writing to SD card or invalid filename", filename);
+    FaslOut = &fasl;
+    FaslOutBuffer = &faslbuffer;
+    binlong(FASLMAGIC, faslwrite);
+    faslwrite(FASLVERSION);
+    binlong(tablesignature(), faslwrite);
+    binlong(size, faslwrite);
+    binlong(written, faslwrite);
+    binword(listlength(symbols), faslwrite);
+    for (object* list = symbols; list != NULL; list = cdr(list)) {
+        object* sym = car(list);
+        if (longsymbolp(sym)) {
+            faslwrite(1);
+            binchars(sym, faslwrite);
+        } else {
+            faslwrite(0);
+            binlong(sym->name, faslwrite);
+        }
+    }
+    binword(forms, faslwrite);
+    for (int i = 0; i < forms; i++) faslobject(read(faslsource), symbols);
+    fileflush(fasl, &faslbuffer);
+    fasl.close();
+    source.close();
+    handler = previous_handler;
+    unprotect();
+    return lispstring(&buffer[1]);
+#else
+    (void)args, (void)env;
+    error2("not supported");
+    return nil;
+#endif
+}
+
+/*
+    (load-compiled filename)
+    If the FASL file made by compile-file from the source file filename was compiled from the source as it is now,
+    evaluates its forms and returns t. Otherwise, or if it was compiled by firmware with different builtins,
+    returns nil. The source is taken to be unchanged if its size and time of last write are the same.
+*/
+object* fn_loadcompiled(object* args, object* env) {
+#if defined(sdcardsupport)
+    object* filename = checkstring(first(args));
+    char source[BUFFERSIZE], fasl[BUFFERSIZE];
+    MakeFilename(filename, source);
+    faslfilename(filename, fasl);
+    SD.begin();
+    if (!SD.exists(fasl)) return nil;
+    bool check = SD.exists(source);
+    uint32_t size = 0, written = 0;
+    if (check) {
+        File file = SD.open(source, FILE_READ);
+        size = file.size();
+        written = file.getLastWrite();
+        file.close();
+    }
+    File file = SD.open(fasl, FILE_READ);
+    if (!file) error("problem reading from SD card or invalid filename", filename);
+    filebuffer_t buffer;
+    buffer.count = 0;
+    buffer.index = 0;
+    jmp_buf dynamic_handler;
+    jmp_buf* previous_handler = handler;
+    handler = &dynamic_handler;
+    if (setjmp(dynamic_handler)) {
+        // Close the file, and pass the error on
+        handler = previous_handler;
+        file.close();
+        GCStack = NULL;
+        longjmp(*handler, 1);
+    }
+    FaslIn = &file;
+    FaslInBuffer = &buffer;
+    if (binreadlong(faslbyte) != FASLMAGIC) error("not a FASL file", lispstring(&fasl[1]));
+    bool valid = binbyte(faslbyte) == FASLVERSION && binreadlong(faslbyte) == tablesignature();
+    if (valid) {
+        uint32_t faslsize = binreadlong(faslbyte), faslwritten = binreadlong(faslbyte);
+        valid = !check || (faslsize == size && faslwritten == written);
+    }
+    if (!valid) {
+        file.close();
+        handler = previous_handler;
+        return nil;
+    }
+    int n = binreadword(faslbyte);
+    object* symbols = (n == 0) ? NULL : makearray(cons(number(n), NULL), NULL, false);
+    protect(symbols);
+    char name[BUFFERSIZE];
+    for (int i = 0; i < n; i++) {
+        object* sym;
+        if (binbyte(faslbyte) == 0) sym = symbol(binreadlong(faslbyte));
+        else {
+            int length = binreadword(faslbyte);
+            if (length >= BUFFERSIZE) error2("FASL file is corrupt");
+            for (int j = 0; j < length; j++) name[j] = binbyte(faslbyte);
+            name[length] = '\0';
+            sym = internlong(name);
+        }
+        *arrayref(symbols, i, n) = sym;
+    }
+    // Each form is evaluated as it's read, so only one is in the workspace at a time
+    int count = binreadword(faslbyte);
+    for (int i = 0; i < count; i++) {
+        FaslIn = &file;  // The last form may have used load-compiled itself
+        FaslInBuffer = &buffer;
+        object* form = faslread(symbols, n);
+        protect(form);
+        eval(form, env);
+        unprotect();
+    }
+    file.close();
+    handler = previous_handler;
+    unprotect();
+    return tee;
+#else
+    (void)args, (void)env;
+    error2("not supported");
+    return nil;
+#endif
+}
+
+/*
+    (reload filename)
+    Evaluates the forms in the Lisp source file filename on the SD card whose text has changed, or that are new,
+    since the file was last reloaded, prints the names of the definitions it skipped, and returns the number of forms
+    evaluated. The first time a file is reloaded all its forms are evaluated.
+*/
+object* fn_reload(object* args, object* env) {
+#if defined(sdcardsupport)
+    object* filename = checkstring(first(args));
+    char buffer[BUFFERSIZE];
+    uint32_t file = 2166136261u;
+    for (char* name = MakeFilename(filename, buffer); *name != 0; name++) file = (file ^ *name) * 16777619u;
+    reload_t* entry = reloadentry(file);
+    if (entry->file != file) entry->count = 0;
+    SD.begin();
+    SDgfile = SD.open(buffer, FILE_READ);
+    if (!SDgfile) error("problem reading from SD card or invalid filename", filename);
+    SDgbuffer.count = 0;
+    SDgbuffer.index = 0;
+    LastChar = 0;
+    free(ReloadHashes);  // Left by a reload that stopped with an error
+    ReloadHashes = NULL;
+    // cdr is the forms to evaluate, and cdr of car the names of the skipped definitions
+    object* head = cons(cons(NULL, NULL), NULL);
+    protect(head);
+    object* tail = head;
+    object* names = car(head);
+    int count = 0, size = 0, skipped = 0;
+    for (;;) {
+        ReloadHash = 2166136261u;
+        ReloadState = RELOADSTART;
+        object* form = read(reloadread);
+        if (form == NULL) break;
+        if (count == size) {
+            size = size ? size * 2 : 16;
+            uint32_t* hashes = (uint32_t*)realloc(ReloadHashes, size * sizeof(uint32_t));
+            if (hashes == NULL) {
+                SDgfile.close();
+                error2("no room for form hashes");
+            }
+            ReloadHashes = hashes;
+        }
+        ReloadHashes[count++] = ReloadHash;
+        if (!reloadedp(entry, ReloadHash)) {
+            cdr(tail) = cons(form, NULL);
+            tail = cdr(tail);
+            continue;
+        }
+        skipped++;
+        if (consp(form) && symbolp(first(form)) && consp(cdr(form))) {
+            symbol_t fname = first(form)->name;
+            if (fname == sym(DEFUN) || fname == sym(DEFVAR) || fname == sym(DEFMACRO)) {
+                cdr(names) = cons(second(form), NULL);
+                names = cdr(names);
+            }
+        }
+    }
+    SDgfile.close();
+    if (skipped > 0) {
+        pfstring("Skipped ", pserial);
+        pint(skipped, pserial);
+        pfstring(" unchanged forms", pserial);
+        if (cdr(car(head)) != NULL) {
+            pserial(':');
+            for (object* list = cdr(car(head)); list != NULL; list = cdr(list)) {
+                pserial(' ');
+                printobject(car(list), pserial);
+            }
+        }
+        pln(pserial);
+    }
+    int evaluated = 0;
+    for (object* list = cdr(head); list != NULL; list = cdr(list)) {
+        eval(car(list), env);
+        evaluated++;
+    }
+    // Only remember the new hashes once every changed form has been evaluated
+    free(entry->hashes);
+    entry->file = file;
+    entry->count = count;
+    entry->hashes = ReloadHashes;
+    ReloadHashes = NULL;
+    unprotect();
+    return number(evaluated);
+#else
+    (void)args, (void)env;
+    error2("not supported");
+    return nil;
+#endif
+}
+
+/*
+    (restart-i2c stream [read-p])
+    Restarts an i2c-stream.
+    If read-p is nil or omitted the stream is written to.
+    If read-p is an integer it specifies the number of bytes to be read from the stream.
+*/
+object* fn_restarti2c(object* args, object* env) {
+    (void)env;
+    int stream = isstream(first(args));
+    args = cdr(args);
+    int read = 0;  // Write
+    I2Ccount = 0;
+    if (args != NULL) {
+        object* rw = first(args);
+        if (integerp(rw)) I2Ccount = rw->integer;
+        read = (rw != NULL);
+    }
+    int address = stream & 0xFF;
+    if (stream >> 8 != I2CSTREAM) error2("not an i2c stream");
+    TwoWire* port;
+    if (address < 128) port = &Wire;
+#if defined(ULISP_I2C1)
+    else port = &Wire1;
+#endif
+    return I2Crestart(port, address & 0x7F, read) ? tee : nil;
+}
+
+/*
+    (gc)
+    Forces a garbage collection and prints the number of objects collected, and the time taken.
+*/
+object* fn_gc(object* obj, object* env) {
+    int initial = Freespace;
+    unsigned long start = micros();
+    gc(obj, env);
+    unsigned long elapsed = micros() - start;
+    pfstring("Space: ", pserial);
+    pint(Freespace - initial, pserial);
+    pfstring(" bytes, Time: ", pserial);
+    pint(elapsed, pserial);
+    pfstring(" us\n", pserial);
+    return nil;
+}
+
+/*
+    (room)
+    Returns the number of free Lisp cells remaining.
+*/
+object* fn_room(object* args, object* env) {
+    (void)args, (void)env;
+    return number(Freespace);
+}
+
+/*
+    (cls)
+    Prints a clear-screen character.
+*/
+object* fn_cls(object* args, object* env) {
+    (void)args, (void)env;
+    pserial(12);
+    return nil;
+}
+
+// Arduino procedures
+
+/*
+    (pinmode pin mode)
+    Sets the input/output mode of an Arduino pin number, and returns nil.
+    The mode parameter can be an integer, a keyword, or t or nil.
+*/
+object* fn_pinmode(object* args, object* env) {
+    (void)env;
+    int pin;
+    object* arg = first(args);
+    if (builtin_keywordp(arg)) pin = checkkeyword(arg);
+    else pin = checkinteger(first(args));
+    int pm = INPUT;
+    arg = second(args);
+    if (builtin_keywordp(arg)) pm = checkkeyword(arg);
+    else if (integerp(arg)) {
+        int mode = arg->integer;
+        if (mode == 1) pm = OUTPUT;
+        else if (mode == 2) pm = INPUT_PULLUP;
+#if defined(INPUT_PULLDOWN)
+        else if (mode == 4) pm = INPUT_PULLDOWN;
+#endif
+    } else if (arg != nil) pm = OUTPUT;
+    pinMode(pin, pm);
+    return nil;
+}
+
+/*
+    (digitalread pin)
+    Reads the state of the specified Arduino pin number and returns t (high) or nil (low).
+*/
+object* fn_digitalread(object* args, object* env) {
+    (void)env;
+    int pin;
+    object* arg = first(args);
+    if (builtin_keywordp(arg)) pin = checkkeyword(arg);
+    else pin = checkinteger(arg);
+    if (digitalRead(pin) != 0) return tee;
+    else return nil;
+}
+
+/*
+    (digitalwrite pin state)
+    Sets the state of the specified Arduino pin number.
+*/
+object* fn_digitalwrite(object* args, object* env) {
+    (void)env;
+    int pin;
+    object* arg = first(args);
+    if (builtin_keywordp(arg)) pin = checkkeyword(arg);
+    else pin = checkinteger(arg);
+    arg = second(args);
+    int mode;
+    if (builtin_keywordp(arg)) mode = checkkeyword(arg);
+    else if (integerp(arg)) mode = arg->integer ? HIGH : LOW;
+    else mode = (arg != nil) ? HIGH : LOW;
+    digitalWrite(pin, mode);
+    return arg;
+}
+
+/*
+    (analogread pin)
+    Reads the specified Arduino analogue pin number and returns the value.
+*/
+object* fn_analogread(object* args, object* env) {
+    (void)env;
+    int pin;
+    object* arg = first(args);
+    if (builtin_keywordp(arg)) pin = checkkeyword(arg);
+    else {
+        pin = checkinteger(arg);
+        checkanalogread(pin);
+    }
+    return number(analogRead(pin));
+}
+
+/*
+    (analogreadresolution bits)
+    Specifies the resolution for the analogue inputs on platforms that support it.
+    The default resolution on all platforms is 10 bits.
+*/
+object* fn_analogreadresolution(object* args, object* env) {
+    (void)env;
+    object* arg = first(args);
+    analogReadResolution(checkinteger(arg));
+    return arg;
+}
+
+/*
+    (analogwrite pin value)
+    Writes the value to the specified Arduino pin number.
+*/
+object* fn_analogwrite(object* args, object* env) {
+    (void)env;
+    int pin;
+    object* arg = first(args);
+    if (builtin_keywordp(arg)) pin = checkkeyword(arg);
+    else pin = checkinteger(arg);
+    checkanalogwrite(pin);
+    object* value = second(args);
+#ifdef toneimplemented
+    analogWrite
+#else
+    dacWrite
+#endif
+      (pin, checkinteger(value));
+    return value;
+}
+
+/*
+    (delay number)
+    Delays for a specified number of milliseconds.
+*/
+object* fn_delay(object* args, object* env) {
+    (void)env;
+    object* arg1 = first(args);
+    unsigned long start = millis();
+    unsigned long total = checkinteger(arg1);
+    flushoutput();
+    do testescape();
+    while (millis() - start < total);
+    return arg1;
+}
+
+/*
+    (millis)
+    Returns the time in milliseconds that uLisp has been running.
+*/
+object* fn_millis(object* args, object* env) {
+    (void)args, (void)env;
+    return number(millis());
+}
+
+/*
+    (sleep secs)
+    Puts the processor into a low-power sleep mode for secs.
+    Only supported on some platforms. On other platforms it does delay(1000*secs).
+*/
+object* fn_sleep(object* args, object* env) {
+    (void)env;
+    object* arg1 = first(args);
+    doze(checkinteger(arg1));
+    return arg1;
+}
+
+/*
+    (note [pin] [note] [octave])
+    Generates a square wave on pin.
+    The argument note represents the note in the well-tempered scale, from 0 to 11,  
+    where 0 represents C, 1 represents C#, and so on.
+    The argument octave can be from 3 to 6. If omitted it defaults to 0.
+    When called with no arguments, turns off the PWM on the last-used pin.
+*/
+object* fn_note(object* args, object* env) {
+    (void)env;
+    static int pin = 255;
+    if (args != NULL) {
+        pin = checkinteger(first(args));
+        int note = 48, octave = 0;
+        if (cdr(args) != NULL) {
+            note = checkinteger(second(args));
+            if (cddr(args) != NULL) octave = checkinteger(third(args));
+        }
+        playnote(pin, note, octave);
+    } else nonote(pin);
+    return nil;
+}
+
+/*
+    (register address [value])
+    Reads or writes the value of a peripheral register.
+    If value is not specified the function returns the value of the register at address.
+    If value is specified the value is written to the register at address and the function returns value.
+*/
+object* fn_register(object* args, object* env) {
+    (void)env;
+    object* arg = first(args);
+    int addr;
+    if (builtin_keywordp(arg)) addr = checkkeyword(arg);
+    else addr = checkinteger(first(args));
+    if (cdr(args) == NULL) return number(*(uint32_t*)addr);
+    (*(uint32_t*)addr) = checkinteger(second(args));
+    return second(args);
+}
+
+// Tree Editor
+
+/*
+    (edit 'function)
+    Calls the Lisp tree editor to allow you to edit a function definition.
+*/
+object* fn_edit(object* args, object* env) {
+    object* fun = first(args);
+    object* pair = findvalue(fun, env);
+    clrflag(EXITEDITOR);
+    object* arg = edit(eval(fun, env));
+    cdr(pair) = arg;
+    return arg;
 }
 
 // Pretty printer
 
 /*
-    (pprint item [str])
-    Prints its argument, using the pretty printer, to display it formatted in a structured way.
-    If str is specified it prints to the specified stream. It returns no value.
+    (pprint item [str])
+    Prints its argument, using the pretty printer, to display it formatted in a structured way.
+    If str is specified it prints to the specified stream. It returns no value.
+*/
+object* fn_pprint(object* args, object* env) {
+    (void)env;
+    object* obj = first(args);
+    pfun_t pfun = pstreamfun(cdr(args));
+#if defined(gfxsupport)
+    if (pfun == gfxwrite) ppwidth = GFXPPWIDTH;
+#endif
+    pln(pfun);
+    superprint(obj, 0, pfun);
+    ppwidth = PPWIDTH;
+    return bsymbol(NOTHING);
+}
+
+/*
+    (pprintall [str])
+    Pretty-prints the definition of every function and variable defined in the uLisp workspace.
+    If str is specified it prints to the specified stream. It returns no value.
+*/
+object* fn_pprintall(object* args, object* env) {
+    (void)env;
+    pfun_t pfun = pstreamfun(args);
+#if defined(gfxsupport)
+    if (pfun == gfxwrite) ppwidth = GFXPPWIDTH;
+#endif
+    object* globals = GlobalEnv;
+    while (globals != NULL) {
+        object* pair = first(globals);
+        object* var = car(pair);
+        object* val = cdr(pair);
+        pln(pfun);
+        if (consp(val) && symbolp(car(val)) && builtin(car(val)->name) == LAMBDA) {
+            superprint(cons(bsymbol(DEFUN), cons(var, cdr(val))), 0, pfun);
+        } else {
+            superprint(cons(bsymbol(DEFVAR), cons(var, cons(quoteit(QUOTE, val), NULL))), 0, pfun);
+        }
+        pln(pfun);
+        testescape();
+        globals = cdr(globals);
+    }
+    ppwidth = PPWIDTH;
+    return bsymbol(NOTHING);
+}
+
+// Format
+
+/*
+    A control string is compiled once into a program: a chain of cells linked through car, each holding
+    a 32-bit word. Literal text is a FMTTEXT word holding the length, followed by the characters packed
+    four to a word. Each directive is a word holding the op and its position in the control string,
+    followed by a word holding the pad character, width, and precision (0xFF if none).
+*/
+
+/*
+    formatword - appends a word to the program being built at tail, and returns the new cell
+*/
+object* formatword(uint32_t word, object** tail) {
+    object* cell = myalloc();
+    car(cell) = NULL;
+    cell->integer = word;
+    car(*tail) = cell;
+    *tail = cell;
+    return cell;
+}
+
+/*
+    formatcompile - compiles a format control string into a program, checking its syntax
+*/
+object* formatcompile(object* formatstr) {
+    object* head = myalloc();
+    car(head) = NULL;
+    object* tail = head;
+    object* text = NULL;
+    int len = stringlength(formatstr), textlen = 0;
+    uint8_t width = 0, precision = 0xFF;
+    char pad = ' ';
+    bool tilde = false, comma = false, quote = false, inloop = false;
+    stringcursor_t cursor;
+    cursorstart(&cursor, formatstr, 0);
+    for (int n = 0; n < len; n++) {
+        char ch = cursornext(&cursor);
+        char ch2 = ch & ~0x20;  // force to upper case
+        char lit = 0;
+        int op = -1;
+        if (!tilde) {
+            if (ch == '~') {
+                tilde = true;
+                pad = ' ';
+                width = 0;
+                precision = 0xFF;
+                comma = false;
+                quote = false;
+            } else lit = ch;
+        } else if (comma && quote) {
+            pad = ch;
+            comma = false, quote = false;
+        } else if (ch == '\'') {
+            if (comma) quote = true;
+            else formaterr(formatstr, "quote not valid", n);
+        } else if (ch >= '0' && ch <= '9') {
+            if (comma) precision = ((precision == 0xFF) ? 0 : precision * 10) + ch - '0';
+            else width = width * 10 + ch - '0';
+        } else if (ch == ',') comma = true;
+        else {
+            tilde = false;
+            if (ch == '~') lit = '~';
+            else if (ch == '%') lit = '\n';
+            else if (ch == '&') op = FMTFRESHLINE;
+            else if (ch == '^') op = FMTCARET;
+            else if (ch == '{') {
+                if (inloop) formaterr(formatstr, "can't nest ~{", n);
+                inloop = true;
+                op = FMTOPEN;
+            } else if (ch == '}') {
+                if (!inloop) formaterr(formatstr, "no matching ~{", n);
+                inloop = false;
+                op = FMTCLOSE;
+            } else if (ch2 == 'A') op = FMTA;
+            else if (ch2 == 'S') op = FMTS;
+            else if (ch2 == 'D' || ch2 == 'G') op = FMTD;
+            else if (ch2 == 'X') op = FMTX;
+            else if (ch2 == 'B') op = FMTB;
+            else if (ch2 == 'F') op = FMTF;
+            else if (ch2 == 'E') op = FMTE;
+            else formaterr(formatstr, "invalid directive", n);
+        }
+        if (lit) {
+            if (text == NULL || textlen == 0xFFFF) {
+                text = formatword(FMTTEXT << 24, &tail);
+                textlen = 0;
+            }
+            if ((textlen & 3) == 0) formatword(0, &tail);
+            tail->integer |= (uint32_t)(uint8_t)lit << ((3 - (textlen & 3)) << 3);
+            text->integer = FMTTEXT << 24 | ++textlen;
+        } else if (op != -1) {
+            text = NULL;
+            formatword(op << 24 | n, &tail);
+            formatword((uint8_t)pad << 16 | width << 8 | precision, &tail);
+        }
+    }
+    return car(head);
+}
+
+/*
+    formatprogram - returns the compiled program for a control string, compiling it if it isn't cached
+*/
+object* formatprogram(object* formatstr) {
+    formatcache_t* entry = &FormatCache[((uintptr_t)formatstr >> 3) % FORMATCACHESIZE];
+    if (entry->string != formatstr) {
+        object* program = formatcompile(formatstr);
+        entry->string = formatstr;
+        entry->program = program;
+    }
+    return entry->program;
+}
+
+/*
+    formatuncache - forgets the compiled program for a control string that is being altered
+*/
+void formatuncache(object* formatstr) {
+    formatcache_t* entry = &FormatCache[((uintptr_t)formatstr >> 3) % FORMATCACHESIZE];
+    if (entry->string == formatstr) {
+        entry->string = NULL;
+        entry->program = NULL;
+    }
+}
+
+/*
+    pformat - prints a character to the buffer that holds the current format field
+*/
+void pformat(char c) {
+    if (FormatCount == FORMATBUFFER) {
+        for (int i = 0; i < FormatCount; i++) FormatPfun(FormatBuffer[i]);
+        FormatCount = 0;
+    }
+    FormatBuffer[FormatCount++] = c;
+    FormatLength++;
+}
+
+/*
+    formatfield - outputs the buffered field, padded to width on the left or right
+    A field too long for the buffer is already wider than any width, so it never needs padding
+*/
+void formatfield(uint8_t width, char pad, bool left) {
+    uint8_t w = (FormatLength < width) ? width - FormatLength : 0;
+    if (left) indent(w, pad, FormatPfun);
+    for (int i = 0; i < FormatCount; i++) FormatPfun(FormatBuffer[i]);
+    if (!left) indent(w, pad, FormatPfun);
+}
+
+/*
+    formatfloat - prints a number for ~F or ~E with precision digits after the point
+    If no precision is given, trailing zeros are dropped
+*/
+void formatfloat(object* arg, bool expt, uint8_t precision) {
+    char buffer[64];
+    int digits = (precision == 0xFF) ? 6 : (precision > 16) ? 16 : precision;
+    snprintf(buffer, sizeof(buffer), expt ? "%.*e" : "%.*f", digits, (double)checkintfloat(arg));
+    char* e = strchr(buffer, 'e');
+    char* end = (e != NULL) ? e : buffer + strlen(buffer);
+    char* p = end;
+    if (precision == 0xFF && strchr(buffer, '.') != NULL) {
+        while (p[-1] == '0' && p[-2] != '.') p--;
+    }
+    for (char* q = buffer; q < p; q++) pformat(*q);
+    while (e != NULL && *e != 0) pformat(*e++);
+}
+
+/*
+    (format output controlstring [arguments]*)
+    Outputs its arguments formatted according to the format directives in controlstring.
+*/
+object* fn_format(object* args, object* env) {
+    (void)env;
+    pfun_t pfun = pserial;
+    object* output = first(args);
+    object* obj;
+    if (output == nil) {
+        obj = startstring();
+        pfun = pstr;
+    } else if (output != tee) pfun = pstreamfun(args);
+    object* formatstr = checkstring(second(args));
+    object* word = formatprogram(formatstr);
+    object* save = NULL;
+    object* loop = NULL;
+    args = cddr(args);
+    bool mute = false;
+    FormatPfun = pfun;
+    while (word != NULL) {
+        uint32_t op = word->integer;
+        word = car(word);
+        if (op >> 24 == FMTTEXT) {
+            object* chunk = NULL;
+            for (int i = 0; i < (int)(op & 0xFFFF); i++) {
+                if ((i & 3) == 0) {
+                    chunk = word;
+                    word = car(word);
+                }
+                if (!mute) pfun(chunk->integer >> ((3 - (i & 3)) << 3));
+            }
+            continue;
+        }
+        uint8_t n = op & 0xFFFF;
+        uint32_t params = word->integer;
+        word = car(word);
+        char pad = params >> 16;
+        uint8_t width = params >> 8, precision = params;
+        op = op >> 24;
+        if (op == FMTCLOSE) {
+            if (args == NULL) {
+                args = cdr(save);
+                save = NULL;
+            } else word = loop;
+            mute = false;
+        } else if (mute) continue;
+        else if (op == FMTFRESHLINE) pfl(pfun);
+        else if (op == FMTCARET) {
+            if (save != NULL && args == NULL) mute = true;
+        } else if (op == FMTOPEN) {
+            if (args == NULL) formaterr(formatstr, noargument, n);
+            if (!listp(first(args))) formaterr(formatstr, notalist, n);
+            save = args;
+            args = first(args);
+            loop = word;
+            if (args == NULL) mute = true;
+        } else {
+            if (args == NULL) formaterr(formatstr, noargument, n);
+            object* arg = first(args);
+            args = cdr(args);
+            FormatCount = 0;
+            FormatLength = 0;
+            if (op == FMTA) {
+                prin1object(arg, pformat);
+                formatfield(width, pad, false);
+            } else if (op == FMTS) {
+                printobject(arg, pformat);
+                formatfield(width, pad, false);
+            } else if ((op == FMTX || op == FMTB) && integerp(arg)) {
+                pintbase(arg->integer, (op == FMTB) ? 2 : 16, pformat);
+                formatfield(width, pad, true);
+            } else if ((op == FMTF || op == FMTE) && (integerp(arg) || floatp(arg) || bignump(arg))) {
+                formatfloat(arg, op == FMTE, precision);
+                formatfield(width, pad, true);
+            } else {
+                prin1object(arg, pformat);
+                formatfield(width, pad, true);
+            }
+        }
+    }
+    if (output == nil) return obj;
+    else return nil;
+}
+
+// LispLibrary
+
+/*
+    unpackstart - starts unpacking data, which unpacks to length characters
+*/
+void unpackstart(unpack_t* unpack, const uint8_t* data, int length) {
+    unpack->data = data;
+    unpack->length = length;
+    unpack->in = 0;
+    unpack->out = 0;
+    unpack->items = 0;
+    unpack->copy = 0;
+}
+
+/*
+    unpacknext - returns the next character unpacked from data packed by packlibrary.py, or 0 at the end
+    The data is LZSS: a flag byte precedes each group of eight items, with bit 0 first; a set bit is a literal
+    byte, and a clear bit is a match of two bytes giving a distance of 1 to 1024 back and a length of 3 to 66.
+    Only the last UNPACKWINDOW characters are kept, so the library is never unpacked in full.
+*/
+char unpacknext(unpack_t* unpack) {
+    if (unpack->out >= unpack->length) return 0;
+    char c;
+    if (unpack->copy == 0) {
+        if (unpack->items == 0) {
+            unpack->flags = unpack->data[unpack->in++];
+            unpack->items = 8;
+        }
+        bool literal = unpack->flags & 1;
+        unpack->flags = unpack->flags >> 1;
+        unpack->items--;
+        if (literal) {
+            c = unpack->data[unpack->in++];
+            unpack->window[unpack->out++ % UNPACKWINDOW] = c;
+            return c;
+        }
+        uint8_t low = unpack->data[unpack->in++], high = unpack->data[unpack->in++];
+        unpack->from = unpack->out - ((low | (high >> 6) << 8) + 1);
+        unpack->copy = (high & 0x3F) + 3;
+    }
+    c = unpack->window[unpack->from++ % UNPACKWINDOW];
+    unpack->copy--;
+    unpack->window[unpack->out++ % UNPACKWINDOW] = c;
+    return c;
+}
+
+/*
+    librarypeek - returns the next character of the Lisp Library without reading it, or 0 at the end
+*/
+char librarypeek() {
+#if defined(packedlibrary)
+    if (LibraryAhead < 0) LibraryAhead = (uint8_t)unpacknext(&LibraryUnpack);
+    return LibraryAhead;
+#else
+    return LispLibrary[GlobalStringIndex];
+#endif
+}
+
+/*
+    librarynext - reads the next character of the Lisp Library, or returns 0 at the end
+*/
+char librarynext() {
+    char c = librarypeek();
+    if (c == 0) return 0;
+#if defined(packedlibrary)
+    LibraryAhead = -1;
+#endif
+    GlobalStringIndex++;
+    return c;
+}
+
+/*
+    libraryseek - moves to character offset in the Lisp Library
+    A packed library can only be read forwards, so moving back unpacks it again from the start.
+*/
+void libraryseek(int offset) {
+#if defined(packedlibrary)
+    if (offset < GlobalStringIndex || LibraryUnpack.data == NULL) {
+        unpackstart(&LibraryUnpack, LispLibraryPacked, LIBRARYPACKED);
+        LibraryAhead = -1;
+        GlobalStringIndex = 0;
+    }
+    while (GlobalStringIndex < offset && librarynext() != 0);
+#else
+    GlobalStringIndex = offset;
+#endif
+}
+
+/*
+    librarytoken - copies the next token in the Lisp Library to buffer, skipping white space
+*/
+void librarytoken(char* buffer) {
+    char c = librarypeek();
+    while (issp(c)) {
+        librarynext();
+        c = librarypeek();
+    }
+    int n = 0;
+    while (c != 0 && !issp(c) && !isbr(c)) {
+        if (n < BUFFERSIZE - 1) buffer[n++] = c;
+        librarynext();
+        c = librarypeek();
+    }
+    buffer[n] = '\0';
+}
+
+/*
+    libraryname - reads the start of a form whose open bracket has just been read, and copies the name
+    it defines to buffer and returns true, or returns false if the form isn't a defun or defvar
+*/
+bool libraryname(char* buffer) {
+    librarytoken(buffer);
+    if (strcasecmp(buffer, "defun") != 0 && strcasecmp(buffer, "defvar") != 0) return false;
+    librarytoken(buffer);
+    return buffer[0] != '\0';
+}
+
+/*
+    librarykey - returns the symbol name of the symbol in buffer, as the reader would make it,
+    or for a long symbol a hash of its characters with the low bits clear, like a long symbol name
+*/
+uint32_t librarykey(char* buffer) {
+    builtin_t x = lookupbuiltin(buffer);
+    if (x != ENDFUNCTIONS) return sym(x);
+    if (strlen(buffer) <= 6 && valid40(buffer)) return twist(pack40(buffer));
+    uint32_t hash = 2166136261u;
+    for (int i = 0; buffer[i] != '\0'; i++) hash = (hash ^ (uint8_t)buffer[i]) * 16777619u;
+    return hash & ~3;
+}
+
+/*
+    scanlibrary - finds the top-level defun and defvar forms in the Lisp Library, stores their keys and offsets
+    in index if it isn't NULL, and returns how many there are
+    Skips strings, comments, and characters, which may contain brackets.
+*/
+int scanlibrary(libraryentry_t* index) {
+    char buffer[BUFFERSIZE];
+    int count = 0, depth = 0;
+    libraryseek(0);
+    char c = librarynext();
+    while (c != 0) {
+        if (c == ';') {
+            while (librarypeek() != 0 && librarypeek() != '\n') librarynext();
+        } else if (c == '"') {
+            c = librarynext();
+            while (c != 0 && c != '"') {
+                if (c == '\\') librarynext();
+                c = librarynext();
+            }
+        } else if (c == '#' && librarypeek() == '\\') {
+            librarynext();
+            librarynext();
+        } else if (c == '#' && librarypeek() == '|') {
+            librarynext();
+            c = librarynext();
+            while (c != 0 && !(c == '|' && librarypeek() == '#')) c = librarynext();
+            librarynext();
+        } else if (c == '(') {
+            int offset = GlobalStringIndex - 1;
+            if (depth == 0 && libraryname(buffer)) {
+                if (index != NULL) {
+                    index[count].key = librarykey(buffer);
+                    index[count].offset = offset;
+                }
+                count++;
+            }
+            depth++;
+        } else if (c == ')' && depth > 0) depth--;
+        c = librarynext();
+    }
+    return count;
+}
+
+/*
+    libraryindex - builds the index of the definitions in the Lisp Library the first time it's needed
 */
-object* fn_pprint(object* args, object* env) {
-    (void)env;
-    object* obj = first(args);
-    pfun_t pfun = pstreamfun(cdr(args));
-#if defined(gfxsupport)
-    if (pfun == gfxwrite) ppwidth = GFXPPWIDTH;
-#endif
-    pln(pfun);
-    superprint(obj, 0, pfun);
-    ppwidth = PPWIDTH;
-    return bsymbol(NOTHING);
+void libraryindex() {
+    if (LibraryEntries >= 0) return;
+    int count = scanlibrary(NULL);
+    LibraryIndex = (libraryentry_t*)calloc(count + 1, sizeof(libraryentry_t));
+    if (LibraryIndex == NULL) error2("no room for library index");
+    LibraryEntries = scanlibrary(LibraryIndex);
 }
 
 /*
-    (pprintall [str])
-    Pretty-prints the definition of every function and variable defined in the uLisp workspace.
-    If str is specified it prints to the specified stream. It returns no value.
+    definesp - returns true if line is a defun or defvar form defining the symbol arg
 */
-object* fn_pprintall(object* args, object* env) {
-    (void)env;
-    pfun_t pfun = pstreamfun(args);
-#if defined(gfxsupport)
-    if (pfun == gfxwrite) ppwidth = GFXPPWIDTH;
-#endif
-    object* globals = GlobalEnv;
-    while (globals != NULL) {
-        object* pair = first(globals);
-        object* var = car(pair);
-        object* val = cdr(pair);
-        pln(pfun);
-        if (consp(val) && symbolp(car(val)) && builtin(car(val)->name) == LAMBDA) {
-            superprint(cons(bsymbol(DEFUN), cons(var, cdr(val))), 0, pfun);
-        } else {
-            superprint(cons(bsymbol(DEFVAR), cons(var, cons(quoteit(QUOTE, val), NULL))), 0, pfun);
-        }
-        pln(pfun);
-        testescape();
-        globals = cdr(globals);
-    }
-    ppwidth = PPWIDTH;
-    return bsymbol(NOTHING);
+bool definesp(object* line, object* arg) {
+    if (!consp(line) || !symbolp(first(line)) || !consp(cdr(line))) return false;
+    symbol_t fname = first(line)->name;
+    return (fname == sym(DEFUN) || fname == sym(DEFVAR)) && symbolp(second(line)) && second(line)->name == arg->name;
 }
 
-// Format
-
 /*
-    (format output controlstring [arguments]*)
-    Outputs its arguments formatted according to the format directives in controlstring.
+    librarydefinition - returns the defun or defvar form in the Lisp Library that defines the symbol arg, or NULL
+    Reads only the forms in the index whose key matches, rather than the whole library.
 */
-object* fn_format(object* args, object* env) {
-    (void)env;
-    pfun_t pfun = pserial;
-    object* output = first(args);
-    object* obj;
-    if (output == nil) {
-        obj = startstring();
-        pfun = pstr;
-    } else if (output != tee) pfun = pstreamfun(args);
-    object* formatstr = checkstring(second(args));
-    object* save = NULL;
-    args = cddr(args);
-    int len = stringlength(formatstr);
-    uint8_t n = 0, width = 0, w, bra = 0;
-    char pad = ' ';
-    bool tilde = false, mute = false, comma = false, quote = false;
-    while (n < len) {
-        char ch = nthchar(formatstr, n);
-        char ch2 = ch & ~0x20;  // force to upper case
-        if (tilde) {
-            if (ch == '}') {
-                if (save == NULL) formaterr(formatstr, "no matching ~{", n);
-                if (args == NULL) {
-                    args = cdr(save);
-                    save = NULL;
-                } else n = bra;
-                mute = false;
-                tilde = false;
-            } else if (!mute) {
-                if (comma && quote) {
-                    pad = ch;
-                    comma = false, quote = false;
-                } else if (ch == '\'') {
-                    if (comma) quote = true;
-                    else formaterr(formatstr, "quote not valid", n);
-                } else if (ch == '~') {
-                    pfun('~');
-                    tilde = false;
-                } else if (ch >= '0' && ch <= '9') width = width * 10 + ch - '0';
-                else if (ch == ',') comma = true;
-                else if (ch == '%') {
-                    pln(pfun);
-                    tilde = false;
-                } else if (ch == '&') {
-                    pfl(pfun);
-                    tilde = false;
-                } else if (ch == '^') {
-                    if (save != NULL && args == NULL) mute = true;
-                    tilde = false;
-                } else if (ch == '{') {
-                    if (save != NULL) formaterr(formatstr, "can't nest ~{", n);
-                    if (args == NULL) formaterr(formatstr, noargument, n);
-                    if (!listp(first(args))) formaterr(formatstr, notalist, n);
-                    save = args;
-                    args = first(args);
-                    bra = n;
-                    tilde = false;
-                    if (args == NULL) mute = true;
-                } else if (ch2 == 'A' || ch2 == 'S' || ch2 == 'D' || ch2 == 'G' || ch2 == 'X' || ch2 == 'B') {
-                    if (args == NULL) formaterr(formatstr, noargument, n);
-                    object* arg = first(args);
-                    args = cdr(args);
-                    uint8_t aw = atomwidth(arg);
-                    if (width < aw) w = 0;
-                    else w = width - aw;
-                    tilde = false;
-                    if (ch2 == 'A') {
-                        prin1object(arg, pfun);
-                        indent(w, pad, pfun);
-                    } else if (ch2 == 'S') {
-                        printobject(arg, pfun);
-                        indent(w, pad, pfun);
-                    } else if (ch2 == 'D' || ch2 == 'G') {
-                        indent(w, pad, pfun);
-                        prin1object(arg, pfun);
-                    } else if (ch2 == 'X' || ch2 == 'B') {
-                        if (integerp(arg)) {
-                            uint8_t base = (ch2 == 'B') ? 2 : 16;
-                            uint8_t hw = basewidth(arg, base);
-                            if (width < hw) w = 0;
-                            else w = width - hw;
-                            indent(w, pad, pfun);
-                            pintbase(arg->integer, base, pfun);
-                        } else {
-                            indent(w, pad, pfun);
-                            prin1object(arg, pfun);
-                        }
-                    }
-                    tilde = false;
-                } else formaterr(formatstr, "invalid directive", n);
+object* librarydefinition(object* arg) {
+    if (romlibraryp()) {
+        startlibrary();
+        for (object* line = nextlibraryform(); line != NULL; line = nextlibraryform()) {
+            if (definesp(line, arg)) return line;
+        }
+        return NULL;
+    }
+    libraryindex();
+    uint32_t key = arg->name;
+    if (longsymbolp(arg)) {
+        key = 2166136261u;
+        for (object* chunk = cdr(arg); chunk != NULL; chunk = car(chunk)) {
+            for (int shift = 24; shift >= 0; shift = shift - 8) {
+                uint8_t ch = chunk->chars >> shift & 0xFF;
+                if (ch) key = (key ^ ch) * 16777619u;
             }
-        } else {
-            if (ch == '~') {
-                tilde = true;
-                pad = ' ';
-                width = 0;
-                comma = false;
-                quote = false;
-            } else if (!mute) pfun(ch);
         }
-        n++;
+        key = key & ~3;
     }
-    if (output == nil) return obj;
-    else return nil;
+    for (int i = 0; i < LibraryEntries; i++) {
+        if (LibraryIndex[i].key != key) continue;
+        libraryseek(LibraryIndex[i].offset);
+        LastChar = 0;
+        object* line = read(glibrary);
+        if (definesp(line, arg)) return line;
+    }
+    return NULL;
 }
 
-// LispLibrary
-
 /*
     (require 'symbol)
     Loads the definition of a function defined with defun, or a variable defined with defvar, from the Lisp Library.
@@ -5572,18 +9371,12 @@ object* fn_require(object* args, object* env) {
         if (symbolp(var) && var == arg) return nil;
         globals = cdr(globals);
     }
-    GlobalStringIndex = 0;
-    object* line = read(glibrary);
-    while (line != NULL) {
-        // Is this the definition we want
-        symbol_t fname = first(line)->name;
-        if ((fname == sym(DEFUN) || fname == sym(DEFVAR)) && symbolp(second(line)) && second(line)->name == arg->name) {
-            eval(line, env);
-            return tee;
-        }
-        line = read(glibrary);
-    }
-    return nil;
+    object* line = librarydefinition(arg);
+    if (line == NULL) return nil;
+    protect(line);
+    eval(line, env);
+    unprotect();
+    return tee;
 }
 
 /*
@@ -5592,15 +9385,27 @@ object* fn_require(object* args, object* env) {
 */
 object* fn_listlibrary(object* args, object* env) {
     (void)args, (void)env;
-    GlobalStringIndex = 0;
-    object* line = read(glibrary);
+    if (!romlibraryp()) {
+        libraryindex();
+        char buffer[BUFFERSIZE];
+        for (int i = 0; i < LibraryEntries; i++) {
+            libraryseek(LibraryIndex[i].offset + 1);
+            libraryname(buffer);
+            if (longnamep(LibraryIndex[i].key)) pfstring(buffer, pserial);
+            else psymbol(LibraryIndex[i].key, pserial);
+            pserial(' ');
+        }
+        return bsymbol(NOTHING);
+    }
+    startlibrary();
+    object* line = nextlibraryform();
     while (line != NULL) {
         builtin_t bname = builtin(first(line)->name);
         if (bname == DEFUN || bname == DEFVAR) {
             printsymbol(second(line), pserial);
             pserial(' ');
         }
-        line = read(glibrary);
+        line = nextlibraryform();
     }
     return bsymbol(NOTHING);
 }
@@ -5660,6 +9465,9 @@ object* fn_aproposlist(object* args, object* env) {
 object* sp_unwindprotect(object* args, object* env) {
     if (args == NULL) error2(toofewargs);
     object* current_GCStack = GCStack;
+    int current_ArgTop = ArgTop;
+    int current_EvalTop = EvalTop;
+    int current_StringStreamTop = StringStreamTop;
     jmp_buf dynamic_handler;
     jmp_buf* previous_handler = handler;
     handler = &dynamic_handler;
@@ -5671,6 +9479,9 @@ object* sp_unwindprotect(object* args, object* env) {
         result = eval(protected_form, env);
     } else {
         GCStack = current_GCStack;
+        ArgTop = current_ArgTop;
+        EvalTop = current_EvalTop;
+        StringStreamTop = current_StringStreamTop;
         signaled = true;
     }
     handler = previous_handler;
@@ -5693,6 +9504,9 @@ object* sp_unwindprotect(object* args, object* env) {
 */
 object* sp_ignoreerrors(object* args, object* env) {
     object* current_GCStack = GCStack;
+    int current_ArgTop = ArgTop;
+    int current_EvalTop = EvalTop;
+    int current_StringStreamTop = StringStreamTop;
     jmp_buf dynamic_handler;
     jmp_buf* previous_handler = handler;
     handler = &dynamic_handler;
@@ -5709,6 +9523,9 @@ object* sp_ignoreerrors(object* args, object* env) {
         }
     } else {
         GCStack = current_GCStack;
+        ArgTop = current_ArgTop;
+        EvalTop = current_EvalTop;
+        StringStreamTop = current_StringStreamTop;
         signaled = true;
     }
     handler = previous_handler;
@@ -5748,6 +9565,7 @@ object* sp_withclient(object* args, object* env) {
     char buffer[BUFFERSIZE];
     params = cdr(params);
     int n;
+    flushoutput();  // Before client changes, and as connecting can take a while
     if (params == NULL) {
         client = server.available();
         if (!client) return nil;
@@ -5766,6 +9584,7 @@ object* sp_withclient(object* args, object* env) {
     push(pair, env);
     object* forms = cdr(args);
     object* result = progn_no_tc(forms, env);
+    flushoutput();
     client.stop();
     return result;
 }
@@ -5847,6 +9666,7 @@ object* fn_wificonnect(object* args, object* env) {
         WiFi.disconnect(true);
         return nil;
     }
+    flushoutput();
     if (cdr(args) == NULL) WiFi.begin(cstring(first(args), ssid, 33));
     else WiFi.begin(cstring(first(args), ssid, 33), cstring(second(args), pass, 65));
     int result = WiFi.waitForConnectResult();
@@ -6223,6 +10043,9 @@ object* fn_invertdisplay(object* args, object* env) {
 */
 object* sp_catch(object* args, object* env) {
     object* current_GCStack = GCStack;
+    int current_ArgTop = ArgTop;
+    int current_EvalTop = EvalTop;
+    int current_StringStreamTop = StringStreamTop;
 
     jmp_buf dynamic_handler;
     jmp_buf* previous_handler = handler;
@@ -6252,6 +10075,9 @@ object* sp_catch(object* args, object* env) {
     } else {
         // Something was thrown, check if it is the same tag
         GCStack = current_GCStack;
+        ArgTop = current_ArgTop;
+        EvalTop = current_EvalTop;
+        StringStreamTop = current_StringStreamTop;
         handler = previous_handler;
         Flags = temp;
         if (Thrown == NULL) {
@@ -6376,38 +10202,361 @@ CHECK:
     return isbuiltin(first(lambda), MACRO);
 }
 
-object* macroexpand1(object* form, object* env, bool* done) {
-    if (!is_macro_call(form, env)) {
-        *done = true;
-        return form;
-    }
-    while (symbolp(car(form))) form = cons(cdr(findvalue(car(form), env)), cdr(form));
-    protect(form);
-    form = closure(false, sym(NIL), car(form), cdr(form), &env);
-    clrflag(TAILCALL);
-    object* result = eval(form, env);
-    unprotect();
-    return result;
+object* macroexpand1(object* form, object* env, bool* done) {
+    if (!is_macro_call(form, env)) {
+        *done = true;
+        return form;
+    }
+    while (symbolp(car(form))) form = cons(cdr(findvalue(car(form), env)), cdr(form));
+    protect(form);
+    form = closure(false, sym(NIL), car(form), cdr(form), &env);
+    clrflag(TAILCALL);
+    object* result = eval(form, env);
+    unprotect();
+    return result;
+}
+
+object* fn_macroexpand1(object* args, object* env) {
+    bool dummy;
+    return macroexpand1(first(args), env, &dummy);
+}
+
+object* macroexpand(object* form, object* env) {
+    bool done = false;
+    protect(form);
+    while (!done) {
+        form = macroexpand1(form, env, &done);
+        car(GCStack) = form;
+    }
+    unprotect();
+    return form;
+}
+
+object* fn_macroexpand(object* args, object* env) {
+    return macroexpand(first(args), env);
+}
+
+// Hash tables
+
+/*
+    (make-hash-table [:test function])
+    Returns a new empty hash table. The test can be eq, eql, or equal, and defaults to eq.
+*/
+object* fn_makehashtable(object* args, object* env) {
+    (void)env;
+    object* test = testargument(args);
+    int kind = HASHEQ;
+    if ((symbolp(test) || bfunctionp(test)) && builtinp(test->name)) {
+        fn_ptr_type fn = lookupfn(builtin(test->name));
+        if (fn == fn_equal) kind = HASHEQUAL;
+        else if (fn != fn_eq) error("unsupported test", test);
+    } else error("unsupported test", test);
+    return makehashtable(kind);
+}
+
+/*
+    (gethash key hash-table [default])
+    Returns the value associated with key in the hash table, or default (or nil) if the key isn't present.
+*/
+object* fn_gethash(object* args, object* env) {
+    (void)env;
+    object* pair = hashfind(checkhashtable(second(args)), first(args));
+    if (pair != NULL) return cdr(pair);
+    return (cddr(args) != NULL) ? third(args) : nil;
+}
+
+/*
+    (remhash key hash-table)
+    Removes the entry for key from the hash table, and returns t if it was present or nil otherwise.
+*/
+object* fn_remhash(object* args, object* env) {
+    (void)env;
+    return hashremove(checkhashtable(second(args)), first(args)) ? tee : nil;
+}
+
+/*
+    (maphash function hash-table)
+    Calls the function with the key and value of each entry in the hash table, and returns nil.
+    The function may change the value of the current entry, or remove it, but mustn't add entries.
+*/
+object* fn_maphash(object* args, object* env) {
+    object* function = first(args);
+    object* table = checkhashtable(second(args));
+    while (hasholdbuckets(table) != NULL) rehashstep(table);
+    object* buckets = hashbuckets(table);
+    protect(buckets);
+    int size = hashsize(buckets);
+    for (int i = 0; i < size; i++) {
+        object* list = *arrayref(buckets, i, size);
+        while (list != NULL) {
+            object* pair = car(list);
+            list = cdr(list);
+            apply(function, cons(car(pair), cons(cdr(pair), NULL)), env);
+        }
+    }
+    unprotect();
+    return nil;
+}
+
+/*
+    (clrhash hash-table)
+    Removes all the entries from the hash table, and returns it.
+*/
+object* fn_clrhash(object* args, object* env) {
+    (void)env;
+    object* table = checkhashtable(first(args));
+    object* buckets = car(hashinfo(table));
+    car(buckets) = makebuckets(HASHSIZE);
+    cdr(buckets) = nil;
+    hashinfo(table)->integer = hashtest(table);
+    hashcount(table) = 0;
+    return table;
+}
+
+/*
+    (hash-table-count hash-table)
+    Returns the number of entries in the hash table.
+*/
+object* fn_hashtablecount(object* args, object* env) {
+    (void)env;
+    return number(hashcount(checkhashtable(first(args))));
+}
+
+/*
+    (sxhash object)
+    Returns a non-negative integer hash code for the object, which is the same for objects that are equal.
+*/
+object* fn_sxhash(object* args, object* env) {
+    (void)env;
+    return number(hashobject(first(args), HASHEQUAL, 4) & INT_MAX);
+}
+
+// Argument vector entry points
+
+/*
+    These are called by eval() with the evaluated arguments in a vector on ArgStack,
+    so a call such as (car x) or (+ a 1) doesn't need to cons an argument list.
+    Anything outside the common case falls back on the list entry point.
+    They mustn't call eval(), which may move ArgStack.
+*/
+
+/*
+    argvlist - conses up the argument vector as a list, for falling back on the list entry point
+*/
+object* argvlist(object** argv, int nargs) {
+    object* list = nil;
+    while (nargs > 0) push(argv[--nargs], list);
+    return list;
+}
+
+/*
+    comparev - compares integer arguments in argv, otherwise falls back on compare()
+*/
+object* comparev(object** argv, int nargs, bool lt, bool gt, bool eq) {
+    for (int i = 0; i < nargs; i++) {
+        if (!integerp(argv[i])) return compare(argvlist(argv, nargs), lt, gt, eq);
+    }
+    for (int i = 1; i < nargs; i++) {
+        int arg1 = argv[i - 1]->integer, arg2 = argv[i]->integer;
+        if (!lt && (arg1 < arg2)) return nil;
+        if (!eq && (arg1 == arg2)) return nil;
+        if (!gt && (arg1 > arg2)) return nil;
+    }
+    return tee;
+}
+
+object* av_not(object** argv, int nargs, object* env) {
+    (void)nargs;
+    (void)env;
+    return (argv[0] == nil) ? tee : nil;
+}
+
+object* av_cons(object** argv, int nargs, object* env) {
+    (void)nargs;
+    (void)env;
+    return cons(argv[0], argv[1]);
+}
+
+object* av_atom(object** argv, int nargs, object* env) {
+    (void)nargs;
+    (void)env;
+    return atom(argv[0]) ? tee : nil;
+}
+
+object* av_listp(object** argv, int nargs, object* env) {
+    (void)nargs;
+    (void)env;
+    return listp(argv[0]) ? tee : nil;
+}
+
+object* av_consp(object** argv, int nargs, object* env) {
+    (void)nargs;
+    (void)env;
+    return consp(argv[0]) ? tee : nil;
+}
+
+object* av_eq(object** argv, int nargs, object* env) {
+    (void)nargs;
+    (void)env;
+    return eq(argv[0], argv[1]) ? tee : nil;
+}
+
+object* av_equal(object** argv, int nargs, object* env) {
+    (void)nargs;
+    (void)env;
+    return equal(argv[0], argv[1]) ? tee : nil;
+}
+
+object* av_car(object** argv, int nargs, object* env) {
+    (void)nargs;
+    (void)env;
+    return carx(argv[0]);
+}
+
+object* av_cdr(object** argv, int nargs, object* env) {
+    (void)nargs;
+    (void)env;
+    return cdrx(argv[0]);
+}
+
+object* av_cadr(object** argv, int nargs, object* env) {
+    (void)nargs;
+    (void)env;
+    return carx(cdrx(argv[0]));
+}
+
+object* av_cddr(object** argv, int nargs, object* env) {
+    (void)nargs;
+    (void)env;
+    return cdrx(cdrx(argv[0]));
+}
+
+object* av_caddr(object** argv, int nargs, object* env) {
+    (void)nargs;
+    (void)env;
+    return carx(cdrx(cdrx(argv[0])));
+}
+
+object* av_nth(object** argv, int nargs, object* env) {
+    (void)nargs;
+    (void)env;
+    int n = checkinteger(argv[0]);
+    if (n < 0) error(indexnegative, argv[0]);
+    object* list = argv[1];
+    while (list != NULL) {
+        if (improperp(list)) error(notproper, list);
+        if (n == 0) return car(list);
+        list = cdr(list);
+        n--;
+    }
+    return nil;
+}
+
+object* av_add(object** argv, int nargs, object* env) {
+    int result = 0;
+    if (nargs == 2 && integerp(argv[0]) && integerp(argv[1])) {  // Common case
+        if (!__builtin_add_overflow(argv[0]->integer, argv[1]->integer, &result)) return number(result);
+        return bignumadd(argv[0], argv[1], false);
+    }
+    for (int i = 0; i < nargs; i++) {
+        object* arg = argv[i];
+        if (!integerp(arg) || __builtin_add_overflow(result, arg->integer, &result)) return fn_add(argvlist(argv, nargs), env);
+    }
+    return number(result);
+}
+
+object* av_subtract(object** argv, int nargs, object* env) {
+    if (nargs == 1) return negate(argv[0]);
+    int result;
+    if (nargs == 2 && integerp(argv[0]) && integerp(argv[1])) {  // Common case
+        if (!__builtin_sub_overflow(argv[0]->integer, argv[1]->integer, &result)) return number(result);
+        return bignumadd(argv[0], argv[1], true);
+    }
+    if (!integerp(argv[0])) return fn_subtract(argvlist(argv, nargs), env);
+    result = argv[0]->integer;
+    for (int i = 1; i < nargs; i++) {
+        object* arg = argv[i];
+        if (!integerp(arg) || __builtin_sub_overflow(result, arg->integer, &result)) return fn_subtract(argvlist(argv, nargs), env);
+    }
+    return number(result);
+}
+
+object* av_multiply(object** argv, int nargs, object* env) {
+    int result = 1;
+    if (nargs == 2 && integerp(argv[0]) && integerp(argv[1])) {  // Common case
+        if (!__builtin_mul_overflow(argv[0]->integer, argv[1]->integer, &result)) return number(result);
+        return bignummultiply(argv[0], argv[1]);
+    }
+    for (int i = 0; i < nargs; i++) {
+        object* arg = argv[i];
+        if (!integerp(arg) || __builtin_mul_overflow(result, arg->integer, &result)) return fn_multiply(argvlist(argv, nargs), env);
+    }
+    return number(result);
+}
+
+object* av_mod(object** argv, int nargs, object* env) {
+    if (!(integerp(argv[0]) && integerp(argv[1]))) return fn_mod(argvlist(argv, nargs), env);
+    int divisor = argv[1]->integer;
+    if (divisor == 0) error2("division by zero");
+    int dividend = argv[0]->integer;
+    int remainder = dividend % divisor;
+    if ((dividend < 0) != (divisor < 0)) remainder = remainder + divisor;
+    return number(remainder);
+}
+
+object* av_oneplus(object** argv, int nargs, object* env) {
+    object* arg = argv[0];
+    if (integerp(arg) && arg->integer != INT_MAX) return number(arg->integer + 1);
+    return fn_oneplus(argvlist(argv, nargs), env);
+}
+
+object* av_oneminus(object** argv, int nargs, object* env) {
+    object* arg = argv[0];
+    if (integerp(arg) && arg->integer != INT_MIN) return number(arg->integer - 1);
+    return fn_oneminus(argvlist(argv, nargs), env);
+}
+
+object* av_numeq(object** argv, int nargs, object* env) {
+    (void)env;
+    return comparev(argv, nargs, false, false, true);
+}
+
+object* av_less(object** argv, int nargs, object* env) {
+    (void)env;
+    return comparev(argv, nargs, true, false, false);
+}
+
+object* av_lesseq(object** argv, int nargs, object* env) {
+    (void)env;
+    return comparev(argv, nargs, true, false, true);
+}
+
+object* av_greater(object** argv, int nargs, object* env) {
+    (void)env;
+    return comparev(argv, nargs, false, true, false);
+}
+
+object* av_greatereq(object** argv, int nargs, object* env) {
+    (void)env;
+    return comparev(argv, nargs, false, true, true);
 }
 
-object* fn_macroexpand1(object* args, object* env) {
-    bool dummy;
-    return macroexpand1(first(args), env, &dummy);
+object* av_zerop(object** argv, int nargs, object* env) {
+    object* arg = argv[0];
+    if (integerp(arg)) return (arg->integer == 0) ? tee : nil;
+    return fn_zerop(argvlist(argv, nargs), env);
 }
 
-object* macroexpand(object* form, object* env) {
-    bool done = false;
-    protect(form);
-    while (!done) {
-        form = macroexpand1(form, env, &done);
-        car(GCStack) = form;
-    }
-    unprotect();
-    return form;
+object* av_plusp(object** argv, int nargs, object* env) {
+    object* arg = argv[0];
+    if (integerp(arg)) return (arg->integer > 0) ? tee : nil;
+    return fn_plusp(argvlist(argv, nargs), env);
 }
 
-object* fn_macroexpand(object* args, object* env) {
-    return macroexpand(first(args), env);
+object* av_minusp(object** argv, int nargs, object* env) {
+    object* arg = argv[0];
+    if (integerp(arg)) return (arg->integer < 0) ? tee : nil;
+    return fn_minusp(argvlist(argv, nargs), env);
 }
 
 ///////////////////////////////////////////////////////////
@@ -6667,6 +10816,41 @@ const char stringcatch[] = "catch";
 const char stringthrow[] = "throw";
 const char stringmacroexpand1[] = "macroexpand-1";
 const char stringmacroexpand[] = "macroexpand";
+const char stringgethash[] = "gethash";
+const char stringkey[] = ":key";
+const char stringstart[] = ":start";
+const char stringend[] = ":end";
+const char stringmakehashtable[] = "make-hash-table";
+const char stringremhash[] = "remhash";
+const char stringmaphash[] = "maphash";
+const char stringclrhash[] = "clrhash";
+const char stringhashtablecount[] = "hash-table-count";
+const char stringsxhash[] = "sxhash";
+const char stringeql[] = "eql";
+const char stringwithinputfromstring[] = "with-input-from-string";
+const char stringreadsequence[] = "read-sequence";
+const char stringwritesequence[] = "write-sequence";
+const char stringfilelength[] = "file-length";
+const char stringwithflashfile[] = "with-flash-file";
+const char stringdirectory[] = "directory";
+const char stringdeletefile[] = "delete-file";
+const char stringrenamefile[] = "rename-file";
+const char stringfileposition[] = "file-position";
+const char stringreadrecord[] = "read-record";
+const char stringwriterecord[] = "write-record";
+const char stringsaveimage[] = "save-image";
+const char stringloadimage[] = "load-image";
+const char stringcompilefile[] = "compile-file";
+const char stringloadcompiled[] = "load-compiled";
+const char stringreload[] = "reload";
+const char stringwriteobject[] = "write-object";
+const char stringreadobject[] = "read-object";
+const char stringkvopen[] = "kv-open";
+const char stringkvput[] = "kv-put";
+const char stringkvget[] = "kv-get";
+const char stringkvdelete[] = "kv-delete";
+const char stringkvcompact[] = "kv-compact";
+const char stringserialraw[] = "serial-raw";
 
 // Documentation strings
 const char doc0[] = "nil\n"
@@ -6740,7 +10924,8 @@ const char doc26[] = "(register address [value])\n"
                      "If value is not specified the function returns the value of the register at address.\n"
                      "If value is specified the value is written to the register at address and the function returns value.";
 const char doc27[] = "(format output controlstring [arguments]*)\n"
-                     "Outputs its arguments formatted according to the format directives in controlstring.";
+                     "Outputs its arguments formatted according to the format directives in controlstring.\n"
+                     "~w,dF and ~w,dE print a number in fixed or exponential notation with d digits after the point.";
 const char doc28[] = "(or item*)\n"
                      "Evaluates its arguments until one returns non-nil, and returns its value.";
 const char doc29[] = "(setq symbol value [symbol value]*)\n"
@@ -6803,7 +10988,8 @@ const char doc46[] = "(with-spi (str pin [clock] [bitorder] [mode]) form*)\n"
                      "bitorder 0 for LSBFIRST and 1 for MSBFIRST (default 1), and SPI mode (default 0).";
 const char doc47[] = "(with-sd-card (str filename [mode]) form*)\n"
                      "Evaluates the forms with str bound to an sd-stream reading from or writing to the file filename.\n"
-                     "If mode is omitted the file is read, otherwise 0 means read, 1 write-append, or 2 write-overwrite.";
+                     "If mode is omitted the file is read, otherwise 0 means read, 1 write-append, 2 write-overwrite,\n"
+                     "or 3 update, which keeps the contents so that records can be read and rewritten with file-position.";
 const char doc48[] = "(progn form*)\n"
                      "Evaluates several forms grouped together into a block, and returns the result of evaluating the last form.";
 const char doc49[] = "(if test then [else])\n"
@@ -6913,16 +11099,16 @@ const char docmapcon[] = "(mapcon function list1 [list]*)\n"
                          "and these are destructively concatenated together to give the value returned.";
 const char doc96[] = "(+ number*)\n"
                      "Adds its arguments together.\n"
-                     "If each argument is an integer, and the running total doesn't overflow, the result is an integer,\n"
+                     "If each argument is an integer the result is an integer, promoted to a bignum if it overflows,\n"
                      "otherwise a floating-point number.";
 const char doc97[] = "(- number*)\n"
                      "If there is one argument, negates the argument.\n"
                      "If there are two or more arguments, subtracts the second and subsequent arguments from the first argument.\n"
-                     "If each argument is an integer, and the running total doesn't overflow, returns the result as an integer,\n"
+                     "If each argument is an integer the result is an integer, promoted to a bignum if it overflows,\n"
                      "otherwise a floating-point number.";
 const char doc98[] = "(* number*)\n"
                      "Multiplies its arguments together.\n"
-                     "If each argument is an integer, and the running total doesn't overflow, the result is an integer,\n"
+                     "If each argument is an integer the result is an integer, promoted to a bignum if it overflows,\n"
                      "otherwise it's a floating-point number.";
 const char doc99[] = "(/ number*)\n"
                      "Divides the first argument by the second and subsequent arguments.\n"
@@ -6933,15 +11119,15 @@ const char doc100[] = "(mod number number)\n"
                       "If both arguments are integers the result is an integer; otherwise it's a floating-point number.";
 const char doc101[] = "(1+ number)\n"
                       "Adds one to its argument and returns it.\n"
-                      "If the argument is an integer the result is an integer if possible;\n"
+                      "If the argument is an integer the result is an integer, promoted to a bignum if it overflows;\n"
                       "otherwise it's a floating-point number.";
 const char doc102[] = "(1- number)\n"
                       "Subtracts one from its argument and returns it.\n"
-                      "If the argument is an integer the result is an integer if possible;\n"
+                      "If the argument is an integer the result is an integer, promoted to a bignum if it overflows;\n"
                       "otherwise it's a floating-point number.";
 const char doc103[] = "(abs number)\n"
                       "Returns the absolute, positive value of its argument.\n"
-                      "If the argument is an integer the result will be returned as an integer if possible,\n"
+                      "If the argument is an integer the result will be returned as an integer, promoted to a bignum if necessary,\n"
                       "otherwise a floating-point number.";
 const char doc104[] = "(random number)\n"
                       "If number is an integer returns a random number between 0 and one less than its argument.\n"
@@ -7042,15 +11228,17 @@ const char docstringlteq[] = "(string<= string string)\n"
 const char docstringgteq[] = "(string>= string string)\n"
                              "Returns the index to the first mismatch if the first string is alphabetically greater than or equal to\n"
                              "the second string, or nil otherwise.";
-const char doc147[] = "(sort list test)\n"
-                      "Destructively sorts list according to the test function, using an insertion sort, and returns the sorted list.";
+const char doc147[] = "(sort sequence test [:key function])\n"
+                      "Destructively sorts a list or vector according to the test function, and returns the sorted sequence.\n"
+                      "Lists are sorted with a stable merge sort; vectors are sorted in place.";
 const char doc148[] = "(concatenate 'string string*)\n"
                       "Joins together the strings given in the second and subsequent arguments, and returns a single string.";
 const char doc149[] = "(subseq seq start [end])\n"
                       "Returns a subsequence of a list or string from item start to item end-1.";
-const char doc150[] = "(search pattern target [:test function])\n"
+const char doc150[] = "(search pattern target [:test function] [:start n] [:end m])\n"
                       "Returns the index of the first occurrence of pattern in target, or nil if it's not found.\n"
-                      "The target can be a list or string. If it's a list a test function can be specified; default eq.";
+                      "The target can be a list or string. If it's a list a test function can be specified; default eq.\n"
+                      "Only the part of target from :start up to :end is searched, but the index is counted from the beginning.";
 const char doc151[] = "(read-from-string string)\n"
                       "Reads an atom or list from the specified string and returns it.";
 const char doc152[] = "(princ-to-string item)\n"
@@ -7245,6 +11433,97 @@ const char docmacroexpand1[] = "(macroexpand-1 'form)\n"
 const char docmacroexpand[] = "(macroexpand 'form)\n"
                               "Repeatedly applies (macroexpand-1) until the form no longer represents a call to a macro,\n"
                               "then returns the new form.";
+const char docgethash[] = "(gethash key hash-table [default])\n"
+                          "Returns the value associated with key in the hash table, or default (or nil) if the key isn't present.\n"
+                          "Use setf to add or change an entry.";
+const char docmakehashtable[] = "(make-hash-table [:test function])\n"
+                                "Returns a new empty hash table. The test can be eq, eql, or equal, and defaults to eq.";
+const char docremhash[] = "(remhash key hash-table)\n"
+                          "Removes the entry for key from the hash table, and returns t if it was present or nil otherwise.";
+const char docmaphash[] = "(maphash function hash-table)\n"
+                          "Calls the function with the key and value of each entry in the hash table, and returns nil.\n"
+                          "The function may change the value of the current entry, or remove it, but mustn't add entries.";
+const char docclrhash[] = "(clrhash hash-table)\n"
+                          "Removes all the entries from the hash table, and returns it.";
+const char dochashtablecount[] = "(hash-table-count hash-table)\n"
+                                 "Returns the number of entries in the hash table.";
+const char docsxhash[] = "(sxhash object)\n"
+                         "Returns a non-negative integer hash code for the object, which is the same for objects that are equal.";
+const char doceql[] = "(eql item item)\n"
+                      "Tests whether the two arguments are the same object, or numbers or characters with the same value.";
+const char docwithinputfromstring[] = "(with-input-from-string (str string) form*)\n"
+                                      "Evaluates the forms with str bound to a string-stream that reads from string.\n"
+                                      "Each stream keeps its own position, so the forms can be nested.";
+const char docreadsequence[] = "(read-sequence sequence stream [:start n] [:end m])\n"
+                               "Reads bytes from stream into a string or vector, replacing the elements from start up to end.\n"
+                               "Returns the index of the first element not replaced, which is less than end if the stream ran out.\n"
+                               "A zero byte can't be read into a string.";
+const char docwritesequence[] = "(write-sequence sequence stream [:start n] [:end m])\n"
+                                "Writes the characters of a string, or the bytes in a vector of integers, from start up to end to stream.\n"
+                                "Returns the sequence.";
+const char docfilelength[] = "(file-length stream)\n"
+                             "Returns the length in bytes of the file open on an sd-stream or flash-stream, or nil for other streams.";
+const char docwithflashfile[] = "(with-flash-file (str filename [mode]) form*)\n"
+                                "Evaluates the forms with str bound to a flash-stream reading from or writing to the file filename\n"
+                                "in the LittleFS filesystem in flash. Mode is as for with-sd-card.";
+const char docdirectory[] = "(directory [dirname])\n"
+                            "Returns a list of the names of the files in a directory in flash, default the root directory.\n"
+                            "The names of subdirectories end in a slash.";
+const char docdeletefile[] = "(delete-file filename)\n"
+                             "Deletes a file in flash. Returns t if it was deleted, or nil if it couldn't be.";
+const char docrenamefile[] = "(rename-file filename newname)\n"
+                             "Renames a file in flash. Returns t if it was renamed, or nil if it couldn't be.";
+const char docfileposition[] = "(file-position stream [position])\n"
+                               "Returns the position of the next byte to be read or written on an sd-stream or flash-stream.\n"
+                               "If position is given, moves to that byte of the file and returns t, or nil if it couldn't.";
+const char docreadrecord[] = "(read-record stream size index)\n"
+                             "Reads record number index, of size bytes, from a file stream and returns it as a vector of bytes,\n"
+                             "or nil if the file doesn't contain the whole record.";
+const char docwriterecord[] = "(write-record stream size index sequence)\n"
+                              "Writes a string or vector of bytes as record number index, of size bytes, to a file stream.\n"
+                              "The record is padded with zeros or truncated to size. Returns the sequence.";
+const char docsaveimage[] = "(save-image filename [sd])\n"
+                            "Saves the global definitions as an image file in flash, or on the SD card if sd is non-nil,\n"
+                            "and returns the number of cells saved.";
+const char docloadimage[] = "(load-image filename [sd])\n"
+                            "Replaces the workspace with an image saved by save-image, and returns to the REPL.\n"
+                            "Images saved by firmware with different builtins are rejected.";
+const char doccompilefile[] = "(compile-file filename)\n"
+                              "Reads the Lisp source file filename on the SD card and writes its forms, in a binary form that\n"
+                              "loads without the reader, to a file with the extension .fasl. Returns the name of the FASL file.";
+const char docloadcompiled[] = "(load-compiled filename)\n"
+                               "If the FASL file made by compile-file from the source file filename was compiled from the source\n"
+                               "as it is now, evaluates its forms and returns t. Otherwise, or if it was compiled by firmware with\n"
+                               "different builtins, returns nil. The source is taken to be unchanged if its size and time of last\n"
+                               "write are the same.";
+const char docreload[] = "(reload filename)\n"
+                         "Evaluates the forms in the Lisp source file filename on the SD card whose text has changed, or that\n"
+                         "are new, since the file was last reloaded, prints the names of the definitions it skipped, and returns\n"
+                         "the number of forms evaluated. The first time a file is reloaded all its forms are evaluated.";
+const char docwriteobject[] = "(write-object object stream)\n"
+                              "Writes object to stream in a compact binary form that read-object reads back, and returns object.\n"
+                              "Conses, integers, floats, characters, strings, symbols and arrays can be written,\n"
+                              "and shared or circular structure is preserved. The stream can't be a string stream.";
+const char docreadobject[] = "(read-object stream)\n"
+                             "Reads an object written by write-object from stream, and returns it, or nil at the end of the stream.";
+const char dockvopen[] = "(kv-open filename [sd])\n"
+                         "Opens the key-value store in the file filename in flash or, if sd is non-nil, on the SD card,\n"
+                         "creating it if it doesn't exist, and returns the number of keys in it. Until a store is opened\n"
+                         "the other kv- functions use ulisp.kv in flash.";
+const char dockvput[] = "(kv-put key value)\n"
+                        "Sets key to value in the key-value store, and returns value.\n"
+                        "Keys and values can be any objects that write-object can write.";
+const char dockvget[] = "(kv-get key [default])\n"
+                        "Returns the value of key in the key-value store, or default if it has none.";
+const char dockvdelete[] = "(kv-delete key)\n"
+                           "Removes key from the key-value store, and returns t, or nil if it wasn't there.";
+const char dockvcompact[] = "(kv-compact)\n"
+                            "Rewrites the key-value store without the records that later ones have replaced or deleted,\n"
+                            "and returns the number of bytes reclaimed.";
+const char docserialraw[] = "(serial-raw flag)\n"
+                            "Switches raw serial input on if flag is true, or off if it's nil, and returns flag.\n"
+                            "In raw mode read-byte and read-line get each byte from the serial port as it arrives,\n"
+                            "without waiting for a whole line and without echo, and ~ isn't an escape. An error ends raw mode.";
 
 // Built-in symbol lookup table
 const tbl_entry_t BuiltinTable[] = {
@@ -7256,7 +11535,7 @@ const tbl_entry_t BuiltinTable[] = {
     { string4, NULL, MINMAX(OTHER_FORMS, 0, 0), NULL },
     { string5, NULL, MINMAX(OTHER_FORMS, 0, 0), NULL },
     { stringtest, NULL, MINMAX(OTHER_FORMS, 0, 0), NULL },
-    { string67, fn_eq, MINMAX(FUNCTIONS, 2, 2), doc67 },
+    { string67, fn_eq, MINMAX(FUNCTIONS, 2, 2), doc67, av_eq },
     { string6, NULL, MINMAX(OTHER_FORMS, 0, 0), NULL },
     { string7, NULL, MINMAX(OTHER_FORMS, 0, 0), doc7 },
     { string8, NULL, MINMAX(OTHER_FORMS, 1, UNLIMITED), doc8 },
@@ -7269,18 +11548,18 @@ const tbl_entry_t BuiltinTable[] = {
     { stringbackquote, sp_backquote, MINMAX(SPECIAL_FORMS, 1, 1), docbackquote },
     { stringunquote, bq_invalid, MINMAX(SPECIAL_FORMS, 1, 1), docunquote },
     { stringuqsplicing, bq_invalid, MINMAX(SPECIAL_FORMS, 1, 1), docunquotesplicing },
-    { string57, fn_cons, MINMAX(FUNCTIONS, 2, 2), doc57 },
+    { string57, fn_cons, MINMAX(FUNCTIONS, 2, 2), doc57, av_cons },
     { string92, fn_append, MINMAX(FUNCTIONS, 0, UNLIMITED), doc92 },
     { string14, sp_defun, MINMAX(SPECIAL_FORMS, 2, UNLIMITED), doc14 },
     { string36, sp_setf, MINMAX(SPECIAL_FORMS, 2, UNLIMITED), doc36 },
     { string139, fn_char, MINMAX(FUNCTIONS, 2, 2), doc139 },
     { string15, sp_defvar, MINMAX(SPECIAL_FORMS, 1, 3), doc15 },
     { stringdefmacro, sp_defmacro, MINMAX(SPECIAL_FORMS, 2, UNLIMITED), docdefmacro },
-    { string16, fn_car, MINMAX(FUNCTIONS, 1, 1), doc16 },
-    { string17, fn_car, MINMAX(FUNCTIONS, 1, 1), NULL },
-    { string18, fn_cdr, MINMAX(FUNCTIONS, 1, 1), doc18 },
-    { string19, fn_cdr, MINMAX(FUNCTIONS, 1, 1), NULL },
-    { string20, fn_nth, MINMAX(FUNCTIONS, 2, 2), doc20 },
+    { string16, fn_car, MINMAX(FUNCTIONS, 1, 1), doc16, av_car },
+    { string17, fn_car, MINMAX(FUNCTIONS, 1, 1), NULL, av_car },
+    { string18, fn_cdr, MINMAX(FUNCTIONS, 1, 1), doc18, av_cdr },
+    { string19, fn_cdr, MINMAX(FUNCTIONS, 1, 1), NULL, av_cdr },
+    { string20, fn_nth, MINMAX(FUNCTIONS, 2, 2), doc20, av_nth },
     { string21, fn_aref, MINMAX(FUNCTIONS, 2, UNLIMITED), doc21 },
     { string22, fn_stringfn, MINMAX(FUNCTIONS, 1, 1), doc22 },
     { string23, fn_pinmode, MINMAX(FUNCTIONS, 2, 2), doc23 },
@@ -7288,6 +11567,10 @@ const tbl_entry_t BuiltinTable[] = {
     { string25, fn_analogread, MINMAX(FUNCTIONS, 1, 1), doc25 },
     { string26, fn_register, MINMAX(FUNCTIONS, 1, 2), doc26 },
     { string27, fn_format, MINMAX(FUNCTIONS, 2, UNLIMITED), doc27 },
+    { stringgethash, fn_gethash, MINMAX(FUNCTIONS, 2, 3), docgethash },
+    { stringkey, NULL, MINMAX(OTHER_FORMS, 0, 0), NULL },
+    { stringstart, NULL, MINMAX(OTHER_FORMS, 0, 0), NULL },
+    { stringend, NULL, MINMAX(OTHER_FORMS, 0, 0), NULL },
     { string28, sp_or, MINMAX(SPECIAL_FORMS, 0, UNLIMITED), doc28 },
     { string29, sp_setq, MINMAX(SPECIAL_FORMS, 2, UNLIMITED), doc29 },
     { string30, sp_loop, MINMAX(SPECIAL_FORMS, 0, UNLIMITED), doc30 },
@@ -7316,28 +11599,28 @@ const tbl_entry_t BuiltinTable[] = {
     { string52, sp_unless, MINMAX(SPECIAL_FORMS, 1, UNLIMITED), doc52 },
     { string53, sp_case, MINMAX(SPECIAL_FORMS, 1, UNLIMITED), doc53 },
     { string54, sp_and, MINMAX(SPECIAL_FORMS, 0, UNLIMITED), doc54 },
-    { string55, fn_not, MINMAX(FUNCTIONS, 1, 1), doc55 },
-    { string56, fn_not, MINMAX(FUNCTIONS, 1, 1), NULL },
-    { string58, fn_atom, MINMAX(FUNCTIONS, 1, 1), doc58 },
-    { string59, fn_listp, MINMAX(FUNCTIONS, 1, 1), doc59 },
-    { string60, fn_consp, MINMAX(FUNCTIONS, 1, 1), doc60 },
+    { string55, fn_not, MINMAX(FUNCTIONS, 1, 1), doc55, av_not },
+    { string56, fn_not, MINMAX(FUNCTIONS, 1, 1), NULL, av_not },
+    { string58, fn_atom, MINMAX(FUNCTIONS, 1, 1), doc58, av_atom },
+    { string59, fn_listp, MINMAX(FUNCTIONS, 1, 1), doc59, av_listp },
+    { string60, fn_consp, MINMAX(FUNCTIONS, 1, 1), doc60, av_consp },
     { string61, fn_symbolp, MINMAX(FUNCTIONS, 1, 1), doc61 },
     { string62, fn_arrayp, MINMAX(FUNCTIONS, 1, 1), doc62 },
     { string63, fn_boundp, MINMAX(FUNCTIONS, 1, 1), doc63 },
     { string64, fn_keywordp, MINMAX(FUNCTIONS, 1, 1), doc64 },
     { string65, fn_setfn, MINMAX(FUNCTIONS, 2, UNLIMITED), doc65 },
     { string66, fn_streamp, MINMAX(FUNCTIONS, 1, 1), doc66 },
-    { string68, fn_equal, MINMAX(FUNCTIONS, 2, 2), doc68 },
+    { string68, fn_equal, MINMAX(FUNCTIONS, 2, 2), doc68, av_equal },
     { string69, fn_caar, MINMAX(FUNCTIONS, 1, 1), doc69 },
-    { string70, fn_cadr, MINMAX(FUNCTIONS, 1, 1), doc70 },
-    { string71, fn_cadr, MINMAX(FUNCTIONS, 1, 1), NULL },
+    { string70, fn_cadr, MINMAX(FUNCTIONS, 1, 1), doc70, av_cadr },
+    { string71, fn_cadr, MINMAX(FUNCTIONS, 1, 1), NULL, av_cadr },
     { string72, fn_cdar, MINMAX(FUNCTIONS, 1, 1), doc72 },
-    { string73, fn_cddr, MINMAX(FUNCTIONS, 1, 1), doc73 },
+    { string73, fn_cddr, MINMAX(FUNCTIONS, 1, 1), doc73, av_cddr },
     { string74, fn_caaar, MINMAX(FUNCTIONS, 1, 1), doc74 },
     { string75, fn_caadr, MINMAX(FUNCTIONS, 1, 1), doc75 },
     { string76, fn_cadar, MINMAX(FUNCTIONS, 1, 1), doc76 },
-    { string77, fn_caddr, MINMAX(FUNCTIONS, 1, 1), doc77 },
-    { string78, fn_caddr, MINMAX(FUNCTIONS, 1, 1), NULL },
+    { string77, fn_caddr, MINMAX(FUNCTIONS, 1, 1), doc77, av_caddr },
+    { string78, fn_caddr, MINMAX(FUNCTIONS, 1, 1), NULL, av_caddr },
     { string79, fn_cdaar, MINMAX(FUNCTIONS, 1, 1), doc79 },
     { string80, fn_cdadr, MINMAX(FUNCTIONS, 1, 1), doc80 },
     { string81, fn_cddar, MINMAX(FUNCTIONS, 1, 1), doc81 },
@@ -7358,26 +11641,26 @@ const tbl_entry_t BuiltinTable[] = {
     { string95, fn_mapcan, MINMAX(FUNCTIONS, 2, UNLIMITED), doc95 },
     { stringmaplist, fn_maplist, MINMAX(FUNCTIONS, 2, UNLIMITED), docmaplist },
     { stringmapcon, fn_mapcon, MINMAX(FUNCTIONS, 2, UNLIMITED), docmapcon },
-    { string96, fn_add, MINMAX(FUNCTIONS, 0, UNLIMITED), doc96 },
-    { string97, fn_subtract, MINMAX(FUNCTIONS, 1, UNLIMITED), doc97 },
-    { string98, fn_multiply, MINMAX(FUNCTIONS, 0, UNLIMITED), doc98 },
+    { string96, fn_add, MINMAX(FUNCTIONS, 0, UNLIMITED), doc96, av_add },
+    { string97, fn_subtract, MINMAX(FUNCTIONS, 1, UNLIMITED), doc97, av_subtract },
+    { string98, fn_multiply, MINMAX(FUNCTIONS, 0, UNLIMITED), doc98, av_multiply },
     { string99, fn_divide, MINMAX(FUNCTIONS, 1, UNLIMITED), doc99 },
-    { string100, fn_mod, MINMAX(FUNCTIONS, 2, 2), doc100 },
-    { string101, fn_oneplus, MINMAX(FUNCTIONS, 1, 1), doc101 },
-    { string102, fn_oneminus, MINMAX(FUNCTIONS, 1, 1), doc102 },
+    { string100, fn_mod, MINMAX(FUNCTIONS, 2, 2), doc100, av_mod },
+    { string101, fn_oneplus, MINMAX(FUNCTIONS, 1, 1), doc101, av_oneplus },
+    { string102, fn_oneminus, MINMAX(FUNCTIONS, 1, 1), doc102, av_oneminus },
     { string103, fn_abs, MINMAX(FUNCTIONS, 1, 1), doc103 },
     { string104, fn_random, MINMAX(FUNCTIONS, 1, 1), doc104 },
     { string105, fn_maxfn, MINMAX(FUNCTIONS, 1, UNLIMITED), doc105 },
     { string106, fn_minfn, MINMAX(FUNCTIONS, 1, UNLIMITED), doc106 },
     { string107, fn_noteq, MINMAX(FUNCTIONS, 1, UNLIMITED), doc107 },
-    { string108, fn_numeq, MINMAX(FUNCTIONS, 1, UNLIMITED), doc108 },
-    { string109, fn_less, MINMAX(FUNCTIONS, 1, UNLIMITED), doc109 },
-    { string110, fn_lesseq, MINMAX(FUNCTIONS, 1, UNLIMITED), doc110 },
-    { string111, fn_greater, MINMAX(FUNCTIONS, 1, UNLIMITED), doc111 },
-    { string112, fn_greatereq, MINMAX(FUNCTIONS, 1, UNLIMITED), doc112 },
-    { string113, fn_plusp, MINMAX(FUNCTIONS, 1, 1), doc113 },
-    { string114, fn_minusp, MINMAX(FUNCTIONS, 1, 1), doc114 },
-    { string115, fn_zerop, MINMAX(FUNCTIONS, 1, 1), doc115 },
+    { string108, fn_numeq, MINMAX(FUNCTIONS, 1, UNLIMITED), doc108, av_numeq },
+    { string109, fn_less, MINMAX(FUNCTIONS, 1, UNLIMITED), doc109, av_less },
+    { string110, fn_lesseq, MINMAX(FUNCTIONS, 1, UNLIMITED), doc110, av_lesseq },
+    { string111, fn_greater, MINMAX(FUNCTIONS, 1, UNLIMITED), doc111, av_greater },
+    { string112, fn_greatereq, MINMAX(FUNCTIONS, 1, UNLIMITED), doc112, av_greatereq },
+    { string113, fn_plusp, MINMAX(FUNCTIONS, 1, 1), doc113, av_plusp },
+    { string114, fn_minusp, MINMAX(FUNCTIONS, 1, 1), doc114, av_minusp },
+    { string115, fn_zerop, MINMAX(FUNCTIONS, 1, 1), doc115, av_zerop },
     { string116, fn_oddp, MINMAX(FUNCTIONS, 1, 1), doc116 },
     { string117, fn_evenp, MINMAX(FUNCTIONS, 1, 1), doc117 },
     { string118, fn_integerp, MINMAX(FUNCTIONS, 1, 1), doc118 },
@@ -7411,10 +11694,10 @@ const tbl_entry_t BuiltinTable[] = {
     { stringstringnoteq, fn_stringnoteq, MINMAX(FUNCTIONS, 2, 2), docstringnoteq },
     { stringstringlesseq, fn_stringlesseq, MINMAX(FUNCTIONS, 2, 2), docstringlteq },
     { stringstringgteq, fn_stringgreatereq, MINMAX(FUNCTIONS, 2, 2), docstringgteq },
-    { string147, fn_sort, MINMAX(FUNCTIONS, 2, 2), doc147 },
+    { string147, fn_sort, MINMAX(FUNCTIONS, 2, 4), doc147 },
     { string148, fn_concatenate, MINMAX(FUNCTIONS, 1, UNLIMITED), doc148 },
     { string149, fn_subseq, MINMAX(FUNCTIONS, 2, 3), doc149 },
-    { string150, fn_search, MINMAX(FUNCTIONS, 2, 2), doc150 },
+    { string150, fn_search, MINMAX(FUNCTIONS, 2, UNLIMITED), doc150 },
     { string151, fn_readfromstring, MINMAX(FUNCTIONS, 1, 1), doc151 },
     { string152, fn_princtostring, MINMAX(FUNCTIONS, 1, 1), doc152 },
     { string153, fn_prin1tostring, MINMAX(FUNCTIONS, 1, 1), doc153 },
@@ -7499,6 +11782,37 @@ const tbl_entry_t BuiltinTable[] = {
     { stringthrow, fn_throw, MINMAX(FUNCTIONS, 1, 2), docthrow },
     { stringmacroexpand1, fn_macroexpand1, MINMAX(FUNCTIONS, 1, 1), docmacroexpand1 },
     { stringmacroexpand, fn_macroexpand, MINMAX(FUNCTIONS, 1, 1), docmacroexpand },
+    { stringmakehashtable, fn_makehashtable, MINMAX(FUNCTIONS, 0, 2), docmakehashtable },
+    { stringremhash, fn_remhash, MINMAX(FUNCTIONS, 2, 2), docremhash },
+    { stringmaphash, fn_maphash, MINMAX(FUNCTIONS, 2, 2), docmaphash },
+    { stringclrhash, fn_clrhash, MINMAX(FUNCTIONS, 1, 1), docclrhash },
+    { stringhashtablecount, fn_hashtablecount, MINMAX(FUNCTIONS, 1, 1), dochashtablecount },
+    { stringsxhash, fn_sxhash, MINMAX(FUNCTIONS, 1, 1), docsxhash },
+    { stringeql, fn_eq, MINMAX(FUNCTIONS, 2, 2), doceql, av_eq },
+    { stringwithinputfromstring, sp_withinputfromstring, MINMAX(SPECIAL_FORMS, 1, UNLIMITED), docwithinputfromstring },
+    { stringreadsequence, fn_readsequence, MINMAX(FUNCTIONS, 2, 6), docreadsequence },
+    { stringwritesequence, fn_writesequence, MINMAX(FUNCTIONS, 2, 6), docwritesequence },
+    { stringfilelength, fn_filelength, MINMAX(FUNCTIONS, 1, 1), docfilelength },
+    { stringwithflashfile, sp_withflashfile, MINMAX(SPECIAL_FORMS, 1, UNLIMITED), docwithflashfile },
+    { stringdirectory, fn_directory, MINMAX(FUNCTIONS, 0, 1), docdirectory },
+    { stringdeletefile, fn_deletefile, MINMAX(FUNCTIONS, 1, 1), docdeletefile },
+    { stringrenamefile, fn_renamefile, MINMAX(FUNCTIONS, 2, 2), docrenamefile },
+    { stringfileposition, fn_fileposition, MINMAX(FUNCTIONS, 1, 2), docfileposition },
+    { stringreadrecord, fn_readrecord, MINMAX(FUNCTIONS, 3, 3), docreadrecord },
+    { stringwriterecord, fn_writerecord, MINMAX(FUNCTIONS, 4, 4), docwriterecord },
+    { stringsaveimage, fn_saveimage, MINMAX(FUNCTIONS, 1, 2), docsaveimage },
+    { stringloadimage, fn_loadimage, MINMAX(FUNCTIONS, 1, 2), docloadimage },
+    { stringcompilefile, fn_compilefile, MINMAX(FUNCTIONS, 1, 1), doccompilefile },
+    { stringloadcompiled, fn_loadcompiled, MINMAX(FUNCTIONS, 1, 1), docloadcompiled },
+    { stringreload, fn_reload, MINMAX(FUNCTIONS, 1, 1), docreload },
+    { stringwriteobject, fn_writeobject, MINMAX(FUNCTIONS, 2, 2), docwriteobject },
+    { stringreadobject, fn_readobject, MINMAX(FUNCTIONS, 1, 1), docreadobject },
+    { stringkvopen, fn_kvopen, MINMAX(FUNCTIONS, 1, 2), dockvopen },
+    { stringkvput, fn_kvput, MINMAX(FUNCTIONS, 2, 2), dockvput },
+    { stringkvget, fn_kvget, MINMAX(FUNCTIONS, 1, 2), dockvget },
+    { stringkvdelete, fn_kvdelete, MINMAX(FUNCTIONS, 1, 1), dockvdelete },
+    { stringkvcompact, fn_kvcompact, MINMAX(FUNCTIONS, 0, 0), dockvcompact },
+    { stringserialraw, fn_serialraw, MINMAX(FUNCTIONS, 1, 1), docserialraw },
 };
 
 // Metatable cross-reference functions
@@ -7555,6 +11869,13 @@ fn_ptr_type lookupfn(builtin_t name) {
     return getentry(name)->fptr;
 }
 
+/*
+    lookupargv - looks up the argument vector entry point for name, or NULL if it only takes an argument list
+*/
+fn_argv_type lookupargv(builtin_t name) {
+    return getentry(name)->aptr;
+}
+
 /*
     getminmax - gets the minmax byte from BuiltinTable[] whose octets specify the type of function
     and minimum and maximum number of arguments for name
@@ -7588,10 +11909,98 @@ bool findsubstring(char* part, builtin_t name) {
 }
 
 /*
-    testescape - tests whether the '~' escape character has been typed
+    testescape - tests whether the '~' escape character has been typed, leaving any other input to be read
 */
 void testescape() {
-    if (Serial.available() && Serial.read() == '~') error2("escape!");
+    flushoutput();
+    serialreceive();
+    if (serialescape() >= 0) escape();
+}
+
+/*
+    escape - takes the '~' that was typed out of the serial input, and gives the escape error
+    Every escape goes through here, so one '~' gives exactly one escape.
+*/
+void escape() {
+    int pos = serialescape();
+    if (pos >= 0) {
+        // Take out the '~', moving the whitespace before it up
+        for (int n = pos; n > 0; n--) SerialRing[(SerialTail + n) & (SERIALRING - 1)] = SerialRing[(SerialTail + n - 1) & (SERIALRING - 1)];
+        SerialTail = (SerialTail + 1) & (SERIALRING - 1);
+        if (SerialLine > pos) SerialLine--;
+        if (SerialScan > pos) SerialScan--;
+    }
+    Escape = false;
+    error2("escape!");
+}
+
+/*
+    serialescape - returns the position in SerialRing of a '~' typed after any whitespace
+    left over from the last line read, or -1 if there isn't one
+*/
+int serialescape() {
+    if (tstflag(RAWSERIAL)) return -1;
+    int count = (SerialHead - SerialTail) & (SERIALRING - 1);
+    for (int n = 0; n < count; n++) {
+        char c = SerialRing[(SerialTail + n) & (SERIALRING - 1)];
+        if (c == '~') return n;
+        if (!issp(c)) return -1;
+    }
+    return -1;
+}
+
+/*
+    serialreceive - moves serial input into SerialRing; called when serial data arrives, and when polling
+    Sets Escape as soon as '~' is typed, so eval() notices it without waiting for the next poll.
+*/
+void serialreceive() {
+    if (__sync_lock_test_and_set(&SerialBusy, 1)) return;  // Already running in the other task
+    while (Serial.available()) {
+        int next = (SerialHead + 1) & (SERIALRING - 1);
+        if (next == SerialTail) break;  // Full, so leave the rest in the UART's buffer
+        SerialRing[SerialHead] = Serial.read();
+        SerialHead = next;
+    }
+    if (!tstflag(NOESC) && serialescape() >= 0) Escape = true;
+    __sync_lock_release(&SerialBusy);
+}
+
+/*
+    serialready - tests whether gserial() has input to deliver: a whole line, or any byte in raw mode
+    A line too long for SerialRing is delivered once the ring is full.
+*/
+bool serialready() {
+    int count = (SerialHead - SerialTail) & (SERIALRING - 1);
+    if (tstflag(RAWSERIAL)) return count > 0;
+    if (SerialLine > 0) return true;
+    for (; SerialScan < count; SerialScan++) {
+        char c = SerialRing[(SerialTail + SerialScan) & (SERIALRING - 1)];
+        if (c == '\n' || c == '\r') {
+            SerialLine = SerialScan + 1;
+            return true;
+        }
+    }
+    if (count == SERIALRING - 1) SerialLine = count;
+    return SerialLine > 0;
+}
+
+/*
+    serialdiscard - throws away any serial input that hasn't been read
+*/
+void serialdiscard() {
+    while (Serial.available()) Serial.read();
+    SerialTail = SerialHead;
+    SerialLine = SerialScan = 0;
+    LastChar = 0;
+    Escape = false;
+}
+
+/*
+    checkstack - checks for C stack overflow; called on entry to each user function or macro
+*/
+void checkstack(symbol_t name) {
+    char here;
+    if (abs(static_cast<char*>(StackBottom) - &here) > MAX_STACK) errorsym2(name, "C stack overflow");
 }
 
 /*
@@ -7614,186 +12023,299 @@ bool keywordp(object* obj) {
 
 // Main evaluator
 
+/*
+    pusharg - pushes an evaluated argument onto ArgStack, growing it if necessary
+*/
+void pusharg(object* arg) {
+    if (ArgTop == ArgSize) {
+        int size = ArgSize ? ArgSize * 2 : ARGSTACKSIZE;
+        object** stack = (object**)realloc(ArgStack, size * sizeof(object*));
+        if (stack == NULL) error2("no room for arguments");
+        ArgStack = stack;
+        ArgSize = size;
+    }
+    ArgStack[ArgTop++] = arg;
+}
+
+/*
+    pushframe - pushes a frame for a pending call or let onto EvalStack, growing it if necessary;
+    the depth is limited to EVALSTACKMAX frames
+*/
+frame_t* pushframe(uint8_t type, object* form, object* env, bool tailcall) {
+    if (EvalTop == EvalSize) {
+        int size = EvalSize ? EvalSize * 2 : EVALSTACKSIZE;
+        frame_t* stack = NULL;
+        if (EvalSize < EVALSTACKMAX) stack = (frame_t*)realloc(EvalStack, size * sizeof(frame_t));
+        if (stack == NULL) {
+            Context = NIL;
+            error("stack overflow", form);
+        }
+        EvalStack = stack;
+        EvalSize = size;
+    }
+    frame_t* frame = &EvalStack[EvalTop++];
+    frame->type = type;
+    frame->tailcall = tailcall;
+    frame->base = 0;
+    frame->form = form;
+    frame->env = env;
+    frame->value = nil;
+    frame->more = nil;
+    return frame;
+}
+
 /*
     eval - the main Lisp evaluator
+    Function arguments and let bindings are evaluated iteratively, with the pending calls kept on EvalStack
+    and the evaluated arguments on ArgStack, so recursion in Lisp doesn't recurse on the C stack.
+    A nested call of eval() only unwinds frames above the EvalTop it was called with.
 */
 object* eval(object* form, object* env) {
+    int bottom = EvalTop;
     bool tailcall = false;
+    object* result;
+    frame_t* frame;
 EVAL:
     // Enough space?
     if (Freespace <= WORKSPACESIZE >> 4) gc(form, env);
     // Escape
-    if (tstflag(ESCAPE)) {
-        clrflag(ESCAPE);
-        error2("escape!");
+    if (Escape) escape();
+    if (--PollCount == 0) {
+        PollCount = ESCAPEPOLL;
+        if (!tstflag(NOESC)) testescape();
     }
-    if (!tstflag(NOESC)) testescape();
-    // Stack overflow check
-    if (abs(static_cast<bool*>(StackBottom) - &tailcall) > MAX_STACK) error("C stack overflow", form);
 
-    if (form == NULL) return nil;
+    if (form == NULL) {
+        result = nil;
+        goto RETURN;
+    }
 
-    if (form->type >= NUMBER && form->type <= STRING) return form;  // Literal
+    if (form->type >= NUMBER && form->type <= STRING) {  // Literal
+        result = form;
+        goto RETURN;
+    }
 
     if (symbolp(form)) {
-        if (form == tee) return form;
-        if (keywordp(form)) return form;  // Keyword
+        result = form;
+        if (form == tee) goto RETURN;
+        if (keywordp(form)) goto RETURN;  // Keyword
         symbol_t name = form->name;
         object* pair = value(name, env);
-        if (pair != NULL) return cdr(pair);
-        pair = value(name, GlobalEnv);
-        if (pair != NULL) return cdr(pair);
+        if (pair == NULL) pair = value(name, GlobalEnv);
+        if (pair != NULL) result = cdr(pair);
         // special symbol macro handling
         else if (builtinp(name)) {
             builtin_t bname = builtin(name);
             uint8_t ft = fntype(getminmax(bname));
-            if (ft == SPECIAL_SYMBOLS) return ((fn_ptr_type)lookupfn(bname))(NULL, env);
-            else if (ft == OTHER_FORMS) return form;
-            else return bfunction_from_symbol(form);
+            if (ft == SPECIAL_SYMBOLS) result = ((fn_ptr_type)lookupfn(bname))(NULL, env);
+            else if (ft != OTHER_FORMS) result = bfunction_from_symbol(form);
+        } else {
+            Context = NIL;
+            error("undefined", form);
         }
-        Context = NIL;
-        error("undefined", form);
+        goto RETURN;
     }
     // Expand macros
     form = macroexpand(form, env);
 
-    // It's a list
-    object* function = car(form);
-    object* args = cdr(form);
-
-    if (function == NULL) error2("can't call nil");
-    if (!listp(args)) error("can't evaluate a dotted pair", args);
-
-    // List starts with a builtin special form?
-    if (symbolp(function) && builtinp(function->name)) {
-        builtin_t name = builtin(function->name);
-
-        if ((name == LET) || (name == LETSTAR)) {
-            if (args == NULL) error2(noargument);
-            object* assigns = first(args);
-            if (!listp(assigns)) error(notalist, assigns);
-            object* forms = cdr(args);
-            object* newenv = env;
-            protect(newenv);
-            while (assigns != NULL) {
-                object* assign = car(assigns);
-                if (!consp(assign)) push(cons(assign, nil), newenv);
-                else if (cdr(assign) == NULL) push(cons(first(assign), nil), newenv);
-                else push(cons(first(assign), eval(second(assign), env)), newenv);
-                car(GCStack) = newenv;
-                if (name == LETSTAR) env = newenv;
-                assigns = cdr(assigns);
+    {
+        // It's a list
+        object* function = car(form);
+        object* args = cdr(form);
+
+        if (function == NULL) error2("can't call nil");
+        if (!listp(args)) error("can't evaluate a dotted pair", args);
+
+        // List starts with a builtin special form?
+        if (symbolp(function) && builtinp(function->name)) {
+            builtin_t name = builtin(function->name);
+
+            if ((name == LET) || (name == LETSTAR)) {
+                if (args == NULL) error2(noargument);
+                object* assigns = first(args);
+                if (!listp(assigns)) error(notalist, assigns);
+                frame = pushframe(LETFRAME, form, env, tailcall);
+                frame->value = env;
+                frame->more = assigns;
+                goto LETBINDINGS;
             }
-            env = newenv;
-            unprotect();
-            clrflag(TAILCALL);
-            form = sp_progn(forms, env);
-            if (tstflag(TAILCALL)) {
-                clrflag(TAILCALL);
-                goto EVAL;
+
+            // MACRO does not do closures.
+            if (name == LAMBDA) {
+                result = form;
+                if (env == NULL) goto RETURN;
+                object* envcopy = NULL;
+                while (env != NULL) {
+                    object* pair = first(env);
+                    if (pair != NULL) push(pair, envcopy);
+                    env = cdr(env);
+                }
+                result = cons(bsymbol(CLOSURE), cons(envcopy, args));
+                goto RETURN;
+            }
+            uint8_t ft = fntype(getminmax(name));
+
+            if (ft == SPECIAL_FORMS) {
+                Context = name;
+                checkargs(args);
+                form = ((fn_ptr_type)lookupfn(name))(args, env);
+                if (tstflag(TAILCALL)) {
+                    tailcall = true;
+                    clrflag(TAILCALL);
+                    goto EVAL;
+                }
+                result = form;
+                goto RETURN;
             }
-            return form;
+            if (ft == OTHER_FORMS) error("can't be used as a function", function);
         }
 
-        // MACRO does not do closures.
-        if (name == LAMBDA) {
-            if (env == NULL) return form;
-            object* envcopy = NULL;
-            while (env != NULL) {
-                object* pair = first(env);
-                if (pair != NULL) push(pair, envcopy);
-                env = cdr(env);
+        object* fname = car(form);
+        object* pair;
+        if (symbolp(fname) && (pair = value(fname->name, env)) != NULL) function = cdr(pair);
+        else if (symbolp(fname)) {
+            // Global or builtin function - use the call-site cache
+            callcache_t* entry = &CallCache[((uintptr_t)form >> 3) % CALLCACHESIZE];
+            if (entry->site == form && entry->name == fname->name && entry->epoch == Epoch) function = entry->function;
+            else {
+                function = eval(fname, env);
+                if (consp(function) || bfunctionp(function)) {
+                    entry->site = form;
+                    entry->name = fname->name;
+                    entry->epoch = Epoch;
+                    entry->function = function;
+                }
             }
-            return cons(bsymbol(CLOSURE), cons(envcopy, args));
+        } else function = eval(fname, env);
+
+        // Evaluate the parameters onto ArgStack
+        frame = pushframe(ARGSFRAME, form, env, tailcall);
+        frame->value = function;
+        frame->more = args;
+        frame->base = ArgTop;
+    }
+
+ARGUMENTS:
+    if (frame->more != NULL) {
+        form = car(frame->more);
+        frame->more = cdr(frame->more);
+        env = frame->env;
+        tailcall = false;
+        goto EVAL;
+    }
+    {
+        // All evaluated - call the function
+        EvalTop--;
+        object* fname = car(frame->form);
+        object* function = frame->value;
+        bool old_tailcall = frame->tailcall;
+        int base = frame->base;
+        int nargs = ArgTop - base;
+        env = frame->env;
+
+        // fail early on calling a symbol
+        if (symbolp(function)) {
+            Context = NIL;
+            error("can't call a symbol", function);
         }
-        uint8_t ft = fntype(getminmax(name));
-
-        if (ft == SPECIAL_FORMS) {
-            Context = name;
-            checkargs(args);
-            form = ((fn_ptr_type)lookupfn(name))(args, env);
-            if (tstflag(TAILCALL)) {
-                tailcall = true;
-                clrflag(TAILCALL);
-                goto EVAL;
+        if (bfunctionp(function)) {
+            builtin_t bname = builtin(function->name);
+            Context = bname;
+            checkminmax(bname, nargs);
+            fn_argv_type aptr = lookupargv(bname);
+            if (aptr != NULL) result = aptr(&ArgStack[base], nargs, env);
+            else {
+                object* args = argvlist(&ArgStack[base], nargs);
+                ArgTop = base;
+                pusharg(args);  // Don't GC the argument list
+                result = ((fn_ptr_type)lookupfn(bname))(args, env);
             }
-            return form;
+            ArgTop = base;
+            goto RETURN;
         }
-        if (ft == OTHER_FORMS) error("can't be used as a function", function);
-    }
-
-    // Evaluate the parameters - result in head
-    object* fname = car(form);
-    bool old_tailcall = tailcall;
-    object* head = cons(eval(fname, env), NULL);
-    protect(head);  // Don't GC the result list
-    object* tail = head;
-    form = cdr(form);
-    int nargs = 0;
-
-    while (form != NULL) {
-        object* obj = cons(eval(car(form), env), NULL);
-        cdr(tail) = obj;
-        tail = obj;
-        form = cdr(form);
-        nargs++;
-    }
-
-    function = car(head);
-    args = cdr(head);
 
-    // fail early on calling a symbol
-    if (symbolp(function)) {
-        Context = NIL;
-        error("can't call a symbol", function);
-    }
-    if (bfunctionp(function)) {
-        builtin_t bname = builtin(function->name);
-        Context = bname;
-        checkminmax(bname, nargs);
-        object* result = ((fn_ptr_type)lookupfn(bname))(args, env);
-        unprotect();
-        return result;
-    }
+        if (consp(function)) {
+            symbol_t name = sym(NIL);
+            if (!listp(fname)) name = fname->name;
+            object* args = argvlist(&ArgStack[base], nargs);
+            ArgTop = base;
+            pusharg(args);  // Don't GC the argument list
 
-    if (consp(function)) {
-        symbol_t name = sym(NIL);
-        if (!listp(fname)) name = fname->name;
+            if (isbuiltin(car(function), LAMBDA)) {
+                form = closure(old_tailcall, name, function, args, &env);
+                clrflag(TAILCALL);
+                ArgTop = base;
+                int trace = tracing(name);
+                if (trace) {
+                    frame = pushframe(TRACEFRAME, fname, env, false);
+                    frame->base = trace;
+                    tailcall = false;
+                } else tailcall = true;
+                goto EVAL;
+            }
 
-        if (isbuiltin(car(function), LAMBDA)) {
-            form = closure(old_tailcall, name, function, args, &env);
-            clrflag(TAILCALL);
-            unprotect();
-            int trace = tracing(fname->name);
-            if (trace) {
-                object* result = eval(form, env);
-                indent((--(TraceDepth[trace - 1])) << 1, ' ', pserial);
-                pint(TraceDepth[trace - 1], pserial);
-                pserial(':');
-                pserial(' ');
-                printobject(fname, pserial);
-                pfstring(" returned ", pserial);
-                printobject(result, pserial);
-                pln(pserial);
-                return result;
-            } else {
+            if (isbuiltin(car(function), CLOSURE)) {
+                function = cdr(function);
+                form = closure(old_tailcall, name, function, args, &env);
+                clrflag(TAILCALL);
+                ArgTop = base;
                 tailcall = true;
                 goto EVAL;
             }
         }
+        error("illegal function", fname);
+    }
 
-        if (isbuiltin(car(function), CLOSURE)) {
-            function = cdr(function);
-            form = closure(old_tailcall, name, function, args, &env);
-            unprotect();
-            clrflag(TAILCALL);
-            tailcall = true;
+LETBINDINGS:
+    while (frame->more != NULL) {
+        object* assign = car(frame->more);
+        if (consp(assign) && cdr(assign) != NULL) {
+            form = second(assign);
+            env = frame->env;
+            tailcall = false;
             goto EVAL;
         }
-    }
-    error("illegal function", fname);
-    // unreachable
-    return nil;
+        push(cons(consp(assign) ? first(assign) : assign, nil), frame->value);
+        if (builtin(car(frame->form)->name) == LETSTAR) frame->env = frame->value;
+        frame->more = cdr(frame->more);
+    }
+    // Bindings done - evaluate the body
+    EvalTop--;
+    env = frame->value;
+    tailcall = frame->tailcall;
+    clrflag(TAILCALL);
+    form = sp_progn(cddr(frame->form), env);
+    if (tstflag(TAILCALL)) {
+        clrflag(TAILCALL);
+        goto EVAL;
+    }
+    result = form;
+
+RETURN:
+    if (EvalTop == bottom) return result;
+    frame = &EvalStack[EvalTop - 1];
+    if (frame->type == ARGSFRAME) {
+        pusharg(result);
+        goto ARGUMENTS;
+    }
+    if (frame->type == LETFRAME) {
+        push(cons(first(car(frame->more)), result), frame->value);
+        if (builtin(car(frame->form)->name) == LETSTAR) frame->env = frame->value;
+        frame->more = cdr(frame->more);
+        goto LETBINDINGS;
+    }
+    // TRACEFRAME
+    EvalTop--;
+    int trace = frame->base;
+    indent((--(TraceDepth[trace - 1])) << 1, ' ', pserial);
+    pint(TraceDepth[trace - 1], pserial);
+    pserial(':');
+    pserial(' ');
+    printobject(frame->form, pserial);
+    pfstring(" returned ", pserial);
+    printobject(result, pserial);
+    pln(pserial);
+    goto RETURN;
 }
 
 // Print functions
@@ -7803,8 +12325,9 @@ EVAL:
 */
 void pserial(char c) {
     LastPrint = c;
-    if (c == '\n') Serial.write('\r');
-    Serial.write(c);
+    if (c == '\n') pbuffer(SERIALSTREAM << 8, '\r');
+    pbuffer(SERIALSTREAM << 8, c);
+    if (c == '\n') flushoutput();
 }
 
 const char ControlCodes[] = "Null\0SOH\0STX\0ETX\0EOT\0ENQ\0ACK\0Bell\0Backspace\0Tab\0Newline\0VT\0"
@@ -7943,6 +12466,33 @@ void pint(int i, pfun_t pfun) {
     pintbase(j, 10, pfun);
 }
 
+/*
+    pbignum - prints a bignum in decimal, converting it to base 1000000000 by repeated short division
+*/
+void pbignum(object* arg, pfun_t pfun) {
+    uint32_t w[MAXBIGNUM], digits[MAXBIGNUM * 32 / 29 + 1];
+    int n = bignumwords(arg, w), g = 0;
+    if (bignumsign(w, n)) {
+        pfun('-');
+        bignumnegate(w, n);
+    }
+    while (n > 0) {
+        uint64_t rem = 0;
+        for (int i = n - 1; i >= 0; i--) {
+            uint64_t t = rem << 32 | w[i];
+            w[i] = t / 1000000000;
+            rem = t % 1000000000;
+        }
+        digits[g++] = rem;
+        while (n > 0 && w[n - 1] == 0) n--;
+    }
+    pint(digits[--g], pfun);
+    while (g > 0) {
+        uint32_t d = digits[--g];
+        for (uint32_t p = 100000000; p > 0; p = p / 10) pfun('0' + (d / p) % 10);
+    }
+}
+
 /*
     pintbase - prints an integer in base 'base' to the specified stream
 */
@@ -7961,78 +12511,324 @@ void pintbase(uint32_t i, uint8_t base, pfun_t pfun) {
     }
 }
 
+// Floating-point conversion
+
+const uint32_t Powers10[] = { 1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000 };
+
 /*
-    pmantissa - prints the mantissa of a floating-point number to the specified stream
+    wideset - sets a wide integer to n
 */
-void pmantissa(float f, pfun_t pfun) {
-    int sig = floor(log10(f));
-    int mul = pow(10, 5 - sig);
-    int i = round(f * mul);
-    bool point = false;
-    if (i == 1000000) {
-        i = 100000;
-        sig++;
+void wideset(wideint_t* a, uint64_t n) {
+    a->length = 0;
+    while (n != 0) {
+        a->word[a->length++] = (uint32_t)n;
+        n = n >> 32;
     }
-    if (sig < 0) {
-        pfun('0');
-        pfun('.');
-        point = true;
-        for (int j = 0; j < -sig - 1; j++) pfun('0');
-    }
-    mul = 100000;
-    for (int j = 0; j < 7; j++) {
-        int d = (int)(i / mul);
-        pfun(d + '0');
-        i = i - d * mul;
-        if (i == 0) {
-            if (!point) {
-                for (int k = j; k < sig; k++) pfun('0');
-                pfun('.');
-                pfun('0');
-            }
-            return;
+}
+
+/*
+    widemul - multiplies a wide integer by m and adds c
+*/
+void widemul(wideint_t* a, uint32_t m, uint32_t c) {
+    uint64_t carry = c;
+    for (int i = 0; i < a->length; i++) {
+        carry = carry + (uint64_t)a->word[i] * m;
+        a->word[i] = (uint32_t)carry;
+        carry = carry >> 32;
+    }
+    if (carry != 0) a->word[a->length++] = carry;
+}
+
+/*
+    widepower10 - multiplies a wide integer by 10 to the power n
+*/
+void widepower10(wideint_t* a, int n) {
+    for (; n >= 9; n = n - 9) widemul(a, Powers10[9], 0);
+    if (n > 0) widemul(a, Powers10[n], 0);
+}
+
+/*
+    wideshift - multiplies a wide integer by 2 to the power n
+*/
+void wideshift(wideint_t* a, int n) {
+    if (a->length == 0) return;
+    int words = n / 32, bits = n % 32;
+    if (bits != 0) {
+        uint32_t carry = 0;
+        for (int i = 0; i < a->length; i++) {
+            uint32_t w = a->word[i];
+            a->word[i] = w << bits | carry;
+            carry = w >> (32 - bits);
+        }
+        if (carry != 0) a->word[a->length++] = carry;
+    }
+    if (words != 0) {
+        memmove(&a->word[words], a->word, a->length * sizeof(uint32_t));
+        memset(a->word, 0, words * sizeof(uint32_t));
+        a->length = a->length + words;
+    }
+}
+
+/*
+    widediv - divides a wide integer by d, and returns the remainder
+*/
+uint32_t widediv(wideint_t* a, uint32_t d) {
+    uint64_t rem = 0;
+    for (int i = a->length - 1; i >= 0; i--) {
+        rem = rem << 32 | a->word[i];
+        a->word[i] = rem / d;
+        rem = rem % d;
+    }
+    while (a->length > 0 && a->word[a->length - 1] == 0) a->length--;
+    return rem;
+}
+
+/*
+    wideadd - adds the wide integer b to a
+*/
+void wideadd(wideint_t* a, wideint_t* b) {
+    uint64_t carry = 0;
+    int n = (a->length > b->length) ? a->length : b->length;
+    for (int i = 0; i < n; i++) {
+        carry = carry + (i < a->length ? a->word[i] : 0) + (i < b->length ? b->word[i] : 0);
+        a->word[i] = (uint32_t)carry;
+        carry = carry >> 32;
+    }
+    a->length = n;
+    if (carry != 0) a->word[a->length++] = carry;
+}
+
+/*
+    widesub - subtracts the wide integer b from a, which is at least as big
+*/
+void widesub(wideint_t* a, wideint_t* b) {
+    int64_t borrow = 0;
+    for (int i = 0; i < a->length; i++) {
+        int64_t d = (int64_t)a->word[i] - (i < b->length ? b->word[i] : 0) - borrow;
+        a->word[i] = (uint32_t)d;
+        borrow = (d < 0);
+    }
+    while (a->length > 0 && a->word[a->length - 1] == 0) a->length--;
+}
+
+/*
+    widecmp - compares two wide integers, returning -1, 0, or 1
+*/
+int widecmp(wideint_t* a, wideint_t* b) {
+    if (a->length != b->length) return (a->length < b->length) ? -1 : 1;
+    for (int i = a->length - 1; i >= 0; i--) {
+        if (a->word[i] != b->word[i]) return (a->word[i] < b->word[i]) ? -1 : 1;
+    }
+    return 0;
+}
+
+/*
+    widebit - returns bit n of a wide integer
+*/
+bool widebit(wideint_t* a, int n) {
+    return n / 32 < a->length && (a->word[n / 32] >> (n % 32) & 1);
+}
+
+/*
+    widebits - returns the number of bits in a wide integer
+*/
+int widebits(wideint_t* a) {
+    if (a->length == 0) return 0;
+    int n = (a->length - 1) * 32;
+    for (uint32_t top = a->word[a->length - 1]; top != 0; top = top >> 1) n++;
+    return n;
+}
+
+/*
+    decimalfloat - returns n times 10 to the power exponent, correctly rounded to the nearest float
+    Inexact means that nonzero digits after those in n were dropped.
+*/
+float decimalfloat(wideint_t* n, int exponent, bool inexact) {
+    if (n->length == 0) return 0.0;
+    // Both numbers are exact floats, so a single multiply or divide rounds correctly
+    if (n->length == 1 && n->word[0] <= 0x1000000 && !inexact && exponent >= -9 && exponent <= 9) {
+        if (exponent < 0) return (float)n->word[0] / (float)Powers10[-exponent];
+        return (float)n->word[0] * (float)Powers10[exponent];
+    }
+    int top = widebits(n) - 1;
+    // n is at least 10 to the power (top * 3 / 10), and less than 10 to the power (top / 3 + 1)
+    if (exponent + top * 3 / 10 > 38) return INFINITY;
+    if (exponent + top / 3 + 1 < -45) return 0.0;
+    // Make n times 2 to the power binary the number, with at least 64 bits in n if it's a fraction
+    int binary = 0;
+    if (exponent >= 0) widepower10(n, exponent);
+    else {
+        int shift = 64 + (-exponent * 10 + 2) / 3 - top;
+        if (shift > 0) {
+            wideshift(n, shift);
+            binary = -shift;
+        }
+        for (int e = -exponent; e > 0; e = e - 9) {
+            if (widediv(n, Powers10[(e < 9) ? e : 9]) != 0) inexact = true;
+        }
+    }
+    top = widebits(n) - 1;
+    int power = top + binary;
+    if (power > 127) return INFINITY;
+    int keep = (power >= -126) ? 24 : 150 + power;  // Bits in the mantissa, fewer if it's subnormal
+    if (keep < 0) return 0.0;
+    int drop = top + 1 - keep;
+    uint32_t bits = 0;
+    for (int i = top; i >= drop && i >= 0; i--) bits = bits << 1 | widebit(n, i);
+    if (drop < 0) bits = bits << -drop;
+    else if (drop > 0 && widebit(n, drop - 1)) {
+        // Round to nearest, or to even if exactly half way
+        for (int i = 0; i < drop - 1 && !inexact; i++) inexact = widebit(n, i);
+        if (inexact || (bits & 1)) bits++;
+    }
+    // Rounding up can carry into the exponent, or give infinity
+    if (keep == 24) bits = bits + ((uint32_t)(power + 126) << 23);
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+/*
+    readfloat - returns the float written in decimal in text, correctly rounded
+    Digits after the first FLOATDIGITS can't affect the rounding, except by being nonzero.
+*/
+float readfloat(const char* text) {
+    wideint_t n;
+    wideset(&n, 0);
+    int digits = 0, exponent = 0;
+    bool point = false, inexact = false;
+    float sign = 1.0;
+    if (*text == '-') sign = -1.0;
+    if (*text == '-' || *text == '+') text++;
+    for (; *text != 'e' && *text != 'E' && *text != '\0'; text++) {
+        if (*text == '.') point = true;
+        else if (digits < FLOATDIGITS) {
+            widemul(&n, 10, *text - '0');
+            if (n.length != 0) digits++;
+            if (point) exponent--;
+        } else {
+            if (*text != '0') inexact = true;
+            if (!point) exponent++;
         }
-        if (j == sig && sig >= 0) {
-            pfun('.');
-            point = true;
+    }
+    int e = 0, esign = 1;
+    for (; *text != '\0'; text++) {
+        if (*text == '-') esign = -esign;
+        else if (*text >= '0' && *text <= '9' && e < 10000) e = e * 10 + *text - '0';
+    }
+    return sign * decimalfloat(&n, exponent + e * esign, inexact);
+}
+
+/*
+    floatdigits - puts in digits the fewest decimal digits that read back as the positive float f, and returns
+    how many there are; f is 0.d1d2... times 10 to the power *point
+*/
+int floatdigits(float f, uint8_t* digits, int* point) {
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    uint32_t mantissa = bits & 0x7FFFFF;
+    int exponent = bits >> 23 & 0xFF;
+    bool lower = (mantissa == 0 && exponent > 1);  // Gap to the float below is half the gap above
+    if (exponent == 0) exponent = 1;
+    else mantissa = mantissa | 0x800000;
+    exponent = exponent - 150;
+    bool even = !(mantissa & 1);  // Numbers half way to the next float read back as this one
+    // f is r/s, and the halfway points to the floats above and below are (r + mplus)/s and (r - mminus)/s
+    wideint_t r, s, mplus, mminus, high;
+    wideset(&r, (uint64_t)mantissa << (lower ? 2 : 1));
+    wideset(&s, lower ? 4 : 2);
+    wideset(&mplus, lower ? 2 : 1);
+    wideset(&mminus, 1);
+    if (exponent >= 0) {
+        wideshift(&r, exponent);
+        wideshift(&mplus, exponent);
+        wideshift(&mminus, exponent);
+    } else wideshift(&s, -exponent);
+    int power = exponent - 1;  // floor(log2(f))
+    for (uint32_t m = mantissa; m != 0; m = m >> 1) power++;
+    int k = (power * 78913) >> 18;  // floor(power * log10(2)), so 10 to the power k is at most f
+    if (k >= 0) widepower10(&s, k);
+    else {
+        widepower10(&r, -k);
+        widepower10(&mplus, -k);
+        widepower10(&mminus, -k);
+    }
+    for (;;) {
+        high = r;
+        wideadd(&high, &mplus);
+        int c = widecmp(&high, &s);
+        if (c < 0 || (c == 0 && !even)) break;
+        widemul(&s, 10, 0);
+        k++;
+    }
+    *point = k;
+    int n = 0;
+    for (;;) {
+        widemul(&r, 10, 0);
+        widemul(&mplus, 10, 0);
+        widemul(&mminus, 10, 0);
+        uint8_t d = 0;
+        while (widecmp(&r, &s) >= 0) {
+            widesub(&r, &s);
+            d++;
         }
-        mul = mul / 10;
+        int c = widecmp(&r, &mminus);
+        bool low = (c < 0 || (c == 0 && even));
+        high = r;
+        wideadd(&high, &mplus);
+        c = widecmp(&high, &s);
+        bool up = (c > 0 || (c == 0 && even));
+        if (low && up) {
+            // Either digit reads back, so take the nearer
+            wideshift(&r, 1);
+            if (widecmp(&r, &s) >= 0) d++;
+        } else if (up) d++;
+        digits[n++] = d;
+        if (low || up) return n;
     }
 }
 
 /*
-    pfloat - prints a floating-point number to the specified stream
+    pfloat - prints a floating-point number to the specified stream, with the fewest digits that read back as it
 */
 void pfloat(float f, pfun_t pfun) {
     if (isnan(f)) {
         pfstring("NaN", pfun);
         return;
     }
-    if (f == 0.0) {
-        pfun('0');
-        return;
+    if (signbit(f)) {
+        pfun('-');
+        f = -f;
     }
     if (isinf(f)) {
         pfstring("Inf", pfun);
         return;
     }
-    if (f < 0) {
-        pfun('-');
-        f = -f;
-    }
-    // Calculate exponent
-    int e = 0;
-    if (f < 1e-3 || f >= 1e5) {
-        e = floor(log(f) / 2.302585);  // log10 gives wrong result
-        f = f / pow(10, e);
+    if (f == 0.0) {
+        pfstring("0.0", pfun);
+        return;
     }
-
-    pmantissa(f, pfun);
-
-    // Exponent
-    if (e != 0) {
+    uint8_t digits[9];
+    int point;
+    int n = floatdigits(f, digits, &point);
+    if (point > 5 || point < -2) {
+        // Exponent for numbers from 1e5, and below 1e-3
+        pfun('0' + digits[0]);
+        pfun('.');
+        if (n == 1) pfun('0');
+        for (int i = 1; i < n; i++) pfun('0' + digits[i]);
         pfun('e');
-        pint(e, pfun);
+        pint(point - 1, pfun);
+    } else if (point <= 0) {
+        pfstring("0.", pfun);
+        for (int i = 0; i < -point; i++) pfun('0');
+        for (int i = 0; i < n; i++) pfun('0' + digits[i]);
+    } else {
+        for (int i = 0; i < n || i < point; i++) {
+            if (i == point) pfun('.');
+            pfun((i < n) ? '0' + digits[i] : '0');
+        }
+        if (n <= point) pfstring(".0", pfun);
     }
 }
 
@@ -8088,6 +12884,7 @@ void printobject(object* form, pfun_t pfun) {
     else if (listp(form) && isbuiltin(car(form), CLOSURE)) pfstring("<closure>", pfun);
     else if (listp(form)) plist(form, pfun);
     else if (integerp(form)) pint(form->integer, pfun);
+    else if (bignump(form)) pbignum(form, pfun);
     else if (floatp(form)) pfloat(form->single_float, pfun);
     else if (symbolp(form)) {
         if (form->name != sym(NOTHING)) printsymbol(form, pfun);
@@ -8102,6 +12899,7 @@ void printobject(object* form, pfun_t pfun) {
     } else if (characterp(form)) pcharacter(form->chars, pfun);
     else if (stringp(form)) printstring(form, pfun);
     else if (arrayp(form)) printarray(form, pfun);
+    else if (hashtablep(form)) pfstring("<hash-table>", pfun);
     else if (streamp(form)) pstream(form, pfun);
     else error2("internal error in print");
 }
@@ -8127,26 +12925,80 @@ int glibrary() {
         LastChar = 0;
         return temp;
     }
-    char c = LispLibrary[GlobalStringIndex++];
-    return (c != 0) ? c : -1;  // -1?
+    char c = librarynext();
+    return (c != 0) ? c : -1;
+}
+
+/*
+    romlibraryp - returns true if there's a ROM library made for this firmware's builtins,
+    which is used instead of LispLibrary[]
+*/
+bool romlibraryp() {
+#if defined(romlibrary)
+    return ROMSIGNATURE == tablesignature();
+#else
+    return false;
+#endif
+}
+
+/*
+    startlibrary - starts reading the forms of the Lisp Library, from the ROM library if it's valid for this firmware
+*/
+void startlibrary() {
+    libraryseek(0);
+    LastChar = 0;
+#if defined(romlibrary)
+    RomNext = romlibraryp() ? RomLibrary : NULL;
+#endif
+}
+
+/*
+    nextlibraryform - returns the next form of the Lisp Library, or NULL at the end
+*/
+object* nextlibraryform() {
+#if defined(romlibrary)
+    if (romlibraryp()) {
+        if (RomNext == NULL) return NULL;
+        object* form = car(RomNext);
+        RomNext = cdr(RomNext);
+        return form;
+    }
+#endif
+    return read(glibrary);
 }
 
 /*
     loadfromlibrary - reads and evaluates a form from the Lisp Library
 */
 void loadfromlibrary(object* env) {
-    GlobalStringIndex = 0;
-    object* line = read(glibrary);
+    startlibrary();
+    object* line = nextlibraryform();
     while (line != NULL) {
         protect(line);
         eval(line, env);
         unprotect();
-        line = read(glibrary);
+        line = nextlibraryform();
     }
 }
 
 /*
-    gserial - gets a character from the serial port
+    loadfromrom - evaluates the forms in the ROM list forms, and returns true,
+    or returns false if there are none or the ROM library isn't valid for this firmware
+*/
+bool loadfromrom(object* forms) {
+#if defined(romlibrary)
+    if (forms == NULL || !romlibraryp()) return false;
+    for (; forms != NULL; forms = cdr(forms)) eval(car(forms), NULL);
+    return true;
+#else
+    (void)forms;
+    return false;
+#endif
+}
+
+/*
+    gserial - gets a character from the serial port, a line at a time, echoing it unless NOECHO is set
+    In raw mode each byte is returned as soon as it arrives, without echo.
 */
 int gserial() {
     if (LastChar) {
@@ -8154,12 +13006,24 @@ int gserial() {
         LastChar = 0;
         return temp;
     }
-    unsigned long start = millis();
-    while (!Serial.available()) {
-        delay(1);
-        if (millis() - start > 1000) clrflag(NOECHO);
+    if (!serialready()) {
+        // Echo is only written out when waiting for input, so that a pasted program is echoed in blocks
+        flushoutput();
+        unsigned long start = millis();
+        for (;;) {
+            serialreceive();
+            if (serialready()) break;
+            delay(1);
+            if (millis() - start > 1000) clrflag(NOECHO);
+        }
     }
-    char temp = Serial.read();
+    uint8_t c = SerialRing[SerialTail];
+    SerialTail = (SerialTail + 1) & (SERIALRING - 1);
+    if (SerialLine > 0) SerialLine--;
+    if (SerialScan > 0) SerialScan--;
+    if (tstflag(RAWSERIAL)) return c;
+    char temp = c;
+    if (temp == '~') Escape = false;  // Read as data, so not an escape
     if (temp != '\n' && !tstflag(NOECHO)) pserial(temp);
     return temp;
 }
@@ -8188,7 +13052,7 @@ object* nextitem(gfun_t gfun) {
         ch = gfun();
         if (ch == '@') return (object*)COMMA_AT;
         else {
-            LastChar = ch;
+            unreadchar(ch, gfun);
             return (object*)COMMA;
         }
     }
@@ -8201,8 +13065,7 @@ object* nextitem(gfun_t gfun) {
     char buffer[BUFFERSIZE];
     int bufmax = BUFFERSIZE - 3;  // Max index
     unsigned int result = 0;
-    bool isfloat = false;
-    float fresult = 0.0;
+    bool isfloat = false, isbig = false;
 
     if (ch == '+') {
         buffer[index++] = ch;
@@ -8226,7 +13089,7 @@ object* nextitem(gfun_t gfun) {
             base = 0;
             ch = gfun();
             if (issp(ch) || isbr(ch)) return character(ch);
-            else LastChar = ch;
+            else unreadchar(ch, gfun);
         } else if (ch == '|') {
             do {
                 while (gfun() != '|')
@@ -8239,11 +13102,14 @@ object* nextitem(gfun_t gfun) {
         else if (ch == '\'') return nextitem(gfun);
         else if (ch == '.') {
             setflag(NOESC);
-            object* result = eval(read(gfun), NULL);
+            object* form = read(gfun);
+            stringcursor_t* cursor = GlobalStringCursor;  // The form can read from another string stream
+            object* result = eval(form, NULL);
+            GlobalStringCursor = cursor;
             clrflag(NOESC);
             return result;
         } else if (ch == '(') {
-            LastChar = ch;
+            unreadchar(ch, gfun);
             return readarray(1, read(gfun));
         } else if (ch == '*') return readbitarray(gfun);
         else if (ch >= '1' && ch <= '9' && (gfun() & ~0x20) == 'A') return readarray(ch - '0', read(gfun));
@@ -8255,39 +13121,27 @@ object* nextitem(gfun_t gfun) {
     else if (digitvalue(ch) < base) valid = 1;
     else valid = -1;
     bool isexponent = false;
-    int exponent = 0, esign = 1;
     buffer[2] = '\0';
     buffer[3] = '\0';
     buffer[4] = '\0';
     buffer[5] = '\0';  // In case symbol is < 5 letters
-    float divisor = 10.0;
 
-    while (!issp(ch) && !isbr(ch) && index < bufmax) {
+    while (!issp(ch) && !isbr(ch) && ch != -1 && index < bufmax) {
         buffer[index++] = ch;
         if (base == 10 && ch == '.' && !isexponent) {
             isfloat = true;
-            fresult = result;
         } else if (base == 10 && (ch == 'e' || ch == 'E')) {
-            if (!isfloat) {
-                isfloat = true;
-                fresult = result;
-            }
+            isfloat = true;
             isexponent = true;
             if (valid == 1) valid = 0;
             else valid = -1;
-        } else if (isexponent && ch == '-') {
-            esign = -esign;
-        } else if (isexponent && ch == '+') {
+        } else if (isexponent && (ch == '-' || ch == '+')) {
         } else {
             int digit = digitvalue(ch);
             if (digitvalue(ch) < base && valid != -1) valid = 1;
             else valid = -1;
-            if (isexponent) {
-                exponent = exponent * 10 + digit;
-            } else if (isfloat) {
-                fresult = fresult + digit / divisor;
-                divisor = divisor * 10.0;
-            } else {
+            if (!isfloat) {
+                if (valid == 1 && result > (UINT_MAX - digit) / base) isbig = true;
                 result = result * base + digit;
             }
         }
@@ -8295,11 +13149,12 @@ object* nextitem(gfun_t gfun) {
     }
 
     buffer[index] = '\0';
-    if (isbr(ch)) LastChar = ch;
-    if (isfloat && valid == 1) return makefloat(fresult * sign * pow(10, exponent * esign));
+    if (index == bufmax && valid != -1 && !issp(ch) && !isbr(ch) && ch != -1) error2("number too long");
+    if (isbr(ch)) unreadchar(ch, gfun);
+    if (isfloat && valid == 1) return makefloat(readfloat(buffer));
     else if (valid == 1) {
-        if (base == 10 && result > ((unsigned int)INT_MAX + (1 - sign) / 2))
-            return makefloat((float)result * sign);
+        if (isbig || (base == 10 && result > ((unsigned int)INT_MAX + (1 - sign) / 2)))
+            return bignumread(buffer, base);
         return number(result * sign);
     } else if (base == 0) {
         if (index == 1) return character(buffer[0]);
@@ -8394,6 +13249,7 @@ void ulispinit() {
     inittables();
     initenv();
     initsleep();
+    initescape();
     initgfx();
 }
 
@@ -8406,6 +13262,7 @@ void repl(object* env) {
     for (;;) {
         randomSeed(micros());
         gc(NULL, env);
+        kvflush();
         if (BreakLevel) {
             pfstring(" : ", pserial);
             pint(BreakLevel, pserial);
@@ -8425,6 +13282,7 @@ void repl(object* env) {
         protect(line);
         pfl(pserial);
         line = eval(line, env);
+        flushoutput();
         pfl(pserial);
         pfstring("\n=> ", pserial);
         printobject(line, pserial);
@@ -8436,15 +13294,27 @@ void repl(object* env) {
 
 void ulisperrcleanup() {
     // Come here after error
+    flushoutput();
     delay(100);
-    while (Serial.available()) Serial.read();
+    serialdiscard();
     clrflag(NOESC);
+    clrflag(RAWSERIAL);
     BreakLevel = 0;
+    ArgTop = 0;
+    EvalTop = 0;
+    StringStreamTop = 0;
     for (int i = 0; i < TRACEMAX; i++) TraceDepth[i] = 0;
 #if defined(sdcardsupport)
+    fileflush(SDpfile, &SDpbuffer);
     SDpfile.close();
     SDgfile.close();
 #endif
+#if defined(LITTLEFS)
+    fileflush(FSpfile, &FSpbuffer);
+    FSpfile.close();
+    FSgfile.close();
+#endif
+    kvflush();
 #if defined(lisplibrary)
     if (!tstflag(LIBRARYLOADED)) {
         setflag(LIBRARYLOADED);